@@ -9,6 +9,9 @@ int onDevicesChanged(AudioObjectID inObjectID,
                      const AudioObjectPropertyAddress *inAddresses,
                      void *inClientData);
 
+// Stands for kOutputDeviceAutoBufferFrameSize in the buffer size combo box
+static NSString *const kAutomaticBufferFrameSizeItem = @"Automatic";
+
 @implementation WindowDelegate {
     std::vector<AudioDeviceID> currentDeviceList;
     int initializationAttemptInterval;
@@ -224,6 +227,10 @@ int onDevicesChanged(AudioObjectID inObjectID,
     AudioDeviceID proxyAudioBox = AudioDevice::audioDeviceIDForBoxUID(CFSTR(kBox_UID));
     AudioDevice::setIdentifyValue(proxyAudioBox, -((SInt32)ProxyAudioDevice::ConfigType::outputDeviceBufferFrameSize));
     NSString *result = (__bridge_transfer NSString *)AudioDevice::copyObjectName(proxyAudioBox);
+
+    if ([result isEqualToString:[NSString stringWithFormat:@"%d", kOutputDeviceAutoBufferFrameSize]]) {
+        return kAutomaticBufferFrameSizeItem;
+    }
     
     return result ? result : @"";
 }
@@ -237,6 +244,10 @@ int onDevicesChanged(AudioObjectID inObjectID,
         return;
     }
 
+    if ([newBufferFrameSizeString isEqualToString:kAutomaticBufferFrameSizeItem]) {
+        newBufferFrameSizeString = [NSString stringWithFormat:@"%d", kOutputDeviceAutoBufferFrameSize];
+    }
+
     AudioDeviceID proxyAudioBox = AudioDevice::audioDeviceIDForBoxUID(CFSTR(kBox_UID));
     AudioDevice::setObjectName(
         proxyAudioBox,
@@ -0,0 +1,87 @@
+#ifndef __Benchmark_h__
+#define __Benchmark_h__
+
+#include <MacTypes.h>
+#include <mach/mach_time.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Just enough of a harness to time the real-time core's inner loops. Each case is run in batches until it has
+// taken long enough to measure, and the fastest batch is reported, as that's the one least disturbed by whatever
+// else the machine was doing.
+//
+// Passing --quick on the command line runs every case only briefly, which is what ctest does to check the
+// benchmarks still build and run.
+class Benchmark {
+  public:
+    Benchmark(int argc, const char *const *argv) : mBatchNanoseconds(20000000), mBatches(5) {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        mTicksToNanoseconds = Float64(timebase.numer) / Float64(timebase.denom);
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--quick") == 0) {
+                mBatchNanoseconds = 200000;
+                mBatches = 1;
+            }
+        }
+    }
+
+    // Prints a heading for the cases that follow
+    void Section(const char *title) const { printf("\n%s\n", title); }
+
+    // Times operation(), which should do work items of work each call, and prints the nanoseconds it took per call
+    // and per item
+    template <typename Operation> Float64 Run(const char *name, UInt64 items, Operation &&operation) const {
+        // Find how many calls make a batch long enough to time, warming up caches on the way
+        UInt64 calls = 1;
+
+        while (true) {
+            Float64 nanoseconds = TimeCalls(calls, operation);
+
+            if (nanoseconds >= mBatchNanoseconds / 10 || calls >= (1ULL << 40)) {
+                calls = std::max<UInt64>(1, UInt64(calls * (mBatchNanoseconds / std::max(nanoseconds, 1.0))));
+                break;
+            }
+
+            calls *= 10;
+        }
+
+        Float64 best = 0;
+
+        for (UInt32 batch = 0; batch < mBatches; batch++) {
+            Float64 nanosecondsPerCall = TimeCalls(calls, operation) / Float64(calls);
+            best = batch == 0 ? nanosecondsPerCall : std::min(best, nanosecondsPerCall);
+        }
+
+        printf("  %-48s %12.1f ns/call %10.3f ns/item\n", name, best, best / Float64(std::max<UInt64>(items, 1)));
+        fflush(stdout);
+
+        return best;
+    }
+
+  private:
+    template <typename Operation> Float64 TimeCalls(UInt64 calls, Operation &operation) const {
+        UInt64 start = mach_absolute_time();
+
+        for (UInt64 call = 0; call < calls; call++) {
+            operation();
+        }
+
+        return Float64(mach_absolute_time() - start) * mTicksToNanoseconds;
+    }
+
+    Float64 mTicksToNanoseconds;
+    Float64 mBatchNanoseconds;
+    UInt32 mBatches;
+};
+
+// Keeps the compiler from optimising away work whose result is otherwise unused
+template <typename T> inline void KeepResult(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#endif // __Benchmark_h__
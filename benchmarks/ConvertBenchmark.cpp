@@ -0,0 +1,64 @@
+// Times AudioMixKernels::ConvertToInteger, which writes the mixed output to the output device's buffers when it's
+// driven with an integer format, for each of those formats with and without dither, for stereo buffers of 64 to
+// 4096 frames. Each is timed with the scalar kernel the driver starts out with, then with whichever vector kernel
+// Initialize picks for this CPU.
+
+#include "AudioMixKernels.h"
+#include "Benchmark.h"
+
+#include <vector>
+
+struct Layout {
+    AudioMixKernels::IntegerFormat format;
+    const char *name;
+};
+
+static const Layout kLayouts[] = {
+    {{2, 16, false, false}, "16 bit"},
+    {{3, 24, false, false}, "24 bit packed"},
+    {{4, 24, true, false}, "24 bit in 32"},
+    {{4, 32, false, false}, "32 bit"},
+};
+
+static void BenchmarkLayouts(const Benchmark &benchmark, bool dither, const char *kernelName) {
+    char title[128];
+    snprintf(title, sizeof(title), "%s, %s", dither ? "dithered" : "undithered", kernelName);
+    benchmark.Section(title);
+
+    for (const Layout &layout : kLayouts) {
+        AudioMixKernels::IntegerFormat format = layout.format;
+        format.dither = dither;
+
+        for (UInt32 frameCount = 64; frameCount <= 4096; frameCount *= 8) {
+            UInt32 sampleCount = frameCount * 2;
+            std::vector<Float32> in(sampleCount);
+            std::vector<Byte> out(sampleCount * format.bytesPerSample);
+            UInt32 ditherState[4] = {1, 2, 3, 4};
+
+            for (UInt32 i = 0; i < sampleCount; i++) {
+                in[i] = 0.9f * Float32(i % 200) / 100.0f - 0.9f;
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "%s, %u frames", layout.name, frameCount);
+            benchmark.Run(name, sampleCount, [&] {
+                AudioMixKernels::ConvertToInteger(in.data(), out.data(), sampleCount, format, ditherState);
+                KeepResult(out[0]);
+            });
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    Benchmark benchmark(argc, argv);
+
+    BenchmarkLayouts(benchmark, false, AudioMixKernels::Name());
+    BenchmarkLayouts(benchmark, true, AudioMixKernels::Name());
+
+    AudioMixKernels::Initialize();
+
+    BenchmarkLayouts(benchmark, false, AudioMixKernels::Name());
+    BenchmarkLayouts(benchmark, true, AudioMixKernels::Name());
+
+    return 0;
+}
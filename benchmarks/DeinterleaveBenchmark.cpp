@@ -0,0 +1,80 @@
+// Times mixing interleaved input into an output device with one mono buffer per channel, for 2-, 8- and 32-buffer
+// layouts from 16 to 4096 frames: AudioMixKernels::DeinterleaveAccumulate on its own, then the whole of
+// AudioMixer::Mix for the nonInterleaved layout, which is what the output IO proc calls. Each is timed with the
+// scalar kernel the driver starts out with, then with whichever vector kernel Initialize picks for this CPU.
+
+#include "AudioMixKernels.h"
+#include "AudioMixer.h"
+#include "Benchmark.h"
+
+#include <cstddef>
+#include <vector>
+
+static void BenchmarkBuffers(const Benchmark &benchmark, UInt32 channelCount, const char *kernelName) {
+    char title[128];
+    snprintf(title, sizeof(title), "%u mono buffers, %s", channelCount, kernelName);
+    benchmark.Section(title);
+
+    std::vector<Float32> gains(channelCount);
+
+    for (UInt32 channel = 0; channel < channelCount; channel++) {
+        gains[channel] = 0.25f + 0.5f * Float32(channel) / Float32(channelCount);
+    }
+
+    AudioMixGains mixGains;
+    mixGains.Set(gains.data(), channelCount);
+
+    AudioMixer mixer;
+    mixer.Configure(channelCount, std::vector<UInt32>(), std::vector<UInt32>(channelCount, 1));
+
+    if (mixer.GetLayout() != AudioMixer::Layout::nonInterleaved) {
+        fprintf(stderr, "AudioMixer didn't pick the nonInterleaved layout for %u mono buffers\n", channelCount);
+    }
+
+    for (UInt32 frameCount = 16; frameCount <= 4096; frameCount *= 4) {
+        UInt32 sampleCount = frameCount * channelCount;
+        std::vector<Float32> in(sampleCount, 0.5f), out(sampleCount, 0.0f);
+        std::vector<Float32 *> outs(channelCount);
+        // The output device's buffers, one per channel, as the HAL would hand them to the IO proc
+        std::vector<Byte> bufferListStorage(offsetof(AudioBufferList, mBuffers) + channelCount * sizeof(AudioBuffer));
+        AudioBufferList *bufferList = reinterpret_cast<AudioBufferList *>(bufferListStorage.data());
+        bufferList->mNumberBuffers = channelCount;
+
+        for (UInt32 channel = 0; channel < channelCount; channel++) {
+            outs[channel] = out.data() + channel * frameCount;
+            bufferList->mBuffers[channel].mNumberChannels = 1;
+            bufferList->mBuffers[channel].mDataByteSize = UInt32(frameCount * sizeof(Float32));
+            bufferList->mBuffers[channel].mData = outs[channel];
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "kernel, %u frames", frameCount);
+        benchmark.Run(name, sampleCount, [&] {
+            AudioMixKernels::DeinterleaveAccumulate(in.data(), channelCount, outs.data(), gains.data(), frameCount);
+            KeepResult(out[0]);
+        });
+
+        snprintf(name, sizeof(name), "mixer, %u frames", frameCount);
+        benchmark.Run(name, sampleCount, [&] {
+            mixer.Mix(in.data(), 0, frameCount, mixGains, bufferList);
+            KeepResult(out[0]);
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    Benchmark benchmark(argc, argv);
+    const UInt32 channelCounts[] = {2, 8, 32};
+
+    for (UInt32 channelCount : channelCounts) {
+        BenchmarkBuffers(benchmark, channelCount, AudioMixKernels::Name());
+    }
+
+    AudioMixKernels::Initialize();
+
+    for (UInt32 channelCount : channelCounts) {
+        BenchmarkBuffers(benchmark, channelCount, AudioMixKernels::Name());
+    }
+
+    return 0;
+}
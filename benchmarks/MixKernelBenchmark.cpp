@@ -0,0 +1,52 @@
+// Times AudioMixKernels::AccumulateScaled, the mix loop of the output IO proc, for interleaved stereo and
+// N-channel buffers from 16 to 4096 frames. Each size is timed with the scalar kernel the driver starts out with,
+// then with whichever vector kernel Initialize picks for this CPU.
+
+#include "AudioMixKernels.h"
+#include "Benchmark.h"
+
+#include <vector>
+
+static void BenchmarkChannels(const Benchmark &benchmark, UInt32 channelCount, const char *kernelName) {
+    char title[128];
+    snprintf(title, sizeof(title), "%u channels, %s", channelCount, kernelName);
+    benchmark.Section(title);
+
+    std::vector<Float32> gains(channelCount);
+
+    for (UInt32 channel = 0; channel < channelCount; channel++) {
+        gains[channel] = 0.25f + 0.5f * Float32(channel) / Float32(channelCount);
+    }
+
+    std::vector<Float32> pattern(channelCount * AudioMixKernels::kGainPatternGranularity);
+    UInt32 patternLength = AudioMixKernels::MakeGainPattern(gains.data(), channelCount, pattern.data());
+
+    for (UInt32 frameCount = 16; frameCount <= 4096; frameCount *= 2) {
+        UInt32 sampleCount = frameCount * channelCount;
+        std::vector<Float32> in(sampleCount, 0.5f), out(sampleCount, 0.0f);
+        char name[64];
+        snprintf(name, sizeof(name), "%u frames", frameCount);
+
+        benchmark.Run(name, sampleCount, [&] {
+            AudioMixKernels::AccumulateScaled(in.data(), out.data(), sampleCount, pattern.data(), patternLength);
+            KeepResult(out[0]);
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    Benchmark benchmark(argc, argv);
+    const UInt32 channelCounts[] = {2, 6, 8};
+
+    for (UInt32 channelCount : channelCounts) {
+        BenchmarkChannels(benchmark, channelCount, AudioMixKernels::Name());
+    }
+
+    AudioMixKernels::Initialize();
+
+    for (UInt32 channelCount : channelCounts) {
+        BenchmarkChannels(benchmark, channelCount, AudioMixKernels::Name());
+    }
+
+    return 0;
+}
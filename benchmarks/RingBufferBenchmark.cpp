@@ -0,0 +1,157 @@
+// Times AudioRingBuffer's Store, Fetch and Read across frame sizes and capacities: the steady state, stores and
+// fetches that wrap around the end of the ring, stores that skip ahead and have to zero the gap, Clear, and
+// fetches that run off either end of the valid range. It also compares the ring's mask-based frame offsets with
+// the modulo arithmetic it used to do.
+
+#include "AudioRingBuffer.h"
+#include "Benchmark.h"
+
+#include <vector>
+
+static const UInt32 kChunkFrames = 512;
+
+// How the ring used to find a frame in its buffer, relative to the slot of its first valid frame, with a 32-bit
+// multiply and a division
+struct ModuloOffsets {
+    UInt32 mStartOffset;
+    SInt64 mStartFrame;
+    UInt32 mBytesPerFrame;
+    UInt32 mCapacityBytes;
+
+    UInt32 FrameOffset(SInt64 frameNumber) const {
+        return (mStartOffset + UInt32(frameNumber - mStartFrame) * mBytesPerFrame) % mCapacityBytes;
+    }
+};
+
+static void BenchmarkFrameOffsets(const Benchmark &benchmark, UInt32 bytesPerFrame, UInt32 capacityFrames) {
+    char title[128];
+    snprintf(title,
+             sizeof(title),
+             "Frame offsets, %u bytes per frame, %u frame capacity",
+             bytesPerFrame,
+             capacityFrames);
+    benchmark.Section(title);
+
+    AudioRingBuffer ring(bytesPerFrame, capacityFrames);
+    ModuloOffsets modulo = {0, 0, bytesPerFrame, ring.mCapacityFrames * bytesPerFrame};
+    // Frame numbers a day's worth of 48 kHz audio in, in the uneven steps a Store and Fetch pair takes
+    SInt64 frames[kChunkFrames];
+
+    for (UInt32 i = 0; i < kChunkFrames; i++) {
+        frames[i] = 48000LL * 86400 + SInt64(i) * 509;
+    }
+
+    benchmark.Run("Modulo", kChunkFrames, [&] {
+        UInt64 sum = 0;
+
+        for (UInt32 i = 0; i < kChunkFrames; i++) {
+            sum += modulo.FrameOffset(frames[i]);
+        }
+
+        KeepResult(sum);
+    });
+
+    benchmark.Run("Mask", kChunkFrames, [&] {
+        UInt64 sum = 0;
+
+        for (UInt32 i = 0; i < kChunkFrames; i++) {
+            sum += ring.FrameOffset(frames[i]);
+        }
+
+        KeepResult(sum);
+    });
+}
+
+static void BenchmarkRing(const Benchmark &benchmark, UInt32 bytesPerFrame, UInt32 capacityFrames) {
+    char title[128];
+    snprintf(title, sizeof(title), "%u bytes per frame, %u frame capacity", bytesPerFrame, capacityFrames);
+    benchmark.Section(title);
+
+    AudioRingBuffer ring(bytesPerFrame, capacityFrames);
+    std::vector<Byte> chunk(kChunkFrames * bytesPerFrame, 1);
+    std::vector<Byte> out(kChunkFrames * bytesPerFrame);
+    SInt64 capacity = ring.mCapacityFrames;
+    SInt64 frame = 0;
+
+    // Steady state: store a chunk, fetch the chunk stored half the ring earlier
+    benchmark.Run("Store + Fetch, sequential", kChunkFrames, [&] {
+        ring.Store(chunk.data(), kChunkFrames, frame);
+        KeepResult(ring.Fetch(out.data(), kChunkFrames, frame - capacity / 2));
+        frame += kChunkFrames;
+    });
+
+    benchmark.Run("Store + Read, sequential", kChunkFrames, [&] {
+        ring.Store(chunk.data(), kChunkFrames, frame);
+        KeepResult(ring.Read(kChunkFrames, frame - capacity / 2, [&](const Byte *span, UInt32, UInt32 spanFrames) {
+            KeepResult(span[spanFrames * bytesPerFrame - 1]);
+        }));
+        frame += kChunkFrames;
+    });
+
+    // Every store and fetch straddles the end of the ring, so is split into two copies
+    SInt64 straddling = (frame / capacity + 2) * capacity - kChunkFrames / 2;
+
+    for (SInt64 fill = straddling - capacity + kChunkFrames; fill <= straddling; fill += kChunkFrames) {
+        ring.Store(chunk.data(), kChunkFrames, fill);
+    }
+
+    benchmark.Run("Store, wrapping around", kChunkFrames, [&] {
+        ring.Store(chunk.data(), kChunkFrames, straddling);
+    });
+
+    benchmark.Run("Fetch, wrapping around", kChunkFrames, [&] {
+        KeepResult(ring.Fetch(out.data(), kChunkFrames, straddling));
+    });
+
+    // Each store skips a chunk, which has to be zeroed
+    frame = straddling + kChunkFrames;
+
+    benchmark.Run("Store, skipping a chunk", kChunkFrames, [&] {
+        frame += kChunkFrames;
+        ring.Store(chunk.data(), kChunkFrames, frame);
+        frame += kChunkFrames;
+    });
+
+    benchmark.Run("Clear + Store", kChunkFrames, [&] {
+        ring.Clear();
+        ring.Store(chunk.data(), kChunkFrames, frame);
+        frame += kChunkFrames;
+    });
+
+    // Fill the ring again so the fetches below find a full valid range to fall off the ends of
+    for (SInt64 end = frame + capacity; frame < end; frame += kChunkFrames) {
+        ring.Store(chunk.data(), kChunkFrames, frame);
+    }
+
+    benchmark.Run("Fetch, half before the valid range", kChunkFrames, [&] {
+        KeepResult(ring.Fetch(out.data(), kChunkFrames, ring.StartFrame() - kChunkFrames / 2));
+    });
+
+    benchmark.Run("Fetch, half after the valid range", kChunkFrames, [&] {
+        KeepResult(ring.Fetch(out.data(), kChunkFrames, ring.EndFrame() - kChunkFrames / 2));
+    });
+
+    benchmark.Run("Fetch, all before the valid range", kChunkFrames, [&] {
+        KeepResult(ring.Fetch(out.data(), kChunkFrames, ring.StartFrame() - kChunkFrames));
+    });
+}
+
+int main(int argc, char **argv) {
+    Benchmark benchmark(argc, argv);
+
+    // Mono, stereo and 16 channel float frames
+    const UInt32 bytesPerFrame[] = {4, 8, 64};
+    const UInt32 capacityFrames[] = {2048, 16384, 131072};
+
+    for (UInt32 frameSize : bytesPerFrame) {
+        for (UInt32 capacity : capacityFrames) {
+            BenchmarkRing(benchmark, frameSize, capacity);
+        }
+    }
+
+    for (UInt32 frameSize : bytesPerFrame) {
+        BenchmarkFrameOffsets(benchmark, frameSize, capacityFrames[1]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Compares reading the IO proc's shared state through a SeqLock with reading it under a mutex, the way
+// getZeroTimestampMutex used to share it. A reader thread, standing in for an IO thread, reads a State the size of
+// ZeroTimeStampClock's, once uncontended and once with a writer thread storing as fast as it can. For each, the
+// mean time per read is reported along with the tail, which is what matters on a real-time thread: a mutex reader
+// can be held up for as long as the writer is preempted while holding the lock.
+
+#include "Benchmark.h"
+#include "SeqLock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct State {
+    UInt64 anchorHostTime;
+    Float64 elapsedTicks;
+    UInt64 numberTimeStamps;
+    Float64 loopSampleTime;
+    Float64 loopHostTime;
+    Float64 loopHostTicksPerFrame;
+    UInt64 lastOutputTimeStampCount;
+};
+
+class MutexState {
+  public:
+    MutexState() : mValue() {}
+
+    void Store(const State &value) {
+        std::lock_guard<std::mutex> locker(mMutex);
+        mValue = value;
+    }
+
+    bool TryLoad(State &outValue) {
+        std::lock_guard<std::mutex> locker(mMutex);
+        outValue = mValue;
+        return true;
+    }
+
+  private:
+    std::mutex mMutex;
+    State mValue;
+};
+
+class SeqLockState {
+  public:
+    void Store(const State &value) { mValue.Store(value); }
+    bool TryLoad(State &outValue) { return mValue.TryLoad(outValue); }
+
+  private:
+    SeqLock<State> mValue;
+};
+
+template <typename Shared> static void BenchmarkReads(const char *name, bool contended, UInt32 reads) {
+    Shared shared;
+    std::atomic<bool> done(false);
+    std::thread writer;
+
+    if (contended) {
+        writer = std::thread([&] {
+            State state = State();
+
+            while (!done.load(std::memory_order_relaxed)) {
+                state.numberTimeStamps++;
+                state.elapsedTicks += 1.0;
+                shared.Store(state);
+            }
+        });
+    }
+
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    std::vector<UInt64> ticks(reads);
+    UInt32 failedReads = 0;
+    // Every read can fail under contention, leaving this as it started
+    State state = State();
+
+    for (UInt32 read = 0; read < reads; read++) {
+        UInt64 start = mach_absolute_time();
+        failedReads += !shared.TryLoad(state);
+        ticks[read] = mach_absolute_time() - start;
+    }
+
+    KeepResult(state.numberTimeStamps);
+    done.store(true);
+
+    if (writer.joinable()) {
+        writer.join();
+    }
+
+    std::sort(ticks.begin(), ticks.end());
+    Float64 ticksToNanoseconds = Float64(timebase.numer) / Float64(timebase.denom);
+    Float64 totalTicks = 0;
+
+    for (UInt64 tick : ticks) {
+        totalTicks += Float64(tick);
+    }
+
+    printf("  %-24s %-12s mean %8.1f ns   99.9%% %10.1f ns   max %12.1f ns   failed reads %u\n",
+           name,
+           contended ? "contended" : "uncontended",
+           totalTicks / reads * ticksToNanoseconds,
+           Float64(ticks[size_t(reads * 0.999)]) * ticksToNanoseconds,
+           Float64(ticks.back()) * ticksToNanoseconds,
+           failedReads);
+}
+
+int main(int argc, char **argv) {
+    bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+    UInt32 reads = quick ? 10000 : 5000000;
+
+    printf("Reads of a %zu byte state, including about one clock read of overhead each\n", sizeof(State));
+
+    for (bool contended : {false, true}) {
+        BenchmarkReads<MutexState>("mutex", contended, reads);
+        BenchmarkReads<SeqLockState>("SeqLock", contended, reads);
+    }
+
+    return 0;
+}
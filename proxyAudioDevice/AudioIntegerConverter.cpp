@@ -0,0 +1,117 @@
+#include "AudioIntegerConverter.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "debugHelpers.h"
+
+AudioIntegerConverter::AudioIntegerConverter()
+    : mActive(false), mWired(false), mFormat{4, 32, false, false}, mMaxFrames(0) {
+    // Any seeds will do as long as none of them is zero, which xorshift never leaves
+    mDitherState[0] = 0x9e3779b9;
+    mDitherState[1] = 0x7f4a7c15;
+    mDitherState[2] = 0x85ebca6b;
+    mDitherState[3] = 0xc2b2ae35;
+}
+
+void AudioIntegerConverter::Configure(const AudioStreamBasicDescription &format,
+                                      bool dither,
+                                      const std::vector<UInt32> &bufferChannelCounts,
+                                      UInt32 maxFrames) {
+    UInt32 channelsPerBuffer = (format.mFormatFlags & kAudioFormatFlagIsNonInterleaved) ? 1 : format.mChannelsPerFrame;
+
+    if (channelsPerBuffer == 0 || bufferChannelCounts.empty()) {
+        Disable();
+        return;
+    }
+
+    mFormat.bytesPerSample = format.mBytesPerFrame / channelsPerBuffer;
+    mFormat.validBits = format.mBitsPerChannel;
+    mFormat.alignedHigh = (format.mFormatFlags & kAudioFormatFlagIsAlignedHigh) != 0;
+    mFormat.dither = dither;
+    mMaxFrames = maxFrames;
+    mBufferChannelCounts = bufferChannelCounts;
+
+    UInt32 channelCount = 0;
+
+    for (UInt32 count : bufferChannelCounts) {
+        channelCount += count;
+    }
+
+    // Allocated and filled here rather than on the IO thread
+    bool wired = mWired;
+    SetWired(false);
+    mSamples.assign(size_t(maxFrames) * channelCount, 0.0f);
+    mBufferListStorage.assign(offsetof(AudioBufferList, mBuffers) + bufferChannelCounts.size() * sizeof(AudioBuffer),
+                              0);
+    SetWired(wired);
+
+    AudioBufferList *bufferList = reinterpret_cast<AudioBufferList *>(mBufferListStorage.data());
+    bufferList->mNumberBuffers = UInt32(bufferChannelCounts.size());
+    Float32 *samples = mSamples.data();
+
+    for (size_t i = 0; i < bufferChannelCounts.size(); i++) {
+        bufferList->mBuffers[i].mNumberChannels = bufferChannelCounts[i];
+        bufferList->mBuffers[i].mData = samples;
+        bufferList->mBuffers[i].mDataByteSize = 0;
+        samples += size_t(maxFrames) * bufferChannelCounts[i];
+    }
+
+    mActive = true;
+
+    DebugMsg("ProxyAudio: AudioIntegerConverter converting to %u bits in %u bytes%s%s",
+             mFormat.validBits,
+             mFormat.bytesPerSample,
+             mFormat.alignedHigh ? ", aligned high" : "",
+             dither ? ", with dither" : "");
+}
+
+void AudioIntegerConverter::Disable() {
+    mActive = false;
+}
+
+bool AudioIntegerConverter::SetWired(bool wired) {
+    if (!wired) {
+        UnwireVector(mSamples);
+        UnwireVector(mBufferListStorage);
+        mWired = false;
+        return true;
+    }
+
+    mWired = true;
+    return WireVector(mSamples) && WireVector(mBufferListStorage);
+}
+
+AudioBufferList *AudioIntegerConverter::MixBuffers(UInt32 frameCount) {
+    AudioBufferList *bufferList = reinterpret_cast<AudioBufferList *>(mBufferListStorage.data());
+    frameCount = std::min(frameCount, mMaxFrames);
+
+    for (UInt32 i = 0; i < bufferList->mNumberBuffers; i++) {
+        AudioBuffer &buffer = bufferList->mBuffers[i];
+        buffer.mDataByteSize = UInt32(frameCount * buffer.mNumberChannels * sizeof(Float32));
+        memset(buffer.mData, 0, buffer.mDataByteSize);
+    }
+
+    return bufferList;
+}
+
+void AudioIntegerConverter::Convert(AudioBufferList *outOutputData, UInt32 frameCount) {
+    const AudioBufferList *bufferList = reinterpret_cast<const AudioBufferList *>(mBufferListStorage.data());
+    UInt32 bufferCount = std::min(outOutputData->mNumberBuffers, bufferList->mNumberBuffers);
+    frameCount = std::min(frameCount, mMaxFrames);
+
+    for (UInt32 i = 0; i < bufferCount; i++) {
+        const AudioBuffer &mixed = bufferList->mBuffers[i];
+        AudioBuffer &output = outOutputData->mBuffers[i];
+
+        if (!output.mData || output.mNumberChannels != mixed.mNumberChannels) {
+            continue;
+        }
+
+        UInt32 sampleCount =
+            std::min(frameCount * mixed.mNumberChannels, output.mDataByteSize / mFormat.bytesPerSample);
+        AudioMixKernels::ConvertToInteger(
+            static_cast<const Float32 *>(mixed.mData), output.mData, sampleCount, mFormat, mDitherState);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef __AudioIntegerConverter_h__
+#define __AudioIntegerConverter_h__
+
+#include <CoreAudio/CoreAudioTypes.h>
+#include <vector>
+
+#include "AudioMixKernels.h"
+#include "RealTimeMemory.h"
+
+// Lets the output device be driven with an integer format, which saves the HAL converting our floats itself. The
+// mixer only works in floats, so while conversion is active it mixes into scratch buffers laid out like the output
+// device's, and Convert then writes them out to the device's buffers with AudioMixKernels::ConvertToInteger.
+class AudioIntegerConverter {
+  public:
+    AudioIntegerConverter();
+
+    // Not thread safe: only call these while the output device's IO proc isn't running. format is the output
+    // device's virtual format, as AudioDevice::setIntegerVirtualFormat returned it, and bufferChannelCounts the
+    // channel count of each of its buffers.
+    void Configure(const AudioStreamBasicDescription &format,
+                   bool dither,
+                   const std::vector<UInt32> &bufferChannelCounts,
+                   UInt32 maxFrames);
+    void Disable();
+    bool IsActive() const { return mActive; }
+    // The size of a sample in the output device's buffers
+    UInt32 BytesPerSample() const { return mFormat.bytesPerSample; }
+    // Locks the scratch buffers into memory while wired, including after Configure replaces them. Not thread safe,
+    // like Configure. Returns false if locking them failed.
+    bool SetWired(bool wired);
+
+    // Silences the first frameCount frames of the scratch buffers and returns them to be mixed into
+    AudioBufferList *MixBuffers(UInt32 frameCount);
+    // Converts what was mixed into MixBuffers(frameCount) into outOutputData, which has the layout Configure was
+    // given
+    void Convert(AudioBufferList *outOutputData, UInt32 frameCount);
+
+  private:
+    bool mActive;
+    bool mWired;
+    AudioMixKernels::IntegerFormat mFormat;
+    UInt32 mMaxFrames;
+    std::vector<UInt32> mBufferChannelCounts;
+    RealTimeVector<Float32> mSamples;
+    // Backs the AudioBufferList MixBuffers hands out, which has one AudioBuffer per output device buffer
+    RealTimeVector<Byte> mBufferListStorage;
+    UInt32 mDitherState[4];
+};
+
+#endif // __AudioIntegerConverter_h__
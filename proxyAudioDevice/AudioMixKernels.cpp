@@ -0,0 +1,594 @@
+#include "AudioMixKernels.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#elif defined(__arm64__) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "debugHelpers.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Finishes off whatever the vector loops leave over, continuing from gain pattern index g
+static inline void AccumulateScaledTail(const Float32 *in,
+                                        Float32 *out,
+                                        UInt32 i,
+                                        UInt32 sampleCount,
+                                        const Float32 *gainPattern,
+                                        UInt32 patternLength,
+                                        UInt32 g) {
+    for (; i < sampleCount; i++) {
+        out[i] += in[i] * gainPattern[g];
+
+        if (++g == patternLength) {
+            g = 0;
+        }
+    }
+}
+
+static void AccumulateScaledScalar(const Float32 *in,
+                                   Float32 *out,
+                                   UInt32 sampleCount,
+                                   const Float32 *gainPattern,
+                                   UInt32 patternLength) {
+    AccumulateScaledTail(in, out, 0, sampleCount, gainPattern, patternLength, 0);
+}
+
+// Deinterleaves channels firstChannel up to endChannel, from frame firstFrame onwards, one channel at a time
+static inline void DeinterleaveAccumulateTail(const Float32 *in,
+                                              UInt32 channelCount,
+                                              UInt32 firstChannel,
+                                              UInt32 endChannel,
+                                              Float32 *const *outs,
+                                              const Float32 *gains,
+                                              UInt32 firstFrame,
+                                              UInt32 frameCount) {
+    for (UInt32 channel = firstChannel; channel < endChannel; channel++) {
+        const Float32 *x = in + channel;
+        Float32 *out = outs[channel];
+        Float32 gain = gains[channel];
+
+        for (UInt32 frame = firstFrame; frame < frameCount; frame++) {
+            out[frame] += x[frame * channelCount] * gain;
+        }
+    }
+}
+
+static void DeinterleaveAccumulateScalar(const Float32 *in,
+                                         UInt32 channelCount,
+                                         Float32 *const *outs,
+                                         const Float32 *gains,
+                                         UInt32 frameCount) {
+    DeinterleaveAccumulateTail(in, channelCount, 0, channelCount, outs, gains, 0, frameCount);
+}
+
+// What ConvertToInteger needs to know about the format, worked out once per call
+struct QuantizeParameters {
+    // Takes [-1, 1) to the integer range
+    Float32 scale;
+    Float32 minimum;
+    Float32 maximum;
+    // Moves the valid bits to the top of the sample for aligned high formats
+    UInt32 shift;
+};
+
+static QuantizeParameters MakeQuantizeParameters(const AudioMixKernels::IntegerFormat &format) {
+    QuantizeParameters parameters;
+    parameters.scale = ldexpf(1.0f, int(format.validBits) - 1);
+    parameters.minimum = -parameters.scale;
+    // Past 24 bits scale - 1 rounds back up to scale, which overflows when converted, so take the largest float
+    // below scale instead
+    parameters.maximum =
+        format.validBits <= 24 ? parameters.scale - 1.0f : parameters.scale * (1.0f - 1.0f / 16777216.0f);
+    parameters.shift = format.alignedHigh ? format.bytesPerSample * 8 - format.validBits : 0;
+    return parameters;
+}
+
+// xorshift32, which is random enough for dither and vectorizes with nothing but shifts
+static inline UInt32 NextRandom(UInt32 &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// The difference of two uniform values in [0, 1) is triangular over (-1, 1). Sixteen bits of resolution is plenty,
+// so both come from the halves of one random word.
+static inline Float32 TriangularDither(UInt32 &state) {
+    UInt32 random = NextRandom(state);
+    return (Float32(random >> 16) - Float32(random & 0xffff)) * (1.0f / 65536.0f);
+}
+
+template <bool kDither>
+static inline SInt32 QuantizeScalar(Float32 x, const QuantizeParameters &parameters, UInt32 &ditherState) {
+    Float32 y = x * parameters.scale;
+
+    if (kDither) {
+        y += TriangularDither(ditherState);
+    }
+
+    // NaNs come out as silence, as they do in the vector versions. lrintf rounds to nearest, like the vector
+    // conversions.
+    if (y != y) {
+        y = 0.0f;
+    }
+
+    y = std::min(parameters.maximum, std::max(parameters.minimum, y));
+    return SInt32(UInt32(SInt32(lrintf(y))) << parameters.shift);
+}
+
+template <UInt32 kBytes> static inline void StoreSample(void *out, UInt32 index, SInt32 value);
+
+template <> inline void StoreSample<2>(void *out, UInt32 index, SInt32 value) {
+    static_cast<SInt16 *>(out)[index] = SInt16(value);
+}
+
+// Both of the architectures we build for are little endian
+template <> inline void StoreSample<3>(void *out, UInt32 index, SInt32 value) {
+    Byte *sample = static_cast<Byte *>(out) + index * 3;
+    sample[0] = Byte(value);
+    sample[1] = Byte(value >> 8);
+    sample[2] = Byte(value >> 16);
+}
+
+template <> inline void StoreSample<4>(void *out, UInt32 index, SInt32 value) {
+    static_cast<SInt32 *>(out)[index] = value;
+}
+
+template <UInt32 kBytes, bool kDither>
+static inline void ConvertToIntegerTail(const Float32 *in,
+                                        void *out,
+                                        UInt32 i,
+                                        UInt32 sampleCount,
+                                        const QuantizeParameters &parameters,
+                                        UInt32 &ditherState) {
+    for (; i < sampleCount; i++) {
+        StoreSample<kBytes>(out, i, QuantizeScalar<kDither>(in[i], parameters, ditherState));
+    }
+}
+
+// Calls the instantiation of Kernel::Convert for format, so the loops don't have to branch on it
+template <typename Kernel>
+static void ConvertToIntegerWith(const Float32 *in,
+                                 void *out,
+                                 UInt32 sampleCount,
+                                 const AudioMixKernels::IntegerFormat &format,
+                                 UInt32 *ditherState) {
+    QuantizeParameters parameters = MakeQuantizeParameters(format);
+
+    switch (format.bytesPerSample) {
+    case 2:
+        format.dither ? Kernel::template Convert<2, true>(in, out, sampleCount, parameters, ditherState)
+                      : Kernel::template Convert<2, false>(in, out, sampleCount, parameters, ditherState);
+        break;
+    case 3:
+        format.dither ? Kernel::template Convert<3, true>(in, out, sampleCount, parameters, ditherState)
+                      : Kernel::template Convert<3, false>(in, out, sampleCount, parameters, ditherState);
+        break;
+    case 4:
+        format.dither ? Kernel::template Convert<4, true>(in, out, sampleCount, parameters, ditherState)
+                      : Kernel::template Convert<4, false>(in, out, sampleCount, parameters, ditherState);
+        break;
+    }
+}
+
+struct ScalarConversion {
+    template <UInt32 kBytes, bool kDither>
+    static void Convert(const Float32 *in,
+                        void *out,
+                        UInt32 sampleCount,
+                        const QuantizeParameters &parameters,
+                        UInt32 *ditherState) {
+        ConvertToIntegerTail<kBytes, kDither>(in, out, 0, sampleCount, parameters, ditherState[0]);
+    }
+};
+
+static void ConvertToIntegerScalar(const Float32 *in,
+                                   void *out,
+                                   UInt32 sampleCount,
+                                   const AudioMixKernels::IntegerFormat &format,
+                                   UInt32 *ditherState) {
+    ConvertToIntegerWith<ScalarConversion>(in, out, sampleCount, format, ditherState);
+}
+
+#if defined(__x86_64__)
+
+static void AccumulateScaledSSE2(const Float32 *in,
+                                 Float32 *out,
+                                 UInt32 sampleCount,
+                                 const Float32 *gainPattern,
+                                 UInt32 patternLength) {
+    UInt32 i = 0, g = 0;
+
+    for (; i + 8 <= sampleCount; i += 8) {
+        __m128 out0 =
+            _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), _mm_loadu_ps(gainPattern + g)));
+        __m128 out1 = _mm_add_ps(_mm_loadu_ps(out + i + 4),
+                                 _mm_mul_ps(_mm_loadu_ps(in + i + 4), _mm_loadu_ps(gainPattern + g + 4)));
+        _mm_storeu_ps(out + i, out0);
+        _mm_storeu_ps(out + i + 4, out1);
+
+        g += 8;
+        if (g == patternLength) {
+            g = 0;
+        }
+    }
+
+    AccumulateScaledTail(in, out, i, sampleCount, gainPattern, patternLength, g);
+}
+
+__attribute__((target("avx2"))) static void AccumulateScaledAVX2(const Float32 *in,
+                                                                 Float32 *out,
+                                                                 UInt32 sampleCount,
+                                                                 const Float32 *gainPattern,
+                                                                 UInt32 patternLength) {
+    UInt32 i = 0, g = 0;
+
+    for (; i + 8 <= sampleCount; i += 8) {
+        __m256 result = _mm256_add_ps(_mm256_loadu_ps(out + i),
+                                      _mm256_mul_ps(_mm256_loadu_ps(in + i), _mm256_loadu_ps(gainPattern + g)));
+        _mm256_storeu_ps(out + i, result);
+
+        g += 8;
+        if (g == patternLength) {
+            g = 0;
+        }
+    }
+
+    AccumulateScaledTail(in, out, i, sampleCount, gainPattern, patternLength, g);
+}
+
+// Every output is loaded just before it's stored, so channels sharing an output buffer still add up correctly
+static void DeinterleaveAccumulateSSE2(const Float32 *in,
+                                       UInt32 channelCount,
+                                       Float32 *const *outs,
+                                       const Float32 *gains,
+                                       UInt32 frameCount) {
+    UInt32 vectorFrames = frameCount & ~3u;
+
+    if (channelCount == 2) {
+        // Four stereo frames are two vectors, and one shuffle each pulls out the left and right channels
+        Float32 *outL = outs[0];
+        Float32 *outR = outs[1];
+        __m128 gainL = _mm_set1_ps(gains[0]);
+        __m128 gainR = _mm_set1_ps(gains[1]);
+
+        for (UInt32 frame = 0; frame < vectorFrames; frame += 4) {
+            __m128 a = _mm_loadu_ps(in + frame * 2);
+            __m128 b = _mm_loadu_ps(in + frame * 2 + 4);
+            __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+            _mm_storeu_ps(outL + frame, _mm_add_ps(_mm_loadu_ps(outL + frame), _mm_mul_ps(left, gainL)));
+            _mm_storeu_ps(outR + frame, _mm_add_ps(_mm_loadu_ps(outR + frame), _mm_mul_ps(right, gainR)));
+        }
+
+        DeinterleaveAccumulateTail(in, 2, 0, 2, outs, gains, vectorFrames, frameCount);
+        return;
+    }
+
+    // Otherwise take four channels at a time and transpose four frames of them into one vector per channel
+    UInt32 channel = 0;
+
+    for (; channel + 4 <= channelCount; channel += 4) {
+        const Float32 *x = in + channel;
+        Float32 *const *out = outs + channel;
+        __m128 gain0 = _mm_set1_ps(gains[channel]);
+        __m128 gain1 = _mm_set1_ps(gains[channel + 1]);
+        __m128 gain2 = _mm_set1_ps(gains[channel + 2]);
+        __m128 gain3 = _mm_set1_ps(gains[channel + 3]);
+
+        for (UInt32 frame = 0; frame < vectorFrames; frame += 4) {
+            __m128 row0 = _mm_loadu_ps(x + frame * channelCount);
+            __m128 row1 = _mm_loadu_ps(x + (frame + 1) * channelCount);
+            __m128 row2 = _mm_loadu_ps(x + (frame + 2) * channelCount);
+            __m128 row3 = _mm_loadu_ps(x + (frame + 3) * channelCount);
+            _MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+            _mm_storeu_ps(out[0] + frame, _mm_add_ps(_mm_loadu_ps(out[0] + frame), _mm_mul_ps(row0, gain0)));
+            _mm_storeu_ps(out[1] + frame, _mm_add_ps(_mm_loadu_ps(out[1] + frame), _mm_mul_ps(row1, gain1)));
+            _mm_storeu_ps(out[2] + frame, _mm_add_ps(_mm_loadu_ps(out[2] + frame), _mm_mul_ps(row2, gain2)));
+            _mm_storeu_ps(out[3] + frame, _mm_add_ps(_mm_loadu_ps(out[3] + frame), _mm_mul_ps(row3, gain3)));
+        }
+    }
+
+    DeinterleaveAccumulateTail(in, channelCount, 0, channel, outs, gains, vectorFrames, frameCount);
+    DeinterleaveAccumulateTail(in, channelCount, channel, channelCount, outs, gains, 0, frameCount);
+}
+
+// Each lane has its own xorshift state, and the states are saved back for the next call
+struct SSE2Conversion {
+    static inline __m128i NextRandom(__m128i state) {
+        state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+        state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+        return _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+    }
+
+    template <bool kDither>
+    static inline __m128i Quantize(__m128 x,
+                                   __m128 scale,
+                                   __m128 minimum,
+                                   __m128 maximum,
+                                   __m128i shift,
+                                   __m128i &random) {
+        __m128 y = _mm_mul_ps(x, scale);
+
+        if (kDither) {
+            random = NextRandom(random);
+            __m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(random, 16));
+            __m128 b = _mm_cvtepi32_ps(_mm_and_si128(random, _mm_set1_epi32(0xffff)));
+            y = _mm_add_ps(y, _mm_mul_ps(_mm_sub_ps(a, b), _mm_set1_ps(1.0f / 65536.0f)));
+        }
+
+        // NaNs come out as silence: the ordered compare masks them to zero, as the limits alone would take them to
+        // the minimum. cvtps rounds to nearest.
+        y = _mm_and_ps(y, _mm_cmpord_ps(y, y));
+        y = _mm_min_ps(_mm_max_ps(y, minimum), maximum);
+        return _mm_sll_epi32(_mm_cvtps_epi32(y), shift);
+    }
+
+    template <UInt32 kBytes, bool kDither>
+    static void Convert(const Float32 *in,
+                        void *out,
+                        UInt32 sampleCount,
+                        const QuantizeParameters &parameters,
+                        UInt32 *ditherState) {
+        __m128 scale = _mm_set1_ps(parameters.scale);
+        __m128 minimum = _mm_set1_ps(parameters.minimum);
+        __m128 maximum = _mm_set1_ps(parameters.maximum);
+        __m128i shift = _mm_cvtsi32_si128(int(parameters.shift));
+        __m128i random = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ditherState));
+        UInt32 i = 0;
+
+        for (; i + 8 <= sampleCount; i += 8) {
+            __m128i q0 = Quantize<kDither>(_mm_loadu_ps(in + i), scale, minimum, maximum, shift, random);
+            __m128i q1 = Quantize<kDither>(_mm_loadu_ps(in + i + 4), scale, minimum, maximum, shift, random);
+
+            if (kBytes == 2) {
+                // Already in range, so the saturation never kicks in
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(static_cast<SInt16 *>(out) + i), _mm_packs_epi32(q0, q1));
+            } else if (kBytes == 4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(static_cast<SInt32 *>(out) + i), q0);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(static_cast<SInt32 *>(out) + i + 4), q1);
+            } else {
+                // Packing to three bytes needs pshufb, which isn't in SSE2, so only the conversion is vectorized
+                SInt32 samples[8];
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(samples), q0);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(samples + 4), q1);
+
+                for (UInt32 j = 0; j < 8; j++) {
+                    StoreSample<kBytes>(out, i + j, samples[j]);
+                }
+            }
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ditherState), random);
+        ConvertToIntegerTail<kBytes, kDither>(in, out, i, sampleCount, parameters, ditherState[0]);
+    }
+};
+
+static void ConvertToIntegerSSE2(const Float32 *in,
+                                 void *out,
+                                 UInt32 sampleCount,
+                                 const AudioMixKernels::IntegerFormat &format,
+                                 UInt32 *ditherState) {
+    ConvertToIntegerWith<SSE2Conversion>(in, out, sampleCount, format, ditherState);
+}
+
+static bool CPUSupportsAVX2() {
+#if defined(__APPLE__)
+    int supported = 0;
+    size_t size = sizeof(supported);
+
+    if (sysctlbyname("hw.optional.avx2_0", &supported, &size, NULL, 0) != 0) {
+        return false;
+    }
+
+    return supported != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#elif defined(__arm64__) || defined(__aarch64__)
+
+static void AccumulateScaledNEON(const Float32 *in,
+                                 Float32 *out,
+                                 UInt32 sampleCount,
+                                 const Float32 *gainPattern,
+                                 UInt32 patternLength) {
+    UInt32 i = 0, g = 0;
+
+    for (; i + 8 <= sampleCount; i += 8) {
+        float32x4_t out0 = vaddq_f32(vld1q_f32(out + i), vmulq_f32(vld1q_f32(in + i), vld1q_f32(gainPattern + g)));
+        float32x4_t out1 =
+            vaddq_f32(vld1q_f32(out + i + 4), vmulq_f32(vld1q_f32(in + i + 4), vld1q_f32(gainPattern + g + 4)));
+        vst1q_f32(out + i, out0);
+        vst1q_f32(out + i + 4, out1);
+
+        g += 8;
+        if (g == patternLength) {
+            g = 0;
+        }
+    }
+
+    AccumulateScaledTail(in, out, i, sampleCount, gainPattern, patternLength, g);
+}
+
+// Laid out like the SSE2 version, which explains why this is safe with shared output buffers
+static void DeinterleaveAccumulateNEON(const Float32 *in,
+                                       UInt32 channelCount,
+                                       Float32 *const *outs,
+                                       const Float32 *gains,
+                                       UInt32 frameCount) {
+    UInt32 vectorFrames = frameCount & ~3u;
+
+    if (channelCount == 2) {
+        // vld2q does the deinterleaving for us
+        Float32 *outL = outs[0];
+        Float32 *outR = outs[1];
+
+        for (UInt32 frame = 0; frame < vectorFrames; frame += 4) {
+            float32x4x2_t frames = vld2q_f32(in + frame * 2);
+            vst1q_f32(outL + frame, vaddq_f32(vld1q_f32(outL + frame), vmulq_n_f32(frames.val[0], gains[0])));
+            vst1q_f32(outR + frame, vaddq_f32(vld1q_f32(outR + frame), vmulq_n_f32(frames.val[1], gains[1])));
+        }
+
+        DeinterleaveAccumulateTail(in, 2, 0, 2, outs, gains, vectorFrames, frameCount);
+        return;
+    }
+
+    // Otherwise take four channels at a time and transpose four frames of them into one vector per channel
+    UInt32 channel = 0;
+
+    for (; channel + 4 <= channelCount; channel += 4) {
+        const Float32 *x = in + channel;
+        Float32 *const *out = outs + channel;
+
+        for (UInt32 frame = 0; frame < vectorFrames; frame += 4) {
+            float32x4x2_t rows01 = vtrnq_f32(vld1q_f32(x + frame * channelCount),
+                                             vld1q_f32(x + (frame + 1) * channelCount));
+            float32x4x2_t rows23 = vtrnq_f32(vld1q_f32(x + (frame + 2) * channelCount),
+                                             vld1q_f32(x + (frame + 3) * channelCount));
+            float32x4_t column0 = vcombine_f32(vget_low_f32(rows01.val[0]), vget_low_f32(rows23.val[0]));
+            float32x4_t column1 = vcombine_f32(vget_low_f32(rows01.val[1]), vget_low_f32(rows23.val[1]));
+            float32x4_t column2 = vcombine_f32(vget_high_f32(rows01.val[0]), vget_high_f32(rows23.val[0]));
+            float32x4_t column3 = vcombine_f32(vget_high_f32(rows01.val[1]), vget_high_f32(rows23.val[1]));
+            vst1q_f32(out[0] + frame, vaddq_f32(vld1q_f32(out[0] + frame), vmulq_n_f32(column0, gains[channel])));
+            vst1q_f32(out[1] + frame,
+                      vaddq_f32(vld1q_f32(out[1] + frame), vmulq_n_f32(column1, gains[channel + 1])));
+            vst1q_f32(out[2] + frame,
+                      vaddq_f32(vld1q_f32(out[2] + frame), vmulq_n_f32(column2, gains[channel + 2])));
+            vst1q_f32(out[3] + frame,
+                      vaddq_f32(vld1q_f32(out[3] + frame), vmulq_n_f32(column3, gains[channel + 3])));
+        }
+    }
+
+    DeinterleaveAccumulateTail(in, channelCount, 0, channel, outs, gains, vectorFrames, frameCount);
+    DeinterleaveAccumulateTail(in, channelCount, channel, channelCount, outs, gains, 0, frameCount);
+}
+
+
+// Laid out like the SSE2 version
+struct NEONConversion {
+    static inline uint32x4_t NextRandom(uint32x4_t state) {
+        state = veorq_u32(state, vshlq_n_u32(state, 13));
+        state = veorq_u32(state, vshrq_n_u32(state, 17));
+        return veorq_u32(state, vshlq_n_u32(state, 5));
+    }
+
+    template <bool kDither>
+    static inline int32x4_t Quantize(float32x4_t x,
+                                     const QuantizeParameters &parameters,
+                                     int32x4_t shift,
+                                     uint32x4_t &random) {
+        float32x4_t y = vmulq_n_f32(x, parameters.scale);
+
+        if (kDither) {
+            random = NextRandom(random);
+            float32x4_t a = vcvtq_f32_u32(vshrq_n_u32(random, 16));
+            float32x4_t b = vcvtq_f32_u32(vandq_u32(random, vdupq_n_u32(0xffff)));
+            y = vmlaq_n_f32(y, vsubq_f32(a, b), 1.0f / 65536.0f);
+        }
+
+        // vmaxq and vminq pass NaNs through, and vcvtnq converts them to zero, so they come out as silence
+        y = vminq_f32(vmaxq_f32(y, vdupq_n_f32(parameters.minimum)), vdupq_n_f32(parameters.maximum));
+        return vshlq_s32(vcvtnq_s32_f32(y), shift);
+    }
+
+    template <UInt32 kBytes, bool kDither>
+    static void Convert(const Float32 *in,
+                        void *out,
+                        UInt32 sampleCount,
+                        const QuantizeParameters &parameters,
+                        UInt32 *ditherState) {
+        int32x4_t shift = vdupq_n_s32(int32_t(parameters.shift));
+        uint32x4_t random = vld1q_u32(ditherState);
+        UInt32 i = 0;
+
+        for (; i + 8 <= sampleCount; i += 8) {
+            int32x4_t q0 = Quantize<kDither>(vld1q_f32(in + i), parameters, shift, random);
+            int32x4_t q1 = Quantize<kDither>(vld1q_f32(in + i + 4), parameters, shift, random);
+
+            if (kBytes == 2) {
+                vst1q_s16(static_cast<int16_t *>(out) + i, vcombine_s16(vqmovn_s32(q0), vqmovn_s32(q1)));
+            } else if (kBytes == 4) {
+                vst1q_s32(static_cast<int32_t *>(out) + i, q0);
+                vst1q_s32(static_cast<int32_t *>(out) + i + 4, q1);
+            } else {
+                SInt32 samples[8];
+                vst1q_s32(samples, q0);
+                vst1q_s32(samples + 4, q1);
+
+                for (UInt32 j = 0; j < 8; j++) {
+                    StoreSample<kBytes>(out, i + j, samples[j]);
+                }
+            }
+        }
+
+        vst1q_u32(ditherState, random);
+        ConvertToIntegerTail<kBytes, kDither>(in, out, i, sampleCount, parameters, ditherState[0]);
+    }
+};
+
+static void ConvertToIntegerNEON(const Float32 *in,
+                                 void *out,
+                                 UInt32 sampleCount,
+                                 const AudioMixKernels::IntegerFormat &format,
+                                 UInt32 *ditherState) {
+    ConvertToIntegerWith<NEONConversion>(in, out, sampleCount, format, ditherState);
+}
+
+#endif
+
+AudioMixKernels::AccumulateScaledProc AudioMixKernels::sAccumulateScaled = AccumulateScaledScalar;
+AudioMixKernels::DeinterleaveAccumulateProc AudioMixKernels::sDeinterleaveAccumulate = DeinterleaveAccumulateScalar;
+AudioMixKernels::ConvertToIntegerProc AudioMixKernels::sConvertToInteger = ConvertToIntegerScalar;
+const char *AudioMixKernels::sName = "scalar";
+
+void AudioMixKernels::Initialize() {
+#if defined(__x86_64__)
+    // SSE2 is part of the x86_64 baseline. Deinterleaving is mostly shuffling, which AVX2 doesn't do any faster
+    // across 128-bit lanes, so it always uses SSE2. Integer conversion is a small part of the cycle either way.
+    sDeinterleaveAccumulate = DeinterleaveAccumulateSSE2;
+    sConvertToInteger = ConvertToIntegerSSE2;
+
+    if (CPUSupportsAVX2()) {
+        sAccumulateScaled = AccumulateScaledAVX2;
+        sName = "AVX2";
+    } else {
+        sAccumulateScaled = AccumulateScaledSSE2;
+        sName = "SSE2";
+    }
+#elif defined(__arm64__) || defined(__aarch64__)
+    // NEON is always available on arm64
+    sAccumulateScaled = AccumulateScaledNEON;
+    sDeinterleaveAccumulate = DeinterleaveAccumulateNEON;
+    sConvertToInteger = ConvertToIntegerNEON;
+    sName = "NEON";
+#endif
+
+    DebugMsg("ProxyAudio: using %s mix kernels", sName);
+}
+
+UInt32 AudioMixKernels::MakeGainPattern(const Float32 *channelGains, UInt32 channelCount, Float32 *outPattern) {
+    if (channelCount == 0) {
+        return 0;
+    }
+
+    // Smallest common multiple of the channel count and the vector width
+    UInt32 patternLength = channelCount;
+
+    while (patternLength % kGainPatternGranularity != 0) {
+        patternLength += channelCount;
+    }
+
+    for (UInt32 i = 0; i < patternLength; i++) {
+        outPattern[i] = channelGains[i % channelCount];
+    }
+
+    return patternLength;
+}
@@ -0,0 +1,76 @@
+#ifndef __AudioMixKernels_h__
+#define __AudioMixKernels_h__
+
+#include <MacTypes.h>
+
+// Vectorized inner loops for mixing the proxied audio into the output device's buffers, and for converting it to
+// the device's integer format when we drive it with one. The best implementation
+// for the CPU we're running on (AVX2 or SSE2 on x86_64, NEON on arm64) is picked once by Initialize, and the
+// scalar versions are used until then.
+class AudioMixKernels {
+  public:
+    // The kernels process this many samples per step, so gain patterns have to be a multiple of it in length
+    static const UInt32 kGainPatternGranularity = 8;
+
+    static void Initialize();
+    static const char *Name() { return sName; }
+
+    // Fills outPattern with channelGains repeated until its length is a multiple of both channelCount and
+    // kGainPatternGranularity, and returns that length. outPattern must have room for
+    // channelCount * kGainPatternGranularity samples.
+    static UInt32 MakeGainPattern(const Float32 *channelGains, UInt32 channelCount, Float32 *outPattern);
+
+    // out[i] += in[i] * gainPattern[i % patternLength], for sampleCount samples. Used for interleaved input
+    // and output with the same channel count, where the gain of each channel simply repeats every frame.
+    static void AccumulateScaled(const Float32 *in,
+                                 Float32 *out,
+                                 UInt32 sampleCount,
+                                 const Float32 *gainPattern,
+                                 UInt32 patternLength) {
+        sAccumulateScaled(in, out, sampleCount, gainPattern, patternLength);
+    }
+
+    // outs[c][i] += in[i * channelCount + c] * gains[c], for frameCount frames of each of channelCount channels.
+    // Used for interleaved input going to one mono buffer per channel, reading the input only once rather than once
+    // per channel. Several channels may share an output buffer.
+    static void DeinterleaveAccumulate(const Float32 *in,
+                                       UInt32 channelCount,
+                                       Float32 *const *outs,
+                                       const Float32 *gains,
+                                       UInt32 frameCount) {
+        sDeinterleaveAccumulate(in, channelCount, outs, gains, frameCount);
+    }
+
+    // How samples are stored in an integer output buffer: signed, native endian integers of bytesPerSample (2, 3 or
+    // 4) bytes, of which validBits are used, in the most significant bits if alignedHigh and the least otherwise
+    struct IntegerFormat {
+        UInt32 bytesPerSample;
+        UInt32 validBits;
+        bool alignedHigh;
+        // Whether to add triangular (TPDF) dither of up to one step either way before rounding
+        bool dither;
+    };
+
+    // Converts sampleCount samples from in to format, clipping anything outside [-1, 1) and turning NaNs into
+    // silence. ditherState is four words of random state, none of them zero, which is carried over from one call to
+    // the next.
+    static void ConvertToInteger(const Float32 *in,
+                                 void *out,
+                                 UInt32 sampleCount,
+                                 const IntegerFormat &format,
+                                 UInt32 *ditherState) {
+        sConvertToInteger(in, out, sampleCount, format, ditherState);
+    }
+
+  private:
+    typedef void (*AccumulateScaledProc)(const Float32 *, Float32 *, UInt32, const Float32 *, UInt32);
+    typedef void (*DeinterleaveAccumulateProc)(const Float32 *, UInt32, Float32 *const *, const Float32 *, UInt32);
+    typedef void (*ConvertToIntegerProc)(const Float32 *, void *, UInt32, const IntegerFormat &, UInt32 *);
+
+    static AccumulateScaledProc sAccumulateScaled;
+    static DeinterleaveAccumulateProc sDeinterleaveAccumulate;
+    static ConvertToIntegerProc sConvertToInteger;
+    static const char *sName;
+};
+
+#endif // __AudioMixKernels_h__
@@ -0,0 +1,252 @@
+#include "AudioMixer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "debugHelpers.h"
+
+void AudioMixGains::Set(const Float32 *gains, UInt32 channelCount) {
+    channelCount = std::min(channelCount, UInt32(kAudioMixerMaxChannels));
+    std::copy(gains, gains + channelCount, channelGains);
+    patternLength = AudioMixKernels::MakeGainPattern(channelGains, channelCount, pattern);
+    unity = std::all_of(channelGains, channelGains + channelCount, [](Float32 gain) { return gain == 1.0f; });
+}
+
+// How many of frameCount frames starting at frameOffset fit in buffer
+static inline UInt32 FramesToMix(const AudioBuffer &buffer, UInt32 frameOffset, UInt32 frameCount) {
+    if (buffer.mNumberChannels == 0 || !buffer.mData) {
+        return 0;
+    }
+
+    UInt32 bufferFrameCount = buffer.mDataByteSize / (buffer.mNumberChannels * sizeof(Float32));
+
+    if (frameOffset >= bufferFrameCount) {
+        return 0;
+    }
+
+    return std::min(frameCount, bufferFrameCount - frameOffset);
+}
+
+AudioMixer::AudioMixer()
+    : mInputChannelCount(0), mOutputBufferCount(0), mFirstOutputBufferChannelCount(0), mLayout(Layout::routed),
+      mMixProc(MixRouted) {
+}
+
+void AudioMixer::Configure(UInt32 inputChannelCount,
+                           const std::vector<UInt32> &channelMap,
+                           const std::vector<UInt32> &outputBufferChannelCounts) {
+    mInputChannelCount = std::min(inputChannelCount, UInt32(kAudioMixerMaxChannels));
+    mOutputBufferCount = (UInt32)outputBufferChannelCounts.size();
+    mFirstOutputBufferChannelCount = (mOutputBufferCount > 0) ? outputBufferChannelCounts[0] : 0;
+
+    bool allMono = (mOutputBufferCount > 0);
+    UInt32 outputChannelCount = 0;
+
+    for (UInt32 channelCount : outputBufferChannelCounts) {
+        allMono = allMono && (channelCount == 1);
+        outputChannelCount += channelCount;
+    }
+
+    // Work out where each proxied channel ends up once, so mixing is just a strided loop per route
+    bool identityMap = true;
+    mRoutes.clear();
+
+    for (UInt32 inputChannel = 0; inputChannel < mInputChannelCount; inputChannel++) {
+        UInt32 mappedChannel = (inputChannel < channelMap.size()) ? channelMap[inputChannel] : inputChannel + 1;
+        identityMap = identityMap && (mappedChannel == inputChannel + 1);
+
+        if (mappedChannel == 0 || mappedChannel > outputChannelCount) {
+            continue;
+        }
+
+        Route route = {inputChannel, mappedChannel - 1, 0, mappedChannel - 1};
+
+        while (route.outputBufferChannel >= outputBufferChannelCounts[route.outputBuffer]) {
+            route.outputBufferChannel -= outputBufferChannelCounts[route.outputBuffer];
+            route.outputBuffer++;
+        }
+
+        mRoutes.push_back(route);
+    }
+
+    if (identityMap && mOutputBufferCount == 1 && mFirstOutputBufferChannelCount == mInputChannelCount) {
+        mLayout = Layout::matchingInterleaved;
+        mMixProc = MixMatchingInterleaved;
+    } else if (identityMap && mInputChannelCount == 2 && mOutputBufferCount == 1
+               && mFirstOutputBufferChannelCount > 2) {
+        mLayout = Layout::stereoToInterleaved;
+        mMixProc = MixToInterleaved<2>;
+    } else if (allMono && mRoutes.size() == mInputChannelCount) {
+        // Pro interfaces often have one mono buffer per channel. As long as every proxied channel has one to go to,
+        // under any map, they can all be deinterleaved in one pass over the input.
+        mLayout = Layout::nonInterleaved;
+        mMixProc = MixNonInterleaved;
+    } else {
+        mLayout = Layout::routed;
+        mMixProc = MixRouted;
+    }
+
+    DebugMsg("ProxyAudio: AudioMixer configured for %u channels into %u buffers, %u routes, layout %d",
+             mInputChannelCount,
+             mOutputBufferCount,
+             (UInt32)mRoutes.size(),
+             (int)mLayout);
+}
+
+void AudioMixer::Mix(const Float32 *input,
+                     UInt32 frameOffset,
+                     UInt32 frameCount,
+                     const AudioMixGains &gains,
+                     AudioBufferList *outOutputData) const {
+    // The specializations trust the layout they were picked for, so just make sure the HAL hasn't handed us
+    // something else since Configure was called
+    if (outOutputData->mNumberBuffers != mOutputBufferCount
+        || (mOutputBufferCount > 0 && outOutputData->mBuffers[0].mNumberChannels != mFirstOutputBufferChannelCount)) {
+        MixUnexpected(*this, input, frameOffset, frameCount, gains, outOutputData);
+        return;
+    }
+
+    mMixProc(*this, input, frameOffset, frameCount, gains, outOutputData);
+}
+
+bool AudioMixer::Copy(const Float32 *input,
+                      UInt32 frameOffset,
+                      UInt32 frameCount,
+                      AudioBufferList *outOutputData) const {
+    if (mLayout != Layout::matchingInterleaved || outOutputData->mNumberBuffers != 1
+        || outOutputData->mBuffers[0].mNumberChannels != mInputChannelCount) {
+        return false;
+    }
+
+    AudioBuffer &buffer = outOutputData->mBuffers[0];
+    UInt32 framesToCopy = FramesToMix(buffer, frameOffset, frameCount);
+    memcpy((Float32 *)buffer.mData + frameOffset * mInputChannelCount,
+           input,
+           size_t(framesToCopy) * mInputChannelCount * sizeof(Float32));
+    return true;
+}
+
+void AudioMixer::MixMatchingInterleaved(const AudioMixer &mixer,
+                                        const Float32 *input,
+                                        UInt32 frameOffset,
+                                        UInt32 frameCount,
+                                        const AudioMixGains &gains,
+                                        AudioBufferList *outOutputData) {
+    // Identical layouts, so this is one flat run of samples with a repeating gain per channel
+    AudioBuffer &buffer = outOutputData->mBuffers[0];
+    UInt32 framesToMix = FramesToMix(buffer, frameOffset, frameCount);
+    Float32 *out = (Float32 *)buffer.mData + frameOffset * mixer.mInputChannelCount;
+
+    AudioMixKernels::AccumulateScaled(
+        input, out, framesToMix * mixer.mInputChannelCount, gains.pattern, gains.patternLength);
+}
+
+template <UInt32 kInputChannels>
+void AudioMixer::MixToInterleaved(const AudioMixer & /* mixer */,
+                                  const Float32 *input,
+                                  UInt32 frameOffset,
+                                  UInt32 frameCount,
+                                  const AudioMixGains &gains,
+                                  AudioBufferList *outOutputData) {
+    // One interleaved buffer with more channels than we have; the extra ones are left alone
+    AudioBuffer &buffer = outOutputData->mBuffers[0];
+    UInt32 outputChannelCount = buffer.mNumberChannels;
+    UInt32 framesToMix = FramesToMix(buffer, frameOffset, frameCount);
+    Float32 *out = (Float32 *)buffer.mData + frameOffset * outputChannelCount;
+
+    for (UInt32 frame = 0; frame < framesToMix; frame++) {
+        for (UInt32 channel = 0; channel < kInputChannels; channel++) {
+            out[channel] += input[channel] * gains.channelGains[channel];
+        }
+
+        input += kInputChannels;
+        out += outputChannelCount;
+    }
+}
+
+void AudioMixer::MixNonInterleaved(const AudioMixer &mixer,
+                                   const Float32 *input,
+                                   UInt32 frameOffset,
+                                   UInt32 frameCount,
+                                   const AudioMixGains &gains,
+                                   AudioBufferList *outOutputData) {
+    // Configure made sure every proxied channel has a route, and they're in proxied channel order
+    Float32 *outs[kAudioMixerMaxChannels];
+    UInt32 framesToMix = frameCount;
+
+    for (const Route &route : mixer.mRoutes) {
+        AudioBuffer &buffer = outOutputData->mBuffers[route.outputBuffer];
+        framesToMix = std::min(framesToMix, FramesToMix(buffer, frameOffset, frameCount));
+        outs[route.inputChannel] = (Float32 *)buffer.mData + frameOffset;
+    }
+
+    AudioMixKernels::DeinterleaveAccumulate(input, mixer.mInputChannelCount, outs, gains.channelGains, framesToMix);
+}
+
+void AudioMixer::MixRouted(const AudioMixer &mixer,
+                           const Float32 *input,
+                           UInt32 frameOffset,
+                           UInt32 frameCount,
+                           const AudioMixGains &gains,
+                           AudioBufferList *outOutputData) {
+    // Any channel map into any number of buffers with any number of channels each, going by the routes Configure
+    // worked out
+    for (const Route &route : mixer.mRoutes) {
+        MixRoute(route,
+                 input,
+                 mixer.mInputChannelCount,
+                 frameOffset,
+                 frameCount,
+                 gains.channelGains[route.inputChannel],
+                 outOutputData->mBuffers[route.outputBuffer]);
+    }
+}
+
+void AudioMixer::MixUnexpected(const AudioMixer &mixer,
+                               const Float32 *input,
+                               UInt32 frameOffset,
+                               UInt32 frameCount,
+                               const AudioMixGains &gains,
+                               AudioBufferList *outOutputData) {
+    // The HAL has handed us a different layout from the one Configure saw, so find each route's output channel
+    // in the buffers we actually have. Only happens until the mixer is configured for the new layout.
+    for (Route route : mixer.mRoutes) {
+        route.outputBuffer = 0;
+        route.outputBufferChannel = route.outputChannel;
+
+        while (route.outputBuffer < outOutputData->mNumberBuffers
+               && route.outputBufferChannel >= outOutputData->mBuffers[route.outputBuffer].mNumberChannels) {
+            route.outputBufferChannel -= outOutputData->mBuffers[route.outputBuffer].mNumberChannels;
+            route.outputBuffer++;
+        }
+
+        if (route.outputBuffer < outOutputData->mNumberBuffers) {
+            MixRoute(route,
+                     input,
+                     mixer.mInputChannelCount,
+                     frameOffset,
+                     frameCount,
+                     gains.channelGains[route.inputChannel],
+                     outOutputData->mBuffers[route.outputBuffer]);
+        }
+    }
+}
+
+void AudioMixer::MixRoute(const Route &route,
+                          const Float32 *input,
+                          UInt32 inputChannelCount,
+                          UInt32 frameOffset,
+                          UInt32 frameCount,
+                          Float32 gain,
+                          AudioBuffer &buffer) {
+    UInt32 outputChannelCount = buffer.mNumberChannels;
+    UInt32 framesToMix = FramesToMix(buffer, frameOffset, frameCount);
+    const Float32 *in = input + route.inputChannel;
+    Float32 *out = (Float32 *)buffer.mData + frameOffset * outputChannelCount + route.outputBufferChannel;
+
+    for (UInt32 frame = 0; frame < framesToMix; frame++) {
+        *out += *in * gain;
+        in += inputChannelCount;
+        out += outputChannelCount;
+    }
+}
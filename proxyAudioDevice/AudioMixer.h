@@ -0,0 +1,117 @@
+#ifndef __AudioMixer_h__
+#define __AudioMixer_h__
+
+#include <CoreAudio/CoreAudioTypes.h>
+#include <vector>
+
+#include "AudioMixKernels.h"
+
+#define kAudioMixerMaxChannels 64
+
+// The gain of each proxied channel for one IO cycle, along with the same gains laid out as a pattern for
+// AudioMixKernels::AccumulateScaled
+struct AudioMixGains {
+    void Set(const Float32 *gains, UInt32 channelCount);
+
+    Float32 channelGains[kAudioMixerMaxChannels];
+    Float32 pattern[kAudioMixerMaxChannels * AudioMixKernels::kGainPatternGranularity];
+    UInt32 patternLength = 0;
+    // Whether every gain is exactly 1, so the input can be copied rather than scaled
+    bool unity = false;
+};
+
+// Scales the proxied audio and accumulates it into the output device's buffers. The output device's buffer layout
+// and the channel map are only examined in Configure, which picks the specialization of the mixing loop that fits
+// them, so the IO proc doesn't have to work it out again every cycle.
+//
+// Channels are numbered across the output device's buffers the same way the HAL numbers them, so with two stereo
+// buffers output channels 1 and 2 are in the first buffer and 3 and 4 in the second.
+class AudioMixer {
+  public:
+    enum class Layout { matchingInterleaved, stereoToInterleaved, nonInterleaved, routed };
+
+    AudioMixer();
+
+    // Not thread safe: only call this while the output device's IO proc isn't running. channelMap[i] is the 1-based
+    // output channel proxied channel i + 1 goes to, or 0 to leave it out. Proxied channels past the end of the map
+    // go to the output channel with the same number.
+    void Configure(UInt32 inputChannelCount,
+                   const std::vector<UInt32> &channelMap,
+                   const std::vector<UInt32> &outputBufferChannelCounts);
+    Layout GetLayout() const { return mLayout; }
+    UInt32 InputChannelCount() const { return mInputChannelCount; }
+
+    // input holds frameCount interleaved frames, which get mixed in starting frameOffset frames into the cycle
+    void Mix(const Float32 *input,
+             UInt32 frameOffset,
+             UInt32 frameCount,
+             const AudioMixGains &gains,
+             AudioBufferList *outOutputData) const;
+
+    // Like Mix at unity gain, but copies input over what's in the output device's buffers rather than adding to
+    // it, so what comes out is bit for bit what went in. Only the matchingInterleaved layout has the input's
+    // samples in the same order as the output's, so for any other this does nothing and returns false.
+    bool Copy(const Float32 *input, UInt32 frameOffset, UInt32 frameCount, AudioBufferList *outOutputData) const;
+
+  private:
+    typedef void (*MixProc)(
+        const AudioMixer &, const Float32 *, UInt32, UInt32, const AudioMixGains &, AudioBufferList *);
+
+    // One proxied channel's way into the output device's buffers. outputChannel is 0-based and counted across all
+    // the buffers; outputBuffer and outputBufferChannel are where Configure found it.
+    struct Route {
+        UInt32 inputChannel;
+        UInt32 outputChannel;
+        UInt32 outputBuffer;
+        UInt32 outputBufferChannel;
+    };
+
+    static void MixMatchingInterleaved(const AudioMixer &mixer,
+                                       const Float32 *input,
+                                       UInt32 frameOffset,
+                                       UInt32 frameCount,
+                                       const AudioMixGains &gains,
+                                       AudioBufferList *outOutputData);
+    template <UInt32 kInputChannels>
+    static void MixToInterleaved(const AudioMixer &mixer,
+                                 const Float32 *input,
+                                 UInt32 frameOffset,
+                                 UInt32 frameCount,
+                                 const AudioMixGains &gains,
+                                 AudioBufferList *outOutputData);
+    static void MixNonInterleaved(const AudioMixer &mixer,
+                                  const Float32 *input,
+                                  UInt32 frameOffset,
+                                  UInt32 frameCount,
+                                  const AudioMixGains &gains,
+                                  AudioBufferList *outOutputData);
+    static void MixRouted(const AudioMixer &mixer,
+                          const Float32 *input,
+                          UInt32 frameOffset,
+                          UInt32 frameCount,
+                          const AudioMixGains &gains,
+                          AudioBufferList *outOutputData);
+    static void MixUnexpected(const AudioMixer &mixer,
+                              const Float32 *input,
+                              UInt32 frameOffset,
+                              UInt32 frameCount,
+                              const AudioMixGains &gains,
+                              AudioBufferList *outOutputData);
+    static void MixRoute(const Route &route,
+                         const Float32 *input,
+                         UInt32 inputChannelCount,
+                         UInt32 frameOffset,
+                         UInt32 frameCount,
+                         Float32 gain,
+                         AudioBuffer &buffer);
+
+    UInt32 mInputChannelCount;
+    UInt32 mOutputBufferCount;
+    UInt32 mFirstOutputBufferChannelCount;
+    // Sized in Configure and only read after that, so the IO proc never allocates
+    std::vector<Route> mRoutes;
+    Layout mLayout;
+    MixProc mMixProc;
+};
+
+#endif // __AudioMixer_h__
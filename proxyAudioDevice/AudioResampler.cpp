@@ -0,0 +1,155 @@
+#include "AudioResampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "RealTimeLog.h"
+#include "debugHelpers.h"
+
+constexpr Float64 AudioResampler::kMaxRatioDeviation;
+
+AudioResampler::AudioResampler() : mChannelCount(0), mMaxOutputFrames(0), mWired(false) {
+}
+
+void AudioResampler::Configure(UInt32 channelCount, UInt32 maxOutputFrames) {
+    mChannelCount = channelCount;
+    mMaxOutputFrames = maxOutputFrames;
+    bool wired = mWired;
+    SetWired(false);
+
+    // Sized for the largest ratio we allow, and filled now rather than on the IO thread. The fraction is always
+    // below 1, so sizing for 1 covers every fraction the IO proc can pass, however close to 1, even where the last
+    // output frame lands just short of a whole input frame.
+    UInt32 maxInputFrames = InputFramesNeeded(1.0, maxOutputFrames, 1.0 + kMaxRatioDeviation);
+    mInput.assign(size_t(maxInputFrames) * channelCount, 0.0f);
+    mOutput.assign(size_t(maxOutputFrames) * channelCount, 0.0f);
+    SetWired(wired);
+
+    DebugMsg("ProxyAudio: AudioResampler configured for %u channels, %u frames", channelCount, maxOutputFrames);
+}
+
+bool AudioResampler::SetWired(bool wired) {
+    if (!wired) {
+        UnwireVector(mInput);
+        UnwireVector(mOutput);
+        mWired = false;
+        return true;
+    }
+
+    mWired = true;
+    return WireVector(mInput) && WireVector(mOutput);
+}
+
+UInt32 AudioResampler::InputFramesNeeded(Float64 fraction, UInt32 outputFrames, Float64 ratio) {
+    if (outputFrames == 0) {
+        return 0;
+    }
+
+    // The last output frame falls between input frames lastFrame + 1 and lastFrame + 2, and interpolating it takes
+    // the frames either side of those as well
+    UInt32 lastFrame = UInt32(fraction + (outputFrames - 1) * ratio);
+    return lastFrame + 4;
+}
+
+void AudioResampler::Process(Float64 fraction, Float64 ratio, UInt32 outputFrames) {
+    ratio = std::min(std::max(ratio, 1.0 - kMaxRatioDeviation), 1.0 + kMaxRatioDeviation);
+    outputFrames = std::min(outputFrames, mMaxOutputFrames);
+
+    if (mChannelCount == 2) {
+        Interpolate<2>(mInput.data(), mOutput.data(), 2, fraction, ratio, outputFrames);
+    } else {
+        Interpolate<0>(mInput.data(), mOutput.data(), mChannelCount, fraction, ratio, outputFrames);
+    }
+}
+
+// kChannels is the channel count if it's known at compile time, or 0 to use channelCount
+template <UInt32 kChannels>
+void AudioResampler::Interpolate(
+    const Float32 *input, Float32 *output, UInt32 channelCount, Float64 fraction, Float64 ratio, UInt32 frames) {
+    const UInt32 channels = kChannels ? kChannels : channelCount;
+
+    for (UInt32 frame = 0; frame < frames; frame++) {
+        // Work the position out from scratch each frame so rounding errors don't build up over the cycle
+        Float64 position = fraction + frame * ratio;
+        UInt32 index = UInt32(position);
+        Float32 t = Float32(position - index);
+        const Float32 *x = input + index * channels;
+
+        for (UInt32 channel = 0; channel < channels; channel++) {
+            Float32 xm1 = x[channel];
+            Float32 x0 = x[channels + channel];
+            Float32 x1 = x[2 * channels + channel];
+            Float32 x2 = x[3 * channels + channel];
+
+            Float32 c1 = 0.5f * (x1 - xm1);
+            Float32 c2 = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+            Float32 c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+
+            output[channel] = ((c3 * t + c2) * t + c1) * t + x0;
+        }
+
+        output += channels;
+    }
+}
+
+void ClockDriftEstimator::Reset() {
+    mHaveAnchor = false;
+    mHaveRatio = false;
+    mAnchorInputSampleTime = 0;
+    mAnchorInputHostTime = 0;
+    mAnchorOutputSampleTime = 0;
+    mAnchorOutputHostTime = 0;
+    mRatio = 1.0;
+}
+
+void ClockDriftEstimator::Update(Float64 inputSampleTime,
+                                 UInt64 inputHostTime,
+                                 Float64 outputSampleTime,
+                                 UInt64 outputHostTime) {
+    if (!mHaveAnchor) {
+        mAnchorInputSampleTime = inputSampleTime;
+        mAnchorInputHostTime = inputHostTime;
+        mAnchorOutputSampleTime = outputSampleTime;
+        mAnchorOutputHostTime = outputHostTime;
+        mHaveAnchor = true;
+        return;
+    }
+
+    Float64 outputFrames = outputSampleTime - mAnchorOutputSampleTime;
+
+    if (outputFrames < kWindowFrames) {
+        return;
+    }
+
+    Float64 inputFrames = inputSampleTime - mAnchorInputSampleTime;
+    Float64 inputTicks = Float64(SInt64(inputHostTime - mAnchorInputHostTime));
+    Float64 outputTicks = Float64(SInt64(outputHostTime - mAnchorOutputHostTime));
+
+    mHaveAnchor = false;
+
+    if (inputFrames <= 0 || inputTicks <= 0 || outputTicks <= 0) {
+        // One of the time lines jumped, so this window tells us nothing
+        return;
+    }
+
+    Float64 measuredRatio = (inputFrames / inputTicks) / (outputFrames / outputTicks);
+
+    if (std::fabs(measuredRatio - 1.0) > AudioResampler::kMaxRatioDeviation) {
+        RTDebugMsg("ProxyAudio: ClockDriftEstimator ignoring implausible ratio %lf", measuredRatio);
+        return;
+    }
+
+    // Start a new window from where this one ended so no time goes unmeasured
+    mAnchorInputSampleTime = inputSampleTime;
+    mAnchorInputHostTime = inputHostTime;
+    mAnchorOutputSampleTime = outputSampleTime;
+    mAnchorOutputHostTime = outputHostTime;
+    mHaveAnchor = true;
+
+    if (mHaveRatio) {
+        mRatio += 0.25 * (measuredRatio - mRatio);
+    } else {
+        mRatio = measuredRatio;
+        mHaveRatio = true;
+    }
+}
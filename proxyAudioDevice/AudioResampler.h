@@ -0,0 +1,98 @@
+#ifndef __AudioResampler_h__
+#define __AudioResampler_h__
+
+#include <MacTypes.h>
+#include <vector>
+
+#include "RealTimeMemory.h"
+
+// Resamples interleaved Float32 audio by a ratio that may change every cycle. It's only ever used to absorb the
+// drift between two clocks running at nominally the same rate, so the ratio stays within kMaxRatioDeviation of 1.0
+// and 4-point cubic Hermite interpolation is plenty: at such small ratios its error stays far below the noise
+// floor, for a handful of multiply-adds per sample.
+//
+// The caller owns the time line. For each cycle it works out the fractional input frame the first output frame
+// falls on, asks InputFramesNeeded how much input that takes, fills InputBuffer with that many frames starting one
+// frame before the first one (the interpolator needs a frame of history), and then calls Process.
+class AudioResampler {
+  public:
+    // The most the ratio is ever allowed to differ from 1.0
+    static constexpr Float64 kMaxRatioDeviation = 0.01;
+    // Resampling is only ever there to make up for drift, so when there's next to none, the input can be copied
+    // out as it is instead. Copying can't follow drift at all, though, so it only starts once the ratio is within
+    // kBypassTolerance of 1.0 and the read position is within half of kMaxBypassError frames of where the fill
+    // level controller wants it, and stops as soon as it's wandered further than kMaxBypassError from there,
+    // leaving resampling to steer it back. That way drift is never made up by skipping or repeating a frame.
+    static constexpr Float64 kBypassTolerance = 1e-6;
+    static constexpr Float64 kMaxBypassError = 2.0;
+
+    // Whether the next cycle can be copied out rather than resampled, given the ratio it would be resampled at, how
+    // far the read position is from where it should be in frames, and whether the last cycle was copied out
+    static bool CanBypass(Float64 ratio, Float64 distanceError, bool bypassing) {
+        Float64 maxError = bypassing ? kMaxBypassError : 0.5 * kMaxBypassError;
+        return distanceError >= -maxError && distanceError <= maxError
+               && (bypassing || (ratio >= 1.0 - kBypassTolerance && ratio <= 1.0 + kBypassTolerance));
+    }
+
+    AudioResampler();
+
+    // Not thread safe: only call this while the IO proc using the resampler isn't running. The buffers are sized
+    // for up to maxOutputFrames output frames per cycle.
+    void Configure(UInt32 channelCount, UInt32 maxOutputFrames);
+
+    bool CanProcess(UInt32 outputFrames) const { return outputFrames <= mMaxOutputFrames; }
+
+    // Locks the buffers into memory while wired, including after Configure replaces them. Not real-time safe, and
+    // not thread safe either, like Configure. Returns false if locking them failed.
+    bool SetWired(bool wired);
+
+    // How many input frames it takes to produce outputFrames frames when the first one falls fraction of a frame
+    // (0 <= fraction < 1) after the start of the second input frame
+    static UInt32 InputFramesNeeded(Float64 fraction, UInt32 outputFrames, Float64 ratio);
+
+    Float32 *InputBuffer() { return mInput.data(); }
+    const Float32 *OutputBuffer() const { return mOutput.data(); }
+
+    // Reads input frames per output frame at the given ratio from InputBuffer into OutputBuffer
+    void Process(Float64 fraction, Float64 ratio, UInt32 outputFrames);
+
+  private:
+    template <UInt32 kChannels>
+    static void Interpolate(
+        const Float32 *input, Float32 *output, UInt32 channelCount, Float64 fraction, Float64 ratio, UInt32 frames);
+
+    UInt32 mChannelCount;
+    UInt32 mMaxOutputFrames;
+    bool mWired;
+    RealTimeVector<Float32> mInput;
+    RealTimeVector<Float32> mOutput;
+};
+
+// Measures the ratio between the rates of two clocks that both report their progress as a sample time paired with
+// a host time, such as the HAL's IO cycles and the output device's. Only used from the output device's IO thread.
+class ClockDriftEstimator {
+  public:
+    ClockDriftEstimator() { Reset(); }
+
+    void Reset();
+
+    // Feed the latest time stamps from both clocks. Each window of kWindowFrames output frames gives one
+    // measurement, which is folded into Ratio() gradually so jitter in the time stamps doesn't show up in it.
+    void Update(Float64 inputSampleTime, UInt64 inputHostTime, Float64 outputSampleTime, UInt64 outputHostTime);
+
+    // Input frames per output frame, or 1.0 until the first window has been measured
+    Float64 Ratio() const { return mRatio; }
+
+  private:
+    static const UInt32 kWindowFrames = 131072;
+
+    bool mHaveAnchor;
+    bool mHaveRatio;
+    Float64 mAnchorInputSampleTime;
+    UInt64 mAnchorInputHostTime;
+    Float64 mAnchorOutputSampleTime;
+    UInt64 mAnchorOutputHostTime;
+    Float64 mRatio;
+};
+
+#endif // __AudioResampler_h__
@@ -1,132 +1,225 @@
 #include "AudioRingBuffer.h"
 
-AudioRingBuffer::AudioRingBuffer(UInt32 bytesPerFrame, UInt32 capacityFrames) : mBuffer(NULL) {
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+AudioRingBuffer::AudioRingBuffer(UInt32 bytesPerFrame, UInt32 capacityFrames)
+    : mBuffer(NULL), mAllocatedBytes(0), mStartFrame(0), mEndFrame(0), mGeneration(0), mClearRequested(false) {
     Allocate(bytesPerFrame, capacityFrames);
 }
 
 AudioRingBuffer::~AudioRingBuffer() {
     if (mBuffer)
-        free(mBuffer);
+        munmap(mBuffer, mAllocatedBytes);
 }
 
 void AudioRingBuffer::Allocate(UInt32 bytesPerFrame, UInt32 capacityFrames) {
     if (mBuffer)
-        free(mBuffer);
+        munmap(mBuffer, mAllocatedBytes);
+
+    UInt32 roundedCapacityFrames = RoundedCapacityFrames(capacityFrames);
+    UInt64 pageSize = UInt64(sysconf(_SC_PAGESIZE));
 
     mBytesPerFrame = bytesPerFrame;
-    mCapacityFrames = capacityFrames;
-    mCapacityBytes = bytesPerFrame * capacityFrames;
-    mBuffer = (Byte *)malloc(mCapacityBytes);
-    Clear();
+    mCapacityFrames = roundedCapacityFrames;
+    mCapacityBytes = UInt64(bytesPerFrame) * roundedCapacityFrames;
+    mFrameMask = roundedCapacityFrames - 1;
+    mAllocatedBytes = size_t((mCapacityBytes + pageSize - 1) / pageSize * pageSize);
+
+    // Anonymous mappings are page aligned and come zeroed, but their pages aren't actually backed until first
+    // touched, so write to all of them now rather than taking the faults on an IO thread
+    void *buffer = mmap(NULL, mAllocatedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+    if (buffer == MAP_FAILED) {
+        // Leave an empty buffer that rejects every Store rather than crashing
+        mBuffer = NULL;
+        mAllocatedBytes = 0;
+        mCapacityFrames = 0;
+        mCapacityBytes = 0;
+        mFrameMask = 0;
+    } else {
+        mBuffer = (Byte *)buffer;
+        memset(mBuffer, 0, mAllocatedBytes);
+    }
+
+    mStartFrame.store(0, std::memory_order_relaxed);
+    mEndFrame.store(0, std::memory_order_relaxed);
+    mClearRequested.store(false, std::memory_order_relaxed);
+    mGeneration.fetch_add(1, std::memory_order_release);
+}
+
+UInt32 AudioRingBuffer::RoundedCapacityFrames(UInt32 capacityFrames) {
+    UInt32 roundedCapacityFrames = 1;
+    while (roundedCapacityFrames < capacityFrames && roundedCapacityFrames < 0x80000000)
+        roundedCapacityFrames <<= 1;
+
+    return roundedCapacityFrames;
+}
+
+bool AudioRingBuffer::Wire() {
+    return mBuffer && mlock(mBuffer, mAllocatedBytes) == 0;
+}
+
+void AudioRingBuffer::Unwire() {
+    if (mBuffer)
+        munlock(mBuffer, mAllocatedBytes);
 }
 
 void AudioRingBuffer::Clear() {
-    memset(mBuffer, 0, mCapacityBytes);
-    mStartOffset = 0;
-    mStartFrame = 0;
-    mEndFrame = 0;
+    mClearRequested.store(true, std::memory_order_release);
 }
 
 bool AudioRingBuffer::Store(const Byte *data, UInt32 nFrames, SInt64 startFrame) {
     if (nFrames > mCapacityFrames)
         return false;
 
-    // $$$ we have an unaddressed critical region here
-    // reading and writing could well be in separate threads
+    if (nFrames == 0)
+        return true;
 
+    // Only the producer ever writes the cursors, so its own view of them is always current
+    SInt64 currentStart = mStartFrame.load(std::memory_order_relaxed);
+    SInt64 currentEnd = mEndFrame.load(std::memory_order_relaxed);
     SInt64 endFrame = startFrame + nFrames;
-    if (startFrame >= mEndFrame + mCapacityFrames)
-        // writing more than one buffer ahead -- fine but that means that everything we have is now too far in the past
-        Clear();
-
-    if (mStartFrame == 0) {
-        // empty buffer
-        mStartOffset = 0;
-        mStartFrame = startFrame;
-        mEndFrame = endFrame;
-        memcpy(mBuffer, data, nFrames * mBytesPerFrame);
+    // What to publish as the end frame once the data is in
+    SInt64 newEnd = endFrame;
+
+    if (mClearRequested.exchange(false, std::memory_order_acquire) || currentStart == currentEnd
+        || startFrame >= currentEnd + mCapacityFrames || startFrame < currentStart) {
+        // Either the buffer is empty, we were asked to clear it, we're writing more than one buffer ahead (so
+        // everything we have is now too far in the past), or the timeline went backwards. In all of those cases
+        // start a new range at startFrame. The consumer sees the generation change and discards anything it was
+        // in the middle of reading. The generation goes first, so a consumer that has seen the new cursors is sure
+        // to see it too.
+        mGeneration.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        mStartFrame.store(startFrame, std::memory_order_relaxed);
+        mEndFrame.store(startFrame, std::memory_order_relaxed);
+        currentEnd = startFrame;
     } else {
-        UInt32 offset0, offset1, nBytes;
-        if (endFrame > mEndFrame) {
-            // advancing (as will be usual with sequential stores)
-
-            if (startFrame > mEndFrame) {
-                // we are skipping some samples, so zero the range we are skipping
-                offset0 = FrameOffset(mEndFrame);
-                offset1 = FrameOffset(startFrame);
-                if (offset0 < offset1)
-                    memset(mBuffer + offset0, 0, offset1 - offset0);
-                else {
-                    nBytes = mCapacityBytes - offset0;
-                    memset(mBuffer + offset0, 0, nBytes);
-                    memset(mBuffer, 0, offset1);
-                }
-            }
-            mEndFrame = endFrame;
-
-            // except for the case of not having wrapped yet, we will normally
-            // have to advance the start
-            SInt64 newStart = mEndFrame - mCapacityFrames;
-            if (newStart > mStartFrame) {
-                mStartOffset = (UInt32)(mStartOffset + ((UInt64)newStart - mStartFrame) * mBytesPerFrame) % mCapacityBytes;
-                mStartFrame = newStart;
-            }
+        if (startFrame < currentEnd) {
+            // We're writing over frames that are still valid. Cut the valid range off before them until the new
+            // data is in, so a consumer that starts reading now doesn't see them half written, and bump the
+            // generation, so one that's already reading them sees they've gone. The end goes first, so a consumer
+            // that has seen the new generation is sure to see it too.
+            newEnd = std::max(endFrame, currentEnd);
+            mEndFrame.store(startFrame, std::memory_order_relaxed);
+            mGeneration.fetch_add(1, std::memory_order_release);
+            currentEnd = startFrame;
         }
-        // now everything is lined up and we can just write the new data
-        offset0 = FrameOffset(startFrame);
-        offset1 = FrameOffset(endFrame);
+
+        // Writing frames [startFrame, endFrame) reuses the slots of the frames one capacity earlier, so those
+        // have to drop out of the valid range before we touch the memory. That also covers any gap we zero
+        // below, as it lies before startFrame.
+        SInt64 newStart = std::max(currentStart, endFrame - SInt64(mCapacityFrames));
+
+        if (newStart != currentStart)
+            mStartFrame.store(newStart, std::memory_order_relaxed);
+    }
+
+    // Everything above only invalidated frames, and nothing has been written into the buffer yet. This fence keeps
+    // it that way: it orders the invalidation before the writes below, and pairs with the acquire fence the
+    // consumer issues after copying, before it re-checks the generation and start frame. So if any byte the
+    // consumer copied came from the writes below, its re-check sees the frames it read from as gone.
+    std::atomic_thread_fence(std::memory_order_release);
+
+    UInt64 offset0, offset1, nBytes;
+
+    if (startFrame > currentEnd) {
+        // we are skipping some samples, so zero the range we are skipping
+        offset0 = FrameOffset(currentEnd);
+        offset1 = FrameOffset(startFrame);
         if (offset0 < offset1)
-            memcpy(mBuffer + offset0, data, offset1 - offset0);
+            memset(mBuffer + offset0, 0, offset1 - offset0);
         else {
             nBytes = mCapacityBytes - offset0;
-            memcpy(mBuffer + offset0, data, nBytes);
-            memcpy(mBuffer, data + nBytes, offset1);
+            memset(mBuffer + offset0, 0, nBytes);
+            memset(mBuffer, 0, offset1);
         }
     }
 
+    // now everything is lined up and we can just write the new data
+    offset0 = FrameOffset(startFrame);
+    offset1 = FrameOffset(endFrame);
+    if (offset0 < offset1)
+        memcpy(mBuffer + offset0, data, offset1 - offset0);
+    else {
+        nBytes = mCapacityBytes - offset0;
+        memcpy(mBuffer + offset0, data, nBytes);
+        memcpy(mBuffer, data + nBytes, offset1);
+    }
+
+    // Publishing the new end frame, only once all the data is in, is what makes it available to the consumer
+    if (newEnd > currentEnd)
+        mEndFrame.store(newEnd, std::memory_order_release);
+
     return true;
 }
 
 bool AudioRingBuffer::Fetch(Byte *data, UInt32 nFrames, SInt64 startFrame) {
     SInt64 endFrame = startFrame + nFrames;
 
-    if (endFrame < mStartFrame || startFrame >= mEndFrame) {
-        memset(data, 0, mBytesPerFrame * nFrames);
+    UInt32 generation = mGeneration.load(std::memory_order_acquire);
+    SInt64 validStart = mStartFrame.load(std::memory_order_acquire);
+    SInt64 validEnd = mEndFrame.load(std::memory_order_acquire);
+
+    // validStart can only pass validEnd if the cursors moved between our loads of them, treat that as empty too
+    if (mClearRequested.load(std::memory_order_acquire) || validStart >= validEnd || endFrame <= validStart
+        || startFrame >= validEnd) {
+        memset(data, 0, UInt64(nFrames) * mBytesPerFrame);
         return true;
     }
 
     bool bufferOverrun = false;
 
-    if (startFrame < mStartFrame) {
-        UInt64 bytes = (mStartFrame - startFrame) * mBytesPerFrame;
+    if (startFrame < validStart) {
+        UInt64 bytes = UInt64(validStart - startFrame) * mBytesPerFrame;
         memset(data, 0, bytes);
-        startFrame = mStartFrame;
+        startFrame = validStart;
         data += bytes;
         bufferOverrun = true;
     }
 
-    if (endFrame > mEndFrame) {
-        UInt64 bytes = (endFrame - mEndFrame) * mBytesPerFrame;
-        UInt64 offset = (mEndFrame - startFrame) * mBytesPerFrame;
+    if (endFrame > validEnd) {
+        UInt64 bytes = UInt64(endFrame - validEnd) * mBytesPerFrame;
+        UInt64 offset = UInt64(validEnd - startFrame) * mBytesPerFrame;
         memset(data + offset, 0, bytes);
-        endFrame = mEndFrame;
+        endFrame = validEnd;
         bufferOverrun = true;
     }
 
-    if (startFrame == endFrame) {
+    CopyOut(data, startFrame, endFrame);
+
+    // The producer may have lapped us while we were copying. Any frame that has dropped out of the valid range
+    // since we started might have been partially overwritten, so silence it and report it as an overrun.
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (mGeneration.load(std::memory_order_relaxed) != generation) {
+        memset(data, 0, UInt64(endFrame - startFrame) * mBytesPerFrame);
         return true;
     }
 
-    UInt32 offset0 = FrameOffset(startFrame);
-    UInt32 offset1 = FrameOffset(endFrame);
+    SInt64 currentStart = mStartFrame.load(std::memory_order_relaxed);
+
+    if (currentStart > startFrame) {
+        SInt64 lostFrames = std::min(currentStart, endFrame) - startFrame;
+        memset(data, 0, UInt64(lostFrames) * mBytesPerFrame);
+        bufferOverrun = true;
+    }
+
+    return bufferOverrun;
+}
+
+void AudioRingBuffer::CopyOut(Byte *data, SInt64 startFrame, SInt64 endFrame) const {
+    UInt64 offset0 = FrameOffset(startFrame);
+    UInt64 offset1 = FrameOffset(endFrame);
 
     if (offset0 < offset1)
         memcpy(data, mBuffer + offset0, offset1 - offset0);
     else {
-        UInt32 nBytes = mCapacityBytes - offset0;
+        UInt64 nBytes = mCapacityBytes - offset0;
         memcpy(data, mBuffer + offset0, nBytes);
         memcpy(data + nBytes, mBuffer, offset1);
     }
-
-    return bufferOverrun;
 }
@@ -1,30 +1,103 @@
 #ifndef __AudioRingBuffer_h__
 #define __AudioRingBuffer_h__
 
-#include <CoreServices/CoreServices.h>
+#include <MacTypes.h>
+#include <algorithm>
+#include <atomic>
 
-// used for now to cache a couple of seconds (?) of input and access it for audio thruing
+// Caches recent input, addressed by absolute frame number, for audio thruing.
+//
+// This is a single-producer / single-consumer ring: Store must only be called from one thread (the HAL's IO
+// thread) and Fetch from one other thread (the target device's IO thread), and neither ever blocks. The producer
+// publishes the range of valid frames [StartFrame(), EndFrame()) through atomic cursors, and the consumer checks
+// what it copied against those cursors afterwards, so frames that were overwritten while being read are reported
+// as an overrun rather than handed out as garbage.
 class AudioRingBuffer {
   public:
     AudioRingBuffer(UInt32 bytesPerFrame, UInt32 capacityFrames);
     ~AudioRingBuffer();
 
+    // Not thread safe, only call this while neither the producer nor the consumer are running
     void Allocate(UInt32 bytesPerFrame, UInt32 capacityFrames);
+    // The capacity a buffer asked to hold capacityFrames frames actually ends up with
+    static UInt32 RoundedCapacityFrames(UInt32 capacityFrames);
+    // The buffer is allocated in whole pages and touched up front, so it's resident when the IO threads first use
+    // it. Wire keeps it that way (until Unwire) by locking it into memory, which also faults back in any pages that
+    // have been paged out since. Neither is real-time safe.
+    bool Wire();
+    void Unwire();
+    // Safe to call from any thread. The buffer reads as empty from then on, and the producer actually resets
+    // its cursors at the start of its next Store.
     void Clear();
     bool Store(const Byte *data, UInt32 nFrames, SInt64 frameNumber);
     bool Fetch(Byte *data, UInt32 nFrames, SInt64 frameNumber);
+    // Like Fetch, but rather than copying the frames out it hands them to reader in place, as at most two
+    // contiguous spans: reader(const Byte *span, UInt32 frameOffset, UInt32 spanFrames), where frameOffset is
+    // relative to frameNumber. Frames outside the valid range are skipped rather than zero-filled. As the data is
+    // consumed where it lies, frames the producer overwrites while reader runs can only be reported as an
+    // overrun, not silenced.
+    template <typename Reader> bool Read(UInt32 nFrames, SInt64 frameNumber, Reader &&reader);
 
-    UInt32 FrameOffset(SInt64 frameNumber) {
-        return (mStartOffset + UInt32(frameNumber - mStartFrame) * mBytesPerFrame) % mCapacityBytes;
-    }
+    SInt64 StartFrame() const { return mStartFrame.load(std::memory_order_acquire); }
+    SInt64 EndFrame() const { return mEndFrame.load(std::memory_order_acquire); }
+
+    // The capacity is always a power of two, so this is a mask rather than a division. Masking the two's
+    // complement representation also gives the right slot for negative frame numbers.
+    UInt64 FrameOffset(SInt64 frameNumber) const { return (UInt64(frameNumber) & mFrameMask) * mBytesPerFrame; }
 
     UInt32 mBytesPerFrame;
+    // Rounded up to the next power of two from the capacity asked for
     UInt32 mCapacityFrames;
-    UInt32 mCapacityBytes;
+    UInt64 mCapacityBytes;
+    UInt64 mFrameMask;
     Byte *mBuffer;
-    UInt32 mStartOffset;
-    SInt64 mStartFrame;
-    SInt64 mEndFrame;
+    // mCapacityBytes rounded up to whole pages
+    size_t mAllocatedBytes;
+
+  private:
+    void CopyOut(Byte *data, SInt64 startFrame, SInt64 endFrame) const;
+
+    // Written only by the producer
+    std::atomic<SInt64> mStartFrame;
+    std::atomic<SInt64> mEndFrame;
+    // Bumped by the producer whenever it restarts the frame range, so the consumer can tell that the range it
+    // read from is gone even if the new one happens to overlap it
+    std::atomic<UInt32> mGeneration;
+    std::atomic_bool mClearRequested;
 };
 
+template <typename Reader> bool AudioRingBuffer::Read(UInt32 nFrames, SInt64 startFrame, Reader &&reader) {
+    SInt64 endFrame = startFrame + nFrames;
+
+    UInt32 generation = mGeneration.load(std::memory_order_acquire);
+    SInt64 validStart = mStartFrame.load(std::memory_order_acquire);
+    SInt64 validEnd = mEndFrame.load(std::memory_order_acquire);
+
+    if (mClearRequested.load(std::memory_order_acquire) || validStart >= validEnd || endFrame <= validStart
+        || startFrame >= validEnd) {
+        return true;
+    }
+
+    bool bufferOverrun = (startFrame < validStart || endFrame > validEnd);
+    SInt64 readStart = std::max(startFrame, validStart);
+    UInt32 readFrames = UInt32(std::min(endFrame, validEnd) - readStart);
+    UInt32 frameOffset = UInt32(readStart - startFrame);
+    UInt64 firstSlot = UInt64(readStart) & mFrameMask;
+    UInt32 firstSpanFrames = std::min(readFrames, UInt32(mCapacityFrames - firstSlot));
+
+    reader(mBuffer + firstSlot * mBytesPerFrame, frameOffset, firstSpanFrames);
+
+    if (firstSpanFrames < readFrames)
+        reader(mBuffer, frameOffset + firstSpanFrames, readFrames - firstSpanFrames);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (mGeneration.load(std::memory_order_relaxed) != generation
+        || mStartFrame.load(std::memory_order_relaxed) > readStart) {
+        bufferOverrun = true;
+    }
+
+    return bufferOverrun;
+}
+
 #endif // __AudioRingBuffer_h__
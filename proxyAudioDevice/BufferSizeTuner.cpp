@@ -0,0 +1,116 @@
+#include "BufferSizeTuner.h"
+
+#include <algorithm>
+
+#include "debugHelpers.h"
+
+constexpr UInt32 BufferSizeTuner::kMinSize;
+constexpr UInt32 BufferSizeTuner::kMaxSize;
+constexpr UInt32 BufferSizeTuner::kStartSize;
+
+// How long the output has to play cleanly at a size before trying the next one down
+static const Float64 kStableSeconds = 20.0;
+
+BufferSizeTuningStats::BufferSizeTuningStats()
+    : mCycles{0}, mGlitches{0}, mMinHeadroomFrames{INT32_MAX}, mMaxOutputLatenessFrames{0},
+      mMaxInputLatenessFrames{0} {
+}
+
+void BufferSizeTuningStats::StoreMin(std::atomic<SInt32> &value, SInt32 newValue) {
+    SInt32 current = value.load(std::memory_order_relaxed);
+
+    while (newValue < current && !value.compare_exchange_weak(current, newValue, std::memory_order_relaxed)) {
+    }
+}
+
+void BufferSizeTuningStats::StoreMax(std::atomic<SInt32> &value, SInt32 newValue) {
+    SInt32 current = value.load(std::memory_order_relaxed);
+
+    while (newValue > current && !value.compare_exchange_weak(current, newValue, std::memory_order_relaxed)) {
+    }
+}
+
+void BufferSizeTuningStats::RecordOutputCycle(SInt32 headroomFrames, SInt32 latenessFrames) {
+    StoreMin(mMinHeadroomFrames, headroomFrames);
+    StoreMax(mMaxOutputLatenessFrames, latenessFrames);
+    mCycles.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BufferSizeTuningStats::RecordGlitch() {
+    mGlitches.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BufferSizeTuningStats::RecordInputCycle(SInt32 latenessFrames) {
+    StoreMax(mMaxInputLatenessFrames, latenessFrames);
+}
+
+BufferSizeTuningStats::Snapshot BufferSizeTuningStats::Collect() {
+    // An IO thread may record in between these, in which case that cycle just counts towards the next snapshot
+    Snapshot snapshot;
+    snapshot.cycles = mCycles.exchange(0, std::memory_order_relaxed);
+    snapshot.glitches = mGlitches.exchange(0, std::memory_order_relaxed);
+    snapshot.minHeadroomFrames = mMinHeadroomFrames.exchange(INT32_MAX, std::memory_order_relaxed);
+    snapshot.maxOutputLatenessFrames = mMaxOutputLatenessFrames.exchange(0, std::memory_order_relaxed);
+    snapshot.maxInputLatenessFrames = mMaxInputLatenessFrames.exchange(0, std::memory_order_relaxed);
+    return snapshot;
+}
+
+BufferSizeTuner::BufferSizeTuner() {
+    Reset(kStartSize, false);
+}
+
+void BufferSizeTuner::Reset(UInt32 size, bool settled) {
+    mSize = std::min(std::max(size, kMinSize), kMaxSize);
+    mLargestFailedSize = 0;
+    mSettled = settled;
+    StartWindow();
+}
+
+void BufferSizeTuner::StartWindow() {
+    mCleanSeconds = 0;
+    mMinHeadroomFrames = INT32_MAX;
+    mMaxLatenessFrames = 0;
+}
+
+bool BufferSizeTuner::Update(const BufferSizeTuningStats::Snapshot &stats, Float64 seconds) {
+    if (stats.glitches > 0) {
+        mLargestFailedSize = std::max(mLargestFailedSize, mSize);
+        mSettled = false;
+        StartWindow();
+
+        if (mSize >= kMaxSize) {
+            return false;
+        }
+
+        mSize = std::min(mSize * 2, kMaxSize);
+        DebugMsg("ProxyAudio: BufferSizeTuner glitched, going up to %u frames", mSize);
+        return true;
+    }
+
+    mCleanSeconds += seconds;
+    mMinHeadroomFrames = std::min(mMinHeadroomFrames, stats.minHeadroomFrames);
+    // Either thread running late eats into the time the output device's buffer gives us
+    mMaxLatenessFrames =
+        std::max(mMaxLatenessFrames, std::max(stats.maxOutputLatenessFrames, stats.maxInputLatenessFrames));
+
+    if (mSettled || mCleanSeconds < kStableSeconds) {
+        return false;
+    }
+
+    // At half the size, the IO threads have half as long to run in, so they have to have stayed within half of
+    // that, and the input has to have stayed at least that far ahead of the reads
+    UInt32 smallerSize = mSize / 2;
+    SInt32 margin = SInt32(smallerSize / 2);
+
+    if (smallerSize < kMinSize || smallerSize <= mLargestFailedSize || mMaxLatenessFrames > margin
+        || mMinHeadroomFrames < margin) {
+        DebugMsg("ProxyAudio: BufferSizeTuner settled on %u frames", mSize);
+        mSettled = true;
+        return false;
+    }
+
+    mSize = smallerSize;
+    StartWindow();
+    DebugMsg("ProxyAudio: BufferSizeTuner trying %u frames", mSize);
+    return true;
+}
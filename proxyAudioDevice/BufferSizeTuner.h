@@ -0,0 +1,81 @@
+#ifndef __BufferSizeTuner_h__
+#define __BufferSizeTuner_h__
+
+#include <MacTypes.h>
+
+#include <atomic>
+
+// What the IO threads saw since the last time BufferSizeTuner looked. The IO threads only ever record into this,
+// which is lock-free, and the control thread collects and clears it.
+class BufferSizeTuningStats {
+  public:
+    struct Snapshot {
+        UInt32 cycles;
+        UInt32 glitches;
+        // The fewest frames left between the end of what the output device read and the end of the input, over
+        // all the cycles
+        SInt32 minHeadroomFrames;
+        // How late each IO thread ran at worst, in frames, compared to when it's meant to
+        SInt32 maxOutputLatenessFrames;
+        SInt32 maxInputLatenessFrames;
+    };
+
+    BufferSizeTuningStats();
+
+    // Called by the output device's IO thread every cycle it plays the input
+    void RecordOutputCycle(SInt32 headroomFrames, SInt32 latenessFrames);
+    // Called by either IO thread for anything that was audible
+    void RecordGlitch();
+    // Called by the HAL's IO thread every cycle it writes
+    void RecordInputCycle(SInt32 latenessFrames);
+
+    Snapshot Collect();
+
+  private:
+    static void StoreMin(std::atomic<SInt32> &value, SInt32 newValue);
+    static void StoreMax(std::atomic<SInt32> &value, SInt32 newValue);
+
+    std::atomic<UInt32> mCycles;
+    std::atomic<UInt32> mGlitches;
+    std::atomic<SInt32> mMinHeadroomFrames;
+    std::atomic<SInt32> mMaxOutputLatenessFrames;
+    std::atomic<SInt32> mMaxInputLatenessFrames;
+};
+
+// Looks for the smallest output device buffer size that plays without glitches.
+//
+// Any glitch doubles the size straight away, and the size that glitched is never tried again. The size is only
+// halved after a stretch of clean playing in which both IO threads kept well clear of their deadlines, by enough
+// that they would still have done at half the size. Once the next size down is known to fail, or the margins aren't
+// there, the tuner has settled on its size.
+class BufferSizeTuner {
+  public:
+    static constexpr UInt32 kMinSize = 32;
+    static constexpr UInt32 kMaxSize = 4096;
+    static constexpr UInt32 kStartSize = 64;
+
+    BufferSizeTuner();
+
+    // Starts tuning from size, which is taken to be already settled on if settled is true
+    void Reset(UInt32 size, bool settled);
+
+    // Takes what the IO threads saw over the last seconds seconds of playing, and returns whether the size has
+    // changed
+    bool Update(const BufferSizeTuningStats::Snapshot &stats, Float64 seconds);
+
+    UInt32 Size() const { return mSize; }
+    bool Settled() const { return mSettled; }
+
+  private:
+    void StartWindow();
+
+    UInt32 mSize;
+    // The largest size that glitched, or 0 if none has
+    UInt32 mLargestFailedSize;
+    bool mSettled;
+    Float64 mCleanSeconds;
+    SInt32 mMinHeadroomFrames;
+    SInt32 mMaxLatenessFrames;
+};
+
+#endif // __BufferSizeTuner_h__
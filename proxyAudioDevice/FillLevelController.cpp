@@ -0,0 +1,55 @@
+#include "FillLevelController.h"
+
+#include <algorithm>
+#include <cmath>
+
+constexpr Float64 FillLevelController::kMaxCorrection;
+
+// How long it takes the controller to correct most of an error in the distance
+static const Float64 kCorrectionSeconds = 10.0;
+// Time constant of the smoothing applied to the measured distance
+static const Float64 kSmoothingSeconds = 1.0;
+
+FillLevelController::FillLevelController() {
+    Reset(44100.0);
+}
+
+void FillLevelController::Reset(Float64 sampleRate) {
+    mTargetDistance = 0;
+    mSampleRate = sampleRate;
+    mSmoothedError = 0;
+    mIntegral = 0;
+    mHaveTarget = false;
+
+    // Gains are per output frame. The ring's distance is the integral of the ratio error, so with the integral
+    // gain at a quarter of the square of the proportional gain the loop is critically damped and settles without
+    // overshooting.
+    mProportionalGain = 1.0 / (kCorrectionSeconds * sampleRate);
+    mIntegralGain = mProportionalGain * mProportionalGain / 4.0;
+}
+
+Float64 FillLevelController::Update(Float64 distance, UInt32 frames) {
+    if (!mHaveTarget) {
+        mTargetDistance = distance;
+        mHaveTarget = true;
+    }
+
+    Float64 error = distance - mTargetDistance;
+    Float64 smoothing = 1.0 - exp(-Float64(frames) / (kSmoothingSeconds * mSampleRate));
+    mSmoothedError += (error - mSmoothedError) * smoothing;
+
+    // If we're reading too far behind, read faster to catch up, and vice versa
+    Float64 integral = mIntegral + mSmoothedError * frames;
+    Float64 correction = mProportionalGain * mSmoothedError + mIntegralGain * integral;
+
+    if (correction > kMaxCorrection) {
+        correction = kMaxCorrection;
+    } else if (correction < -kMaxCorrection) {
+        correction = -kMaxCorrection;
+    } else {
+        // Only integrate while we're not saturated, so the integral doesn't wind up while we can't act on it
+        mIntegral = integral;
+    }
+
+    return correction;
+}
@@ -0,0 +1,38 @@
+#ifndef __FillLevelController_h__
+#define __FillLevelController_h__
+
+#include <MacTypes.h>
+
+// Holds the distance between where the output device reads the ring buffer and where the HAL's IO thread last
+// wrote to it at a target, by nudging the resampling ratio with a PI controller.
+//
+// The distance it's fed is worked out from time stamps, which jitter from cycle to cycle. That's smoothed out before
+// the controller sees it, so the ratio follows the average distance rather than wobbling every cycle.
+class FillLevelController {
+  public:
+    // The largest correction ever added to the ratio
+    static constexpr Float64 kMaxCorrection = 0.002;
+
+    FillLevelController();
+
+    // The first distance passed to Update after this becomes the target
+    void Reset(Float64 sampleRate);
+
+    // Takes the distance measured this cycle, in frames, and returns how much to add to the resampling ratio for
+    // the next frames frames
+    Float64 Update(Float64 distance, UInt32 frames);
+
+    Float64 TargetDistance() const { return mTargetDistance; }
+    Float64 SmoothedError() const { return mSmoothedError; }
+
+  private:
+    Float64 mTargetDistance;
+    Float64 mSampleRate;
+    Float64 mSmoothedError;
+    Float64 mIntegral;
+    Float64 mProportionalGain;
+    Float64 mIntegralGain;
+    bool mHaveTarget;
+};
+
+#endif // __FillLevelController_h__
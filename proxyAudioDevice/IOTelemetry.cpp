@@ -0,0 +1,119 @@
+#include "IOTelemetry.h"
+
+IOTelemetry::IOTelemetry()
+    : mOutputCalls{0}, mOutputCycles{0}, mPassthroughCycles{0}, mInputCycles{0}, mOverruns{0}, mUnderruns{0},
+      mFramesZeroFilled{0}, mMinRingDistance{INT64_MAX}, mMaxRingDistance{INT64_MIN}, mLastCycleWallTicks{0},
+      mMaxCycleWallTicks{0}, mTotalCycleWallTicks{0}, mLastCycleCPUNanoseconds{0}, mMaxCycleCPUNanoseconds{0},
+      mTotalCycleCPUNanoseconds{0} {
+}
+
+// Each counter has a single writer, so a relaxed load and store is all an increment needs, and unlike fetch_add
+// it never has to go through a locked instruction
+static inline void Add(std::atomic<UInt64> &counter, UInt64 amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+void IOTelemetry::RecordOutputCall() {
+    Add(mOutputCalls, 1);
+}
+
+void IOTelemetry::RecordOutputCycle(UInt32 framesZeroFilled, bool overrun, bool underrun, SInt64 ringDistance) {
+    Add(mOutputCycles, 1);
+    Add(mFramesZeroFilled, framesZeroFilled);
+
+    if (overrun) {
+        Add(mOverruns, 1);
+    }
+
+    if (underrun) {
+        Add(mUnderruns, 1);
+    }
+
+    if (ringDistance < mMinRingDistance.load(std::memory_order_relaxed)) {
+        mMinRingDistance.store(ringDistance, std::memory_order_relaxed);
+    }
+
+    if (ringDistance > mMaxRingDistance.load(std::memory_order_relaxed)) {
+        mMaxRingDistance.store(ringDistance, std::memory_order_relaxed);
+    }
+}
+
+void IOTelemetry::RecordPassthroughCycle() {
+    Add(mPassthroughCycles, 1);
+}
+
+void IOTelemetry::RecordOutputCycleWallTime(UInt64 hostTicks) {
+    mLastCycleWallTicks.store(hostTicks, std::memory_order_relaxed);
+    Add(mTotalCycleWallTicks, hostTicks);
+
+    if (hostTicks > mMaxCycleWallTicks.load(std::memory_order_relaxed)) {
+        mMaxCycleWallTicks.store(hostTicks, std::memory_order_relaxed);
+    }
+}
+
+void IOTelemetry::RecordOutputCycleCPUTime(UInt64 nanoseconds) {
+    mLastCycleCPUNanoseconds.store(nanoseconds, std::memory_order_relaxed);
+    Add(mTotalCycleCPUNanoseconds, nanoseconds);
+
+    if (nanoseconds > mMaxCycleCPUNanoseconds.load(std::memory_order_relaxed)) {
+        mMaxCycleCPUNanoseconds.store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+void IOTelemetry::RecordInputCycle() {
+    Add(mInputCycles, 1);
+}
+
+void IOTelemetry::ResetRingDistance() {
+    mMinRingDistance.store(INT64_MAX, std::memory_order_relaxed);
+    mMaxRingDistance.store(INT64_MIN, std::memory_order_relaxed);
+}
+
+static void SetNumber(CFMutableDictionaryRef dictionary, CFStringRef key, SInt64 value) {
+    CFNumberRef number = CFNumberCreate(NULL, kCFNumberSInt64Type, &value);
+    CFDictionarySetValue(dictionary, key, number);
+    CFRelease(number);
+}
+
+CFDictionaryRef IOTelemetry::CopyDictionary(Float64 nanosecondsPerHostTick) const {
+    CFMutableDictionaryRef dictionary =
+        CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    SetNumber(dictionary, CFSTR("outputCalls"), mOutputCalls.load(std::memory_order_relaxed));
+    SetNumber(dictionary, CFSTR("outputCycles"), mOutputCycles.load(std::memory_order_relaxed));
+    SetNumber(dictionary, CFSTR("passthroughCycles"), mPassthroughCycles.load(std::memory_order_relaxed));
+    SetNumber(dictionary, CFSTR("inputCycles"), mInputCycles.load(std::memory_order_relaxed));
+    SetNumber(dictionary, CFSTR("overruns"), mOverruns.load(std::memory_order_relaxed));
+    SetNumber(dictionary, CFSTR("underruns"), mUnderruns.load(std::memory_order_relaxed));
+    SetNumber(dictionary, CFSTR("framesZeroFilled"), mFramesZeroFilled.load(std::memory_order_relaxed));
+
+    SInt64 minRingDistance = mMinRingDistance.load(std::memory_order_relaxed);
+    SInt64 maxRingDistance = mMaxRingDistance.load(std::memory_order_relaxed);
+
+    // Left out until there's been a cycle since the read position was last worked out
+    if (minRingDistance <= maxRingDistance) {
+        SetNumber(dictionary, CFSTR("minRingDistance"), minRingDistance);
+        SetNumber(dictionary, CFSTR("maxRingDistance"), maxRingDistance);
+    }
+
+    SetNumber(dictionary,
+              CFSTR("lastCycleWallNanoseconds"),
+              SInt64(mLastCycleWallTicks.load(std::memory_order_relaxed) * nanosecondsPerHostTick));
+    SetNumber(dictionary,
+              CFSTR("maxCycleWallNanoseconds"),
+              SInt64(mMaxCycleWallTicks.load(std::memory_order_relaxed) * nanosecondsPerHostTick));
+    SetNumber(dictionary,
+              CFSTR("totalCycleWallNanoseconds"),
+              SInt64(mTotalCycleWallTicks.load(std::memory_order_relaxed) * nanosecondsPerHostTick));
+    SetNumber(dictionary,
+              CFSTR("lastCycleCPUNanoseconds"),
+              SInt64(mLastCycleCPUNanoseconds.load(std::memory_order_relaxed)));
+    SetNumber(dictionary,
+              CFSTR("maxCycleCPUNanoseconds"),
+              SInt64(mMaxCycleCPUNanoseconds.load(std::memory_order_relaxed)));
+    SetNumber(dictionary,
+              CFSTR("totalCycleCPUNanoseconds"),
+              SInt64(mTotalCycleCPUNanoseconds.load(std::memory_order_relaxed)));
+
+    return dictionary;
+}
@@ -0,0 +1,64 @@
+#ifndef __IOTelemetry_h__
+#define __IOTelemetry_h__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <atomic>
+
+// Counters kept by the IO threads about how proxying is going, published through the device's
+// kProxyAudioDevicePropertyTelemetry property.
+//
+// Recording is lock-free and never allocates, so it's safe on the IO threads. Each counter is only ever written by
+// one thread, and readers just take whatever values are there at the time, so the counters in a snapshot may be a
+// cycle apart from each other.
+class IOTelemetry {
+  public:
+    IOTelemetry();
+
+    // Called by the output device's IO thread at the start of every cycle
+    void RecordOutputCall();
+
+    // Called by the output device's IO thread for every cycle it plays the input in. overrun is whether it read
+    // past the newest input, and underrun whether it fell so far behind that input it hadn't read yet had already
+    // been overwritten. ringDistance is how many frames of input there were from the read position onwards.
+    void RecordOutputCycle(UInt32 framesZeroFilled, bool overrun, bool underrun, SInt64 ringDistance);
+
+    // Called by the output device's IO thread for every cycle it copied the input out untouched
+    void RecordPassthroughCycle();
+
+    // Called by the output device's IO thread with how long a cycle took from start to finish, in host ticks. That's
+    // wall time, not CPU time: it includes any time the thread was preempted or waiting.
+    void RecordOutputCycleWallTime(UInt64 hostTicks);
+
+    // Called by the output device's IO thread with how much CPU time it used in a cycle, in nanoseconds
+    void RecordOutputCycleCPUTime(UInt64 nanoseconds);
+
+    // Called by the HAL's IO thread for every cycle it writes
+    void RecordInputCycle();
+
+    // Called by the output device's IO thread when it works out its read position again, after which the old
+    // ring distances mean nothing
+    void ResetRingDistance();
+
+    // Returns a dictionary of the counters, which the caller must release
+    CFDictionaryRef CopyDictionary(Float64 nanosecondsPerHostTick) const;
+
+  private:
+    std::atomic<UInt64> mOutputCalls;
+    std::atomic<UInt64> mOutputCycles;
+    std::atomic<UInt64> mPassthroughCycles;
+    std::atomic<UInt64> mInputCycles;
+    std::atomic<UInt64> mOverruns;
+    std::atomic<UInt64> mUnderruns;
+    std::atomic<UInt64> mFramesZeroFilled;
+    std::atomic<SInt64> mMinRingDistance;
+    std::atomic<SInt64> mMaxRingDistance;
+    std::atomic<UInt64> mLastCycleWallTicks;
+    std::atomic<UInt64> mMaxCycleWallTicks;
+    std::atomic<UInt64> mTotalCycleWallTicks;
+    std::atomic<UInt64> mLastCycleCPUNanoseconds;
+    std::atomic<UInt64> mMaxCycleCPUNanoseconds;
+    std::atomic<UInt64> mTotalCycleCPUNanoseconds;
+};
+
+#endif // __IOTelemetry_h__
@@ -1,13 +1,20 @@
 #include "ProxyAudioDevice.h"
 
 #include <algorithm>
+#include <cmath>
 #include <string>
 #include <dispatch/dispatch.h>
+#include <mach/mach.h>
 #include <mach/mach_time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "AudioDevice.h"
+#include "AudioMixKernels.h"
+#include "AudioMixer.h"
 #include "AudioRingBuffer.h"
 #include "CFTypeHelpers.h"
+#include "RealTimeLog.h"
 #include "debugHelpers.h"
 #include "utilities.h"
 
@@ -35,6 +42,14 @@ std::string CFStringToStdString(CFStringRef s) {
     return result;
 }
 
+static Float64 hostTicksPerFrameAtSampleRate(Float64 sampleRate) {
+    struct mach_timebase_info theTimeBaseInfo;
+    mach_timebase_info(&theTimeBaseInfo);
+    Float64 theHostClockFrequency = (Float64)theTimeBaseInfo.denom / theTimeBaseInfo.numer;
+    theHostClockFrequency *= 1000000000.0;
+    return theHostClockFrequency / sampleRate;
+}
+
 #pragma mark The Interface
 
 static AudioServerPlugInDriverInterface gAudioServerPlugInDriverInterface = {
@@ -506,6 +521,15 @@ Done:
 
 #pragma mark Basic Operations
 
+ProxyAudioDevice::ProxyAudioDevice() : inputIOIsActive(false) {
+    // outputDeviceIOProc divides by hostTicksPerFrame, so give it a real value from the start rather than
+    // relying on Initialize having published one before the first IO cycle
+    gDevice_HostTicksPerFrame = hostTicksPerFrameAtSampleRate(gDevice_SampleRate);
+    ioProcState.sampleRate = gDevice_SampleRate;
+    ioProcState.hostTicksPerFrame = gDevice_HostTicksPerFrame;
+    ioState.Store(ioProcState);
+}
+
 OSStatus ProxyAudioDevice::Initialize(AudioServerPlugInDriverRef inDriver, AudioServerPlugInHostRef inHost) {
     //    The job of this method is, as the name implies, to get the driver initialized. One specific
     //    thing that needs to be done is to store the AudioServerPlugInHostRef so that it can be used
@@ -563,23 +587,38 @@ OSStatus ProxyAudioDevice::Initialize(AudioServerPlugInDriverRef inDriver, Audio
     
     inputMonitoringTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, audioOutputQueue);
     dispatch_source_set_timer(inputMonitoringTimer, dispatch_walltime(NULL, 0), 500ull * NSEC_PER_MSEC, 20ull * NSEC_PER_MSEC);
-    dispatch_source_set_event_handler(inputMonitoringTimer, ^{ monitorUserActivity(); });
+    dispatch_source_set_event_handler(inputMonitoringTimer, ^{
+        monitorUserActivity();
+        // Nothing else writes out what the IO threads log, so this is never more than half a second behind
+        RealTimeLog::Shared().Drain();
+    });
     dispatch_resume(inputMonitoringTimer);
     
     deviceName = copyDeviceNameFromStorage();
     outputDeviceUID = copyOutputDeviceUIDFromStorage();
     outputDeviceBufferFrameSize = retrieveOutputDeviceBufferFrameSizeFromStorage();
     outputDeviceActiveCondition = retrieveOutputDeviceActiveConditionFromStorage();
+    latencyBudget = retrieveLatencyBudgetFromStorage();
+    zeroTimeStampPeriod = retrieveZeroTimeStampPeriodFromStorage();
+    requestedChannelsPerFrame = retrieveChannelCountFromStorage();
+    gDevice_ChannelsPerFrame = requestedChannelsPerFrame;
+    channelMap = retrieveChannelMapFromStorage();
+    outputDeviceFormat = retrieveOutputDeviceFormatFromStorage();
+    hardwareVolume = retrieveHardwareVolumeFromStorage();
 
     //    calculate the host ticks per frame
-    struct mach_timebase_info theTimeBaseInfo;
-    mach_timebase_info(&theTimeBaseInfo);
-    Float64 theHostClockFrequency = (Float64)theTimeBaseInfo.denom / theTimeBaseInfo.numer;
-    theHostClockFrequency *= 1000000000.0;
-    gDevice_HostTicksPerFrame = theHostClockFrequency / gDevice_SampleRate;
+    gDevice_HostTicksPerFrame = hostTicksPerFrameAtSampleRate(gDevice_SampleRate);
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        updateZeroTimeStampPeriodNoLock();
+        publishIOStateNoLock();
+    }
 
-    inputBuffer = new AudioRingBuffer(gDevice_BytesPerFrameInChannel * gDevice_ChannelsPerFrame, 88200);
-    workBuffer = new Byte[gDevice_BytesPerFrameInChannel * gDevice_ChannelsPerFrame * kDevice_RingBufferSize * 2];
+    AudioMixKernels::Initialize();
+    inputBuffer = new AudioRingBuffer(
+        gDevice_BytesPerFrameInChannel * gDevice_ChannelsPerFrame,
+        inputBufferCapacityFrames(gDevice_SampleRate, outputDeviceBufferFrameSize, latencyBudget));
 
     initializeOutputDevice();
 
@@ -705,8 +744,7 @@ OSStatus ProxyAudioDevice::PerformDeviceConfigurationChange(AudioServerPlugInDri
 
     //    declare the local variables
     OSStatus theAnswer = 0;
-    struct mach_timebase_info theTimeBaseInfo;
-    Float64 theHostClockFrequency = 0;
+    bool channelCountChanged = false;
 
     DebugMsg("ProxyAudio: PerformDeviceConfigurationChange");
     
@@ -733,12 +771,33 @@ OSStatus ProxyAudioDevice::PerformDeviceConfigurationChange(AudioServerPlugInDri
         DebugMsg("ProxyAudio: Setting sample rate to: %llu", inChangeAction);
 
         //    recalculate the state that depends on the sample rate
-        mach_timebase_info(&theTimeBaseInfo);
-        theHostClockFrequency = (Float64)theTimeBaseInfo.denom / theTimeBaseInfo.numer;
-        theHostClockFrequency *= 1000000000.0;
-        gDevice_HostTicksPerFrame = theHostClockFrequency / gDevice_SampleRate;
+        gDevice_HostTicksPerFrame = hostTicksPerFrameAtSampleRate(gDevice_SampleRate);
+        updateZeroTimeStampPeriodNoLock();
+        publishIOStateNoLock();
+
+        if (gDevice_SafetyOffset != requestedSafetyOffset) {
+            // The HAL's time stamps move with the safety offset, so the read position has to be worked out again
+            DebugMsg("ProxyAudio: safety offset is now %u frames", requestedSafetyOffset);
+            gDevice_SafetyOffset = requestedSafetyOffset;
+            resetInputData();
+        }
+
+        if (gDevice_ChannelsPerFrame != requestedChannelsPerFrame) {
+            DebugMsg("ProxyAudio: channel count is now %u", requestedChannelsPerFrame);
+            gDevice_ChannelsPerFrame = requestedChannelsPerFrame;
+            channelCountChanged = true;
+            resetInputData();
+        }
     }
 
+    ExecuteInAudioOutputThread(^{
+        if (channelCountChanged) {
+            reconfigureOutputChannels();
+        }
+
+        resizeInputBuffer();
+    });
+
     DebugMsg("ProxyAudio: finished PerformDeviceConfigurationChange, will match sample rate");
     matchOutputDeviceSampleRate();
 
@@ -2368,6 +2427,8 @@ Boolean ProxyAudioDevice::HasDeviceProperty(AudioServerPlugInDriverRef inDriver,
         case kAudioDevicePropertyZeroTimeStampPeriod:
         case kAudioDevicePropertyIcon:
         case kAudioDevicePropertyStreams:
+        case kAudioObjectPropertyCustomPropertyInfoList:
+        case kProxyAudioDevicePropertyTelemetry:
             theAnswer = true;
             break;
 
@@ -2446,6 +2507,8 @@ OSStatus ProxyAudioDevice::IsDevicePropertySettable(AudioServerPlugInDriverRef i
         case kAudioDevicePropertyPreferredChannelLayout:
         case kAudioDevicePropertyZeroTimeStampPeriod:
         case kAudioDevicePropertyIcon:
+        case kAudioObjectPropertyCustomPropertyInfoList:
+        case kProxyAudioDevicePropertyTelemetry:
             *outIsSettable = false;
             break;
 
@@ -2627,6 +2690,14 @@ OSStatus ProxyAudioDevice::GetDevicePropertyDataSize(AudioServerPlugInDriverRef
             *outDataSize = sizeof(CFURLRef);
             break;
 
+        case kAudioObjectPropertyCustomPropertyInfoList:
+            *outDataSize = sizeof(AudioServerPlugInCustomPropertyInfo);
+            break;
+
+        case kProxyAudioDevicePropertyTelemetry:
+            *outDataSize = sizeof(CFPropertyListRef);
+            break;
+
         default:
             theAnswer = kAudioHardwareUnknownPropertyError;
             break;
@@ -2915,14 +2986,18 @@ OSStatus ProxyAudioDevice::GetDevicePropertyData(AudioServerPlugInDriverRef inDr
             break;
 
         case kAudioDevicePropertyLatency:
-            //    This property returns the presentation latency of the device. For this,
-            //    device, the value is 0 due to the fact that it always vends silence.
+            //    This property returns the presentation latency of the device. For this
+            //    device, that's how far behind the HAL's time line the target plays, plus the
+            //    target's own latency.
             FailWithAction(inDataSize < sizeof(UInt32),
                            theAnswer = kAudioHardwareBadPropertySizeError,
                            Done,
                            "GetDevicePropertyData: not enough space for the return value of "
                            "kAudioDevicePropertyLatency for the device");
-            *((UInt32 *)outData) = 0;
+            {
+                CAMutex::Locker locker(stateMutex);
+                *((UInt32 *)outData) = gDevice_Latency;
+            }
             *outDataSize = sizeof(UInt32);
             break;
 
@@ -2990,13 +3065,16 @@ OSStatus ProxyAudioDevice::GetDevicePropertyData(AudioServerPlugInDriverRef inDr
 
         case kAudioDevicePropertySafetyOffset:
             //    This property returns the how close to now the HAL can read and write. For
-            //    this, device, the value is 0 due to the fact that it always vends silence.
+            //    this device, that's the target's safety offset.
             FailWithAction(inDataSize < sizeof(UInt32),
                            theAnswer = kAudioHardwareBadPropertySizeError,
                            Done,
                            "GetDevicePropertyData: not enough space for the return value of "
                            "kAudioDevicePropertySafetyOffset for the device");
-            *((UInt32 *)outData) = gDevice_SafetyOffset;
+            {
+                CAMutex::Locker locker(stateMutex);
+                *((UInt32 *)outData) = gDevice_SafetyOffset;
+            }
             *outDataSize = sizeof(UInt32);
             break;
 
@@ -3054,17 +3132,19 @@ OSStatus ProxyAudioDevice::GetDevicePropertyData(AudioServerPlugInDriverRef inDr
                            "GetDevicePropertyData: not enough space for the return value of "
                            "kAudioDevicePropertyPreferredChannelsForStereo for the device");
             ((UInt32 *)outData)[0] = 1;
-            ((UInt32 *)outData)[1] = 2;
+            ((UInt32 *)outData)[1] = std::min(gDevice_ChannelsPerFrame, UInt32(2));
             *outDataSize = 2 * sizeof(UInt32);
             break;
 
         case kAudioDevicePropertyPreferredChannelLayout:
             //    This property returns the default AudioChannelLayout to use for the device
-            //    by default. For this device, we return a stereo ACL.
+            //    by default. For this device, the first six channels are labelled in the usual 5.1
+            //    order (left, right, center, LFE, left surround, right surround) and the rest are
+            //    discrete.
             {
                 //    calcualte how big the
-                UInt32 theACLSize =
-                    offsetof(AudioChannelLayout, mChannelDescriptions) + (2 * sizeof(AudioChannelDescription));
+                UInt32 theACLSize = offsetof(AudioChannelLayout, mChannelDescriptions)
+                                    + (gDevice_ChannelsPerFrame * sizeof(AudioChannelDescription));
                 FailWithAction(inDataSize < theACLSize,
                                theAnswer = kAudioHardwareBadPropertySizeError,
                                Done,
@@ -3075,7 +3155,8 @@ OSStatus ProxyAudioDevice::GetDevicePropertyData(AudioServerPlugInDriverRef inDr
                 ((AudioChannelLayout *)outData)->mNumberChannelDescriptions = gDevice_ChannelsPerFrame;
                 for (theItemIndex = 0; theItemIndex < gDevice_ChannelsPerFrame; ++theItemIndex) {
                     ((AudioChannelLayout *)outData)->mChannelDescriptions[theItemIndex].mChannelLabel =
-                        kAudioChannelLabel_Left + theItemIndex;
+                        (theItemIndex < 6) ? kAudioChannelLabel_Left + theItemIndex
+                                           : kAudioChannelLabel_Discrete_0 | theItemIndex;
                     ((AudioChannelLayout *)outData)->mChannelDescriptions[theItemIndex].mChannelFlags = 0;
                     ((AudioChannelLayout *)outData)->mChannelDescriptions[theItemIndex].mCoordinates[0] = 0;
                     ((AudioChannelLayout *)outData)->mChannelDescriptions[theItemIndex].mCoordinates[1] = 0;
@@ -3093,7 +3174,10 @@ OSStatus ProxyAudioDevice::GetDevicePropertyData(AudioServerPlugInDriverRef inDr
                            Done,
                            "GetDevicePropertyData: not enough space for the return value of "
                            "kAudioDevicePropertyZeroTimeStampPeriod for the device");
-            *((UInt32 *)outData) = kDevice_RingBufferSize;
+            {
+                CAMutex::Locker locker(stateMutex);
+                *((UInt32 *)outData) = gDevice_ZeroTimeStampPeriod;
+            }
             *outDataSize = sizeof(UInt32);
             break;
 
@@ -3118,6 +3202,38 @@ OSStatus ProxyAudioDevice::GetDevicePropertyData(AudioServerPlugInDriverRef inDr
             *outDataSize = sizeof(CFURLRef);
         } break;
 
+        case kAudioObjectPropertyCustomPropertyInfoList:
+            //    This returns the custom properties the device has, which is just the telemetry.
+            theNumberItemsToFetch = inDataSize / sizeof(AudioServerPlugInCustomPropertyInfo);
+            if (theNumberItemsToFetch > 1) {
+                theNumberItemsToFetch = 1;
+            }
+
+            if (theNumberItemsToFetch > 0) {
+                AudioServerPlugInCustomPropertyInfo *theInfo = (AudioServerPlugInCustomPropertyInfo *)outData;
+                theInfo->mSelector = kProxyAudioDevicePropertyTelemetry;
+                theInfo->mPropertyDataType = kAudioServerPlugInCustomPropertyDataTypeCFPropertyList;
+                theInfo->mQualifierDataType = kAudioServerPlugInCustomPropertyDataTypeNone;
+            }
+
+            *outDataSize = theNumberItemsToFetch * sizeof(AudioServerPlugInCustomPropertyInfo);
+            break;
+
+        case kProxyAudioDevicePropertyTelemetry: {
+            //    This is a CFDictionary of the counters the IO threads keep. It's put together
+            //    fresh each time, and the caller is responsible for releasing it.
+            FailWithAction(inDataSize < sizeof(CFPropertyListRef),
+                           theAnswer = kAudioHardwareBadPropertySizeError,
+                           Done,
+                           "GetDevicePropertyData: not enough space for the return value of "
+                           "kProxyAudioDevicePropertyTelemetry for the device");
+            struct mach_timebase_info theTimeBaseInfo;
+            mach_timebase_info(&theTimeBaseInfo);
+            Float64 theNanosecondsPerHostTick = (Float64)theTimeBaseInfo.numer / theTimeBaseInfo.denom;
+            *((CFPropertyListRef *)outData) = ioTelemetry.CopyDictionary(theNanosecondsPerHostTick);
+            *outDataSize = sizeof(CFPropertyListRef);
+        } break;
+
         default:
             theAnswer = kAudioHardwareUnknownPropertyError;
             break;
@@ -3542,13 +3658,17 @@ OSStatus ProxyAudioDevice::GetStreamPropertyData(AudioServerPlugInDriverRef inDr
             break;
 
         case kAudioStreamPropertyLatency:
-            //    This property returns any additonal presentation latency the stream has.
+            //    This property returns any additonal presentation latency the stream has,
+            //    which is whatever the target's stream has.
             FailWithAction(inDataSize < sizeof(UInt32),
                            theAnswer = kAudioHardwareBadPropertySizeError,
                            Done,
                            "GetStreamPropertyData: not enough space for the return value of "
                            "kAudioStreamPropertyStartingChannel for the stream");
-            *((UInt32 *)outData) = 0;
+            {
+                CAMutex::Locker locker(stateMutex);
+                *((UInt32 *)outData) = gStream_Output_Latency;
+            }
             *outDataSize = sizeof(UInt32);
             break;
 
@@ -4536,6 +4656,7 @@ OSStatus ProxyAudioDevice::SetControlPropertyData(AudioServerPlugInDriverRef inD
                         if (inObjectID == kObjectID_Volume_Output_L) {
                             if (gVolume_Output_L_Value != theNewVolume) {
                                 gVolume_Output_L_Value = theNewVolume;
+                                publishIOStateNoLock();
                                 *outNumberPropertiesChanged = 2;
                                 outChangedAddresses[0].mSelector = kAudioLevelControlPropertyScalarValue;
                                 outChangedAddresses[0].mScope = kAudioObjectPropertyScopeGlobal;
@@ -4547,6 +4668,7 @@ OSStatus ProxyAudioDevice::SetControlPropertyData(AudioServerPlugInDriverRef inD
                         } else {
                             if (gVolume_Output_R_Value != theNewVolume) {
                                 gVolume_Output_R_Value = theNewVolume;
+                                publishIOStateNoLock();
                                 *outNumberPropertiesChanged = 2;
                                 outChangedAddresses[0].mSelector = kAudioLevelControlPropertyScalarValue;
                                 outChangedAddresses[0].mScope = kAudioObjectPropertyScopeGlobal;
@@ -4584,6 +4706,7 @@ OSStatus ProxyAudioDevice::SetControlPropertyData(AudioServerPlugInDriverRef inD
                         if (inObjectID == kObjectID_Volume_Output_L) {
                             if (gVolume_Output_L_Value != theNewVolume) {
                                 gVolume_Output_L_Value = theNewVolume;
+                                publishIOStateNoLock();
                                 *outNumberPropertiesChanged = 2;
                                 outChangedAddresses[0].mSelector = kAudioLevelControlPropertyScalarValue;
                                 outChangedAddresses[0].mScope = kAudioObjectPropertyScopeGlobal;
@@ -4595,6 +4718,7 @@ OSStatus ProxyAudioDevice::SetControlPropertyData(AudioServerPlugInDriverRef inD
                         } else {
                             if (gVolume_Output_R_Value != theNewVolume) {
                                 gVolume_Output_R_Value = theNewVolume;
+                                publishIOStateNoLock();
                                 *outNumberPropertiesChanged = 2;
                                 outChangedAddresses[0].mSelector = kAudioLevelControlPropertyScalarValue;
                                 outChangedAddresses[0].mScope = kAudioObjectPropertyScopeGlobal;
@@ -4625,6 +4749,7 @@ OSStatus ProxyAudioDevice::SetControlPropertyData(AudioServerPlugInDriverRef inD
                         CAMutex::Locker locker(stateMutex);
                         if (gMute_Output_Mute != (*((const UInt32 *)inData) != 0)) {
                             gMute_Output_Mute = *((const UInt32 *)inData) != 0;
+                            publishIOStateNoLock();
                             *outNumberPropertiesChanged = 1;
                             outChangedAddresses[0].mSelector = kAudioBooleanControlPropertyValue;
                             outChangedAddresses[0].mScope = kAudioObjectPropertyScopeGlobal;
@@ -4648,6 +4773,14 @@ OSStatus ProxyAudioDevice::SetControlPropertyData(AudioServerPlugInDriverRef inD
             break;
     };
 
+    //    In hardwareVolume mode the output device's own controls follow ours. Setting them means calling into
+    //    the HAL, which mustn't happen from here.
+    if (*outNumberPropertiesChanged > 0) {
+        ExecuteInAudioOutputThread(^{
+            forwardVolumeToOutputDevice();
+        });
+    }
+
 Done:
     return theAnswer;
 }
@@ -4753,6 +4886,46 @@ int ProxyAudioDevice::outputDeviceSampleRateListener(AudioObjectID inObjectID,
     return noErr;
 }
 
+int ProxyAudioDevice::outputDeviceStreamConfigurationListenerStatic(AudioObjectID inObjectID,
+                                                                    UInt32 inNumberAddresses,
+                                                                    const AudioObjectPropertyAddress *inAddresses,
+                                                                    void *inClientData) {
+    if (!inClientData) {
+        return noErr;
+    }
+
+    return ((ProxyAudioDevice *)inClientData)
+        ->outputDeviceStreamConfigurationListener(inObjectID, inNumberAddresses, inAddresses);
+}
+
+int ProxyAudioDevice::outputDeviceStreamConfigurationListener(AudioObjectID inObjectID,
+                                                              UInt32 inNumberAddresses,
+                                                              const AudioObjectPropertyAddress *inAddresses) {
+#pragma unused(inNumberAddresses)
+#pragma unused(inAddresses)
+    DebugMsg("ProxyAudio: outputDeviceStreamConfigurationListener");
+
+    // The mixer picked its specialization for the buffer layout the target had at setup time. If that's changed,
+    // it can only cope by working out where each channel goes every cycle, so set it up again for the new one.
+    ExecuteInAudioOutputThread(^{
+        CAMutex::Locker locker(outputDeviceMutex);
+        std::vector<UInt32> channelCounts;
+
+        if (!outputDevice.isValid() || outputDevice.id != inObjectID
+            || outputDevice.getStreamChannelCounts(channelCounts) != noErr
+            || channelCounts == outputDevice.streamChannelCounts) {
+            return;
+        }
+
+        DebugMsg("ProxyAudio: output device's buffer layout changed from %u to %u buffers",
+                 (UInt32)outputDevice.streamChannelCounts.size(),
+                 (UInt32)channelCounts.size());
+        reconfigureOutputChannelsNoLock();
+    });
+
+    return noErr;
+}
+
 int ProxyAudioDevice::devicesListenerProcStatic(AudioObjectID inObjectID,
                                                 UInt32 inNumberAddresses,
                                                 const AudioObjectPropertyAddress *inAddresses,
@@ -4809,13 +4982,17 @@ void ProxyAudioDevice::updateOutputDeviceStartedState() {
 
     if (!outputDevice.isStarted && shouldStart) {
         DebugMsg("ProxyAudio: starting outputDevice");
+        setOutputIOBuffersWired(true);
         outputDevice.start();
     } else if (outputDevice.isStarted && !shouldStart) {
         DebugMsg("ProxyAudio: stopping outputDevice");
         outputDevice.stop();
         resetInputData();
+        setOutputIOBuffersWired(false);
     }
 
+    setIOBuffersWired(inputIOIsActive || outputDevice.isStarted);
+
 }
 
 void ProxyAudioDevice::matchOutputDeviceSampleRateNoLock() {
@@ -4845,6 +5022,7 @@ void ProxyAudioDevice::matchOutputDeviceSampleRateNoLock() {
     if (currentInputSampleRate == outputDevice.sampleRate) {
         outputDeviceReady = true;
         updateOutputDeviceStartedState();
+        updateReportedLatencyNoLock();
         return;
     }
 
@@ -4858,6 +5036,7 @@ void ProxyAudioDevice::matchOutputDeviceSampleRateNoLock() {
     
     resetInputData();
     outputDevice.updateStreamInfo();
+    configureOutputChannelsNoLock();
 
     if (!contains(gDevice_SampleRates, outputDevice.sampleRate)) {
         syslog(LOG_WARNING, "ProxyAudio: output device using unavailable sample rate, cannot play!");
@@ -4871,6 +5050,67 @@ void ProxyAudioDevice::matchOutputDeviceSampleRateNoLock() {
     });
 }
 
+void ProxyAudioDevice::updateReportedLatencyNoLock() {
+    // Must be called with outputDeviceMutex held
+    if (!outputDevice.isValid()) {
+        return;
+    }
+
+    // Once outputDeviceIOProc has played something we know how far behind the HAL it ended up. Until then, go by
+    // where it starts reading: a target buffer and safety offset behind the newest input, whose time stamp is
+    // itself about that far ahead of the target's.
+    Float64 distance = inputLatencyFrames.load(std::memory_order_relaxed);
+
+    if (distance < 0) {
+        distance = 2.0 * outputDevice.bufferFrameSize + outputDevice.safetyOffset;
+    }
+
+    UInt32 latency = UInt32(lround(distance)) + outputDevice.latency;
+    UInt32 streamLatency = outputDevice.streamLatency;
+    UInt32 safetyOffset = outputDevice.safetyOffset;
+    bool latencyChanged, streamLatencyChanged, safetyOffsetChanged;
+    Float64 sampleRate;
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        latencyChanged = (latency != gDevice_Latency);
+        streamLatencyChanged = (streamLatency != gStream_Output_Latency);
+        safetyOffsetChanged = (safetyOffset != requestedSafetyOffset);
+        gDevice_Latency = latency;
+        gStream_Output_Latency = streamLatency;
+        requestedSafetyOffset = safetyOffset;
+        sampleRate = gDevice_SampleRate;
+    }
+
+    if (!latencyChanged && !streamLatencyChanged && !safetyOffsetChanged) {
+        return;
+    }
+
+    DebugMsg("ProxyAudio: reported latency is now %u frames, stream latency %u, safety offset %u",
+             latency,
+             streamLatency,
+             safetyOffset);
+
+    ExecuteInAudioOutputThread(^{
+        if (latencyChanged) {
+            AudioObjectPropertyAddress theAddress = {
+                kAudioDevicePropertyLatency, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster};
+            gPlugIn_Host->PropertiesChanged(gPlugIn_Host, kObjectID_Device, 1, &theAddress);
+        }
+
+        if (streamLatencyChanged) {
+            AudioObjectPropertyAddress theAddress = {
+                kAudioStreamPropertyLatency, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster};
+            gPlugIn_Host->PropertiesChanged(gPlugIn_Host, kObjectID_Stream_Output, 1, &theAddress);
+        }
+
+        if (safetyOffsetChanged) {
+            // The HAL only lets this change while IO is stopped, so it goes through a configuration change
+            gPlugIn_Host->RequestDeviceConfigurationChange(gPlugIn_Host, kObjectID_Device, UInt64(sampleRate), NULL);
+        }
+    });
+}
+
 void ProxyAudioDevice::matchOutputDeviceSampleRate()
 {
     DebugMsg("ProxyAudio: matchOutputDeviceSampleRate");
@@ -4884,9 +5124,16 @@ void ProxyAudioDevice::setupTargetOutputDevice() {
 
     DebugMsg("ProxyAudio: setupTargetOutputDevice newOutputDevice: %d", newOutputDevice.id);
     CAMutex::Locker locker(outputDeviceMutex);
+    UInt32 bufferFrameSize = outputDeviceBufferFrameSize;
+
+    if (bufferFrameSize == kOutputDeviceAutoBufferFrameSize) {
+        bufferFrameSize = tunedOutputDeviceBufferFrameSizeNoLock(newOutputDevice.id);
+    } else {
+        bufferSizeTunerDeviceID = kAudioObjectUnknown;
+    }
     
     if (outputDevice.isValid() && outputDevice.id == newOutputDevice.id
-        && outputDevice.bufferFrameSize == outputDeviceBufferFrameSize) {
+        && outputDevice.bufferFrameSize == bufferFrameSize) {
         DebugMsg("ProxyAudio: setupTargetOutputDevice no change in device");
         return;
     }
@@ -4896,12 +5143,15 @@ void ProxyAudioDevice::setupTargetOutputDevice() {
     // we're not using a locking mechanism on its attributes between this function and its IO
     // function.
     deinitializeOutputDeviceNoLock();
+    // Whatever the IO threads have recorded was for the old device or buffer size
+    bufferSizeTuningStats.Collect();
 
     if (newOutputDevice.isValid()) {
         DebugMsg("ProxyAudio: setupTargetOutputDevice setting up new device");
         resetInputData();
         outputDevice = newOutputDevice;
-        outputDevice.setBufferFrameSize(outputDeviceBufferFrameSize);
+        outputDevice.setBufferFrameSize(bufferFrameSize);
+        configureOutputChannelsNoLock();
         outputDevice.setupIOProc(outputDeviceIOProcStatic, this);
         outputDevice.addPropertyListener(kAudioDevicePropertyDeviceIsAlive,
                                          kAudioObjectPropertyScopeGlobal,
@@ -4913,6 +5163,12 @@ void ProxyAudioDevice::setupTargetOutputDevice() {
                                          kAudioObjectPropertyElementMaster,
                                          outputDeviceSampleRateListenerStatic,
                                          this);
+        outputDevice.addPropertyListener(kAudioDevicePropertyStreamConfiguration,
+                                         kAudioObjectPropertyScopeOutput,
+                                         kAudioObjectPropertyElementMaster,
+                                         outputDeviceStreamConfigurationListenerStatic,
+                                         this);
+        configureHardwareVolumeNoLock();
         DebugMsg("ProxyAudio: setupTargetOutputDevice will match sample rate");
         matchOutputDeviceSampleRateNoLock();
     } else {
@@ -4920,6 +5176,142 @@ void ProxyAudioDevice::setupTargetOutputDevice() {
     }
 }
 
+UInt32 ProxyAudioDevice::tunedOutputDeviceBufferFrameSizeNoLock(AudioObjectID deviceID) {
+    // Must be called with outputDeviceMutex held
+    if (deviceID != kAudioObjectUnknown && deviceID != bufferSizeTunerDeviceID) {
+        // Pick up from wherever tuning got to last time we had this device, or start again from a small buffer
+        CFStringSmartRef deviceUID = AudioDevice::copyDeviceUID(deviceID);
+        UInt32 storedSize = retrieveTunedBufferFrameSizeFromStorage(deviceUID);
+
+        if (storedSize != 0) {
+            bufferSizeTuner.Reset(storedSize, true);
+        } else {
+            bufferSizeTuner.Reset(BufferSizeTuner::kStartSize, false);
+        }
+
+        bufferSizeTunerDeviceID = deviceID;
+        DebugMsg("ProxyAudio: tuning buffer size of device %u from %u frames", deviceID, bufferSizeTuner.Size());
+    }
+
+    return bufferSizeTuner.Size();
+}
+
+void ProxyAudioDevice::tuneOutputDeviceBufferFrameSizeNoLock() {
+    // Must be called with outputDeviceMutex held
+    if (!outputDevice.isValid() || outputDevice.id != bufferSizeTunerDeviceID) {
+        return;
+    }
+
+    BufferSizeTuningStats::Snapshot stats = bufferSizeTuningStats.Collect();
+
+    // Only go by time spent actually playing the input
+    if (stats.cycles == 0) {
+        return;
+    }
+
+    Float64 seconds = Float64(stats.cycles) * outputDevice.bufferFrameSize / outputDevice.sampleRate;
+    bool wasSettled = bufferSizeTuner.Settled();
+    bool sizeChanged = bufferSizeTuner.Update(stats, seconds);
+
+    if (bufferSizeTuner.Settled() && !wasSettled) {
+        CFStringSmartRef deviceUID = AudioDevice::copyDeviceUID(outputDevice.id);
+        storeTunedBufferFrameSize(deviceUID, bufferSizeTuner.Size());
+    }
+
+    if (sizeChanged) {
+        // Only the buffer size changes, so just change it on the running device. The resampler, the integer
+        // converter and the input buffer were all sized for anything the tuner might pick, and outputDeviceIOProc
+        // picks the new size up from the buffers the HAL hands it.
+        outputDevice.setBufferFrameSize(bufferSizeTuner.Size());
+        // Whatever the IO threads have recorded was for the old size
+        bufferSizeTuningStats.Collect();
+    }
+}
+
+UInt32 ProxyAudioDevice::maxOutputDeviceBufferFrameSizeNoLock() {
+    // Must be called with outputDeviceMutex held. While the tuner is tuning the output device, it changes the
+    // buffer size without stopping it, so anything that depends on the size has to allow for the largest it may
+    // pick.
+    if (outputDevice.id == bufferSizeTunerDeviceID) {
+        return std::max(outputDevice.bufferFrameSize, UInt32(BufferSizeTuner::kMaxSize));
+    }
+
+    return outputDevice.bufferFrameSize;
+}
+
+void ProxyAudioDevice::configureOutputFormatNoLock() {
+    // Must be called with outputDeviceMutex held, while the output device isn't playing
+    OutputFormat format;
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        format = outputDeviceFormat;
+    }
+
+    if (format == OutputFormat::float32) {
+        outputIntegerConverter.Disable();
+        return;
+    }
+
+    AudioStreamBasicDescription integerFormat;
+
+    // A sample rate change resets the device's format, so this is done again every time the channels are
+    // configured rather than just once in setupTargetOutputDevice. Switching formats can change the device's buffer
+    // layout, so it has to come before the mixer is configured for it.
+    if (outputDevice.setIntegerVirtualFormat(integerFormat) != noErr
+        || outputDevice.getStreamChannelCounts(outputDevice.streamChannelCounts) != noErr) {
+        syslog(LOG_WARNING, "ProxyAudio: couldn't switch output device to an integer format, staying with float");
+        outputIntegerConverter.Disable();
+        return;
+    }
+
+    outputIntegerConverter.Configure(integerFormat,
+                                     format == OutputFormat::ditheredInteger,
+                                     outputDevice.streamChannelCounts,
+                                     maxOutputDeviceBufferFrameSizeNoLock());
+}
+
+void ProxyAudioDevice::configureOutputChannelsNoLock() {
+    // Must be called with outputDeviceMutex held, while the output device isn't playing
+    UInt32 channelCount;
+    std::vector<UInt32> map;
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        channelCount = gDevice_ChannelsPerFrame;
+        map = channelMap;
+    }
+
+    configureOutputFormatNoLock();
+    outputMixer.Configure(channelCount, map, outputDevice.streamChannelCounts);
+    outputResampler.Configure(channelCount, maxOutputDeviceBufferFrameSizeNoLock());
+}
+
+void ProxyAudioDevice::reconfigureOutputChannelsNoLock() {
+    // Must be called with outputDeviceMutex held, on the audio output queue, after the channel count or map or the
+    // output device's buffer layout has changed
+    DebugMsg("ProxyAudio: reconfigureOutputChannelsNoLock");
+
+    if (!outputDevice.isValid()) {
+        resizeInputBuffer();
+        return;
+    }
+
+    // NB: like everything else outputDeviceIOProc reads without locking, the mixer and resampler can only change
+    // while it isn't running
+    outputDeviceReady = false;
+    updateOutputDeviceStartedState();
+    resizeInputBuffer();
+    outputDevice.updateStreamInfo();
+    configureOutputChannelsNoLock();
+    matchOutputDeviceSampleRateNoLock();
+}
+
+void ProxyAudioDevice::reconfigureOutputChannels() {
+    CAMutex::Locker locker(outputDeviceMutex);
+    reconfigureOutputChannelsNoLock();
+}
+
 void ProxyAudioDevice::initializeOutputDevice() {
     dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 1000 * NSEC_PER_MSEC),
                    AudioOutputDispatchQueue(),
@@ -4943,8 +5335,13 @@ void ProxyAudioDevice::deinitializeOutputDeviceNoLock() {
         DebugMsg("ProxyAudio: deinitializeOutputDeviceNoLock stopping device");
         outputDevice.stop();
         outputDeviceReady = false;
+        setOutputIOBuffersWired(false);
         DebugMsg("ProxyAudio: deinitializeOutputDeviceNoLock removing IO proc");
         outputDevice.destroyIOProc();
+        // Hand the device back to other apps
+        outputDevice.restoreVirtualFormats();
+        outputIntegerConverter.Disable();
+        releaseHardwareVolumeNoLock();
         DebugMsg("ProxyAudio: deinitializeOutputDeviceNoLock invalidating");
         outputDevice.invalidate();
     } else {
@@ -4988,16 +5385,147 @@ void ProxyAudioDevice::setupAudioDevicesListener() {
 
 void ProxyAudioDevice::resetInputData() {
     DebugMsg("ProxyAudio: resetInputData");
-    CAMutex::Locker locker(&IOMutex);
-    
-    if (inputBuffer) {
-        inputBuffer->Clear();
-    }
 
-    lastInputFrameTime = -1;
-    lastInputBufferFrameSize = -1;
-    inputOutputSampleDelta = -1;
+    // The IO threads pick this up on their next cycle. DoIOOperation clears inputBuffer before it writes to it
+    // again, and outputDeviceIOProc ignores inputBuffer until it has been written to in the new epoch, then
+    // recalculates inputOutputSampleDelta.
     inputFinalFrameTime = -1;
+    inputResetEpoch.fetch_add(1, std::memory_order_release);
+}
+
+UInt32 ProxyAudioDevice::inputBufferCapacityFrames(Float64 sampleRate,
+                                                   UInt32 targetBufferFrameSize,
+                                                   UInt32 latencyBudget) {
+    // outputDeviceIOProc reads roughly one of our IO buffers plus one of the target's behind the newest input, and
+    // the latency budget is how much further than that it may drift before it runs off the start of the buffer.
+    // Leave room for two of each buffer so a late cycle on either side doesn't eat into the budget.
+    if (targetBufferFrameSize == kOutputDeviceAutoBufferFrameSize) {
+        // Leave room for the largest size it could be tuned to, so tuning never has to resize the buffer
+        targetBufferFrameSize = BufferSizeTuner::kMaxSize;
+    }
+
+    Float64 budgetFrames = sampleRate * latencyBudget / 1000.0;
+    return UInt32(budgetFrames) + 2 * (kDevice_MaxExpectedIOBufferFrameSize + targetBufferFrameSize);
+}
+
+void ProxyAudioDevice::resizeInputBuffer() {
+    // Only called on the audio output queue, so resizes never overlap
+    UInt32 capacityFrames;
+    UInt32 bytesPerFrame;
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        capacityFrames = inputBufferCapacityFrames(gDevice_SampleRate, outputDeviceBufferFrameSize, latencyBudget);
+        bytesPerFrame = gDevice_BytesPerFrameInChannel * gDevice_ChannelsPerFrame;
+    }
+
+    // Nothing but us replaces inputBuffer, so we can look at it without inputBufferMutex, and allocate and prefault
+    // the new one before taking it
+    AudioRingBuffer *oldBuffer = inputBuffer.load();
+
+    if (oldBuffer && oldBuffer->mCapacityFrames == AudioRingBuffer::RoundedCapacityFrames(capacityFrames)
+        && oldBuffer->mBytesPerFrame == bytesPerFrame) {
+        return;
+    }
+
+    DebugMsg("ProxyAudio: resizeInputBuffer resizing to %u frames of %u bytes", capacityFrames, bytesPerFrame);
+    AudioRingBuffer *newBuffer = new AudioRingBuffer(bytesPerFrame, capacityFrames);
+
+    {
+        // Only take this after letting go of stateMutex, as StartIO takes them the other way round. It's only held
+        // for the swap, so StartIO never waits on the IO threads.
+        CAMutex::Locker locker(inputBufferMutex);
+
+        if (inputBufferWired && !wireInputBuffer(newBuffer)) {
+            syslog(LOG_WARNING, "ProxyAudio: couldn't lock resized input buffer into memory");
+        }
+
+        inputBuffer.store(newBuffer);
+    }
+
+    retireInputBuffer(oldBuffer);
+}
+
+void ProxyAudioDevice::retireInputBuffer(AudioRingBuffer *buffer) {
+    // Called on the audio output queue. The IO threads pick up the new buffer at the start of their next cycle.
+    // Neither of them can be made to wait for us, so we check back until neither has the old buffer marked in use,
+    // after which nothing can reach it.
+    if (inputBufferInUseByWriter.load() == buffer || inputBufferInUseByReader.load() == buffer) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_MSEC), AudioOutputDispatchQueue(), ^{
+            retireInputBuffer(buffer);
+        });
+        return;
+    }
+
+    delete buffer;
+}
+
+bool ProxyAudioDevice::wireInputBuffer(AudioRingBuffer *buffer) {
+    // A long latency budget with many channels at a high sample rate can call for a buffer of hundreds of megabytes,
+    // far too much to lock into memory. A buffer that big is only prefaulted, and may page fault if it's paged out.
+    // Returns false only if locking it failed.
+    if (buffer->mAllocatedBytes > kMaxWiredInputBufferBytes) {
+        syslog(LOG_NOTICE,
+               "ProxyAudio: input buffer of %zu bytes is too large to lock into memory",
+               buffer->mAllocatedBytes);
+        return true;
+    }
+
+    return buffer->Wire();
+}
+
+void ProxyAudioDevice::setIOBuffersWired(bool wired) {
+    // Wires what both IO threads use: the input buffer and the real-time log
+    CAMutex::Locker locker(inputBufferMutex);
+
+    if (wired == inputBufferWired) {
+        return;
+    }
+
+    DebugMsg("ProxyAudio: setIOBuffersWired %d", wired);
+    AudioRingBuffer *buffer = inputBuffer.load();
+
+    if (!wired) {
+        buffer->Unwire();
+        RealTimeLog::Shared().SetWired(false);
+    } else {
+        // Not fatal, we just lose the guarantee that the IO threads won't page fault
+        if (!wireInputBuffer(buffer)) {
+            syslog(LOG_WARNING, "ProxyAudio: couldn't lock input buffer into memory");
+        }
+
+        if (!RealTimeLog::Shared().SetWired(true)) {
+            syslog(LOG_WARNING, "ProxyAudio: couldn't lock real-time log into memory");
+        }
+    }
+
+    inputBufferWired = wired;
+}
+
+void ProxyAudioDevice::setOutputIOBuffersWired(bool wired) {
+    // Called on the audio output queue, which is also where the resampler and converter are configured. They keep
+    // themselves wired across reconfiguration.
+    if (!outputResampler.SetWired(wired) || !outputIntegerConverter.SetWired(wired)) {
+        syslog(LOG_WARNING, "ProxyAudio: couldn't lock output IO buffers into memory");
+    }
+}
+
+AudioRingBuffer *ProxyAudioDevice::acquireInputBuffer(std::atomic<AudioRingBuffer *> &inUse) {
+    // Called by an IO thread at the start of its cycle, which has to store NULL in inUse again when it's done.
+    // Marking the buffer in use and then checking it's still current means resizeInputBuffer either sees the mark
+    // or has already replaced the buffer before we look, in which case we go round again for the new one.
+    AudioRingBuffer *buffer = inputBuffer.load();
+
+    while (true) {
+        inUse.store(buffer);
+        AudioRingBuffer *currentBuffer = inputBuffer.load();
+
+        if (currentBuffer == buffer) {
+            return buffer;
+        }
+
+        buffer = currentBuffer;
+    }
 }
 
 OSStatus ProxyAudioDevice::StartIO(AudioServerPlugInDriverRef inDriver,
@@ -5017,27 +5545,39 @@ OSStatus ProxyAudioDevice::StartIO(AudioServerPlugInDriverRef inDriver,
     DebugMsg("ProxyAudio: StartIO");
     resetInputData();
 
-    CAMutex::Locker locker(stateMutex);
+    bool ioIsRunning;
 
-    //    figure out what we need to do
-    if (gDevice_IOIsRunning == UINT64_MAX) {
-        //    overflowing is an error
-        theAnswer = kAudioHardwareIllegalOperationError;
-    } else if (gDevice_IOIsRunning == 0) {
-        //    We need to start the hardware, which in this case is just anchoring the time line.
-        gDevice_IOIsRunning = 1;
-        gDevice_NumberTimeStamps = 0;
-        gDevice_AnchorSampleTime = 0;
-        gDevice_AnchorHostTime = mach_absolute_time();
-        gDevice_ElapsedTicks = 0;
-        outputAccumulatedRateRatio = 0.0;
-        outputAccumulatedRateRatioSamples = 0;
-    } else {
-        //    IO is already running, so just bump the counter
-        ++gDevice_IOIsRunning;
+    {
+        CAMutex::Locker locker(stateMutex);
+
+        //    figure out what we need to do
+        if (gDevice_IOIsRunning == UINT64_MAX) {
+            //    overflowing is an error
+            theAnswer = kAudioHardwareIllegalOperationError;
+        } else if (gDevice_IOIsRunning == 0) {
+            //    We need to start the hardware, which in this case is just anchoring the time line.
+            gDevice_IOIsRunning = 1;
+
+            // Only rate scalar samples from here on count towards the rate ratio
+            gDevice_ZeroTimeStampClock.Start(
+                mach_absolute_time(), gDevice_ZeroTimeStampPeriod, gDevice_SampleRate, gDevice_HostTicksPerFrame);
+        } else {
+            //    IO is already running, so just bump the counter
+            ++gDevice_IOIsRunning;
+        }
+
+        ioIsRunning = (gDevice_IOIsRunning > 0);
+        inputIOIsActive = ioIsRunning;
     }
-    
-    inputIOIsActive = (gDevice_IOIsRunning > 0);
+
+    // Wire the input buffer and log before returning so their pages are resident by our first IO cycle. Locking
+    // megabytes into memory can take a while, so it's done after letting go of stateMutex rather than holding up
+    // every property call behind it. If a StopIO gets in first, the update queued below still runs after this and
+    // unwires them again once neither IO thread is running.
+    if (ioIsRunning) {
+        setIOBuffersWired(true);
+    }
+
     ExecuteInAudioOutputThread(^ () { updateOutputDeviceStartedState(); });
     
     DebugMsg("ProxyAudio: StartIO finished");
@@ -5053,7 +5593,8 @@ OSStatus ProxyAudioDevice::StopIO(AudioServerPlugInDriverRef inDriver,
 
 #pragma unused(inClientID)
     DebugMsg("ProxyAudio: StopIO");
-    inputFinalFrameTime = lastInputFrameTime + lastInputBufferFrameSize;
+    InputPosition lastPosition = lastInputPosition.Load();
+    inputFinalFrameTime = lastPosition.frameTime + lastPosition.bufferFrameSize;
 
     //    declare the local variables
     OSStatus theAnswer = 0;
@@ -5104,65 +5645,35 @@ OSStatus ProxyAudioDevice::GetZeroTimeStamp(AudioServerPlugInDriverRef inDriver,
     //    kAudioDevicePropertyZeroTimeStampPeriod apart. This is often modeled using a ring buffer
     //    where the zero time stamp is updated when wrapping around the ring buffer.
     //
-    //    For this device, the zero time stamps' sample time increments every kDevice_RingBufferSize
-    //    frames and the host time increments by kDevice_RingBufferSize * gDevice_HostTicksPerFrame.
+    //    For this device, the zero time stamps' sample time increments every gDevice_ZeroTimeStampPeriod
+    //    frames and the host time increments by however many host ticks the output device takes to
+    //    play that many frames, as tracked by gDevice_ZeroTimeStampClock.
 
 #pragma unused(inClientID)
     
     //    declare the local variables
     OSStatus theAnswer = 0;
-    UInt64 theCurrentHostTime;
-    Float64 theHostTicksPerRingBuffer;
-    Float64 theHostTickOffset;
-    UInt64 theNextHostTime;
+    OutputClockTimeStamp outputTimeStamp;
+    bool haveOutputTimeStamp;
 
     //    check the arguments
-    FailWithAction(inDriver != gAudioServerPlugInDriverRef,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "GetZeroTimeStamp: bad driver reference");
-    FailWithAction(inDeviceObjectID != kObjectID_Device,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "GetZeroTimeStamp: bad device ID");
-
-    {
-        CAMutex::Locker locker(&getZeroTimestampMutex);
-        
-        //    get the current host time
-        theCurrentHostTime = mach_absolute_time();
-
-        // In order to keep the input and output IO in sync, we keep a running
-        // average of the output IO proc's mRateScalar field for its output time.
-        // Then each time we calculate the next zero timestamp we slightly adjust
-        // the tick count for our ring buffer by however much the output IO proc
-        // deviated from its sample rate.
-        
-        Float64 rateRatio = 1.0;
-        
-        if (outputAccumulatedRateRatioSamples > 0) {
-            rateRatio = outputAccumulatedRateRatio / outputAccumulatedRateRatioSamples;
-        }
-        
-        //    calculate the next host time
-        theHostTicksPerRingBuffer =
-            gDevice_HostTicksPerFrame * ((Float64)kDevice_RingBufferSize) * rateRatio;
-        theHostTickOffset = gDevice_ElapsedTicks + theHostTicksPerRingBuffer;
-        theNextHostTime = gDevice_AnchorHostTime + ((UInt64)theHostTickOffset);
-
-        //    go to the next time if the next host time is less than the current time
-        if (theNextHostTime <= theCurrentHostTime) {
-            ++gDevice_NumberTimeStamps;
-            gDevice_ElapsedTicks += theHostTicksPerRingBuffer;
-        }
-
-        //    set the return values
-        *outSampleTime = gDevice_NumberTimeStamps * kDevice_RingBufferSize;
-        *outHostTime = gDevice_AnchorHostTime + gDevice_ElapsedTicks;
-        *outSeed = 1;
-        outputAccumulatedRateRatio = 0.0;
-        outputAccumulatedRateRatioSamples = 0;
-    }
+    RTFailWithAction(inDriver != gAudioServerPlugInDriverRef,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "GetZeroTimeStamp: bad driver reference");
+    RTFailWithAction(inDeviceObjectID != kObjectID_Device,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "GetZeroTimeStamp: bad device ID");
+
+    // If outputDeviceIOProc happens to be publishing its time stamp right now, don't wait for it, the clock just
+    // carries on with its current estimate until next time
+    haveOutputTimeStamp = outputClockTimeStamp.TryLoad(outputTimeStamp);
+    gDevice_ZeroTimeStampClock.GetZeroTimeStamp(mach_absolute_time(),
+                                                haveOutputTimeStamp ? &outputTimeStamp : NULL,
+                                                *outSampleTime,
+                                                *outHostTime);
+    *outSeed = 1;
 
 Done:
     return theAnswer;
@@ -5185,14 +5696,14 @@ OSStatus ProxyAudioDevice::WillDoIOOperation(AudioServerPlugInDriverRef inDriver
     bool willDoInPlace = true;
 
     //    check the arguments
-    FailWithAction(inDriver != gAudioServerPlugInDriverRef,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "WillDoIOOperation: bad driver reference");
-    FailWithAction(inDeviceObjectID != kObjectID_Device,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "WillDoIOOperation: bad device ID");
+    RTFailWithAction(inDriver != gAudioServerPlugInDriverRef,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "WillDoIOOperation: bad driver reference");
+    RTFailWithAction(inDeviceObjectID != kObjectID_Device,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "WillDoIOOperation: bad device ID");
 
     //    figure out if we support the operation
     switch (inOperationID) {
@@ -5234,14 +5745,14 @@ OSStatus ProxyAudioDevice::BeginIOOperation(AudioServerPlugInDriverRef inDriver,
     OSStatus theAnswer = 0;
 
     //    check the arguments
-    FailWithAction(inDriver != gAudioServerPlugInDriverRef,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "BeginIOOperation: bad driver reference");
-    FailWithAction(inDeviceObjectID != kObjectID_Device,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "BeginIOOperation: bad device ID");
+    RTFailWithAction(inDriver != gAudioServerPlugInDriverRef,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "BeginIOOperation: bad driver reference");
+    RTFailWithAction(inDeviceObjectID != kObjectID_Device,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "BeginIOOperation: bad device ID");
 
 Done:
     return theAnswer;
@@ -5265,39 +5776,79 @@ OSStatus ProxyAudioDevice::DoIOOperation(AudioServerPlugInDriverRef inDriver,
     OSStatus theAnswer = 0;
 
     //    check the arguments
-    FailWithAction(inDriver != gAudioServerPlugInDriverRef,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "DoIOOperation: bad driver reference");
-    FailWithAction(inDeviceObjectID != kObjectID_Device,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "DoIOOperation: bad device ID");
-    FailWithAction((inStreamObjectID != kObjectID_Stream_Output),
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "DoIOOperation: bad stream ID");
+    RTFailWithAction(inDriver != gAudioServerPlugInDriverRef,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "DoIOOperation: bad driver reference");
+    RTFailWithAction(inDeviceObjectID != kObjectID_Device,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "DoIOOperation: bad device ID");
+    RTFailWithAction((inStreamObjectID != kObjectID_Stream_Output),
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "DoIOOperation: bad stream ID");
 
     //    clear the buffer if this iskAudioServerPlugInIOOperationReadInput
     if (inOperationID == kAudioServerPlugInIOOperationReadInput) {
-        memset(ioMainBuffer, 0, inIOBufferFrameSize * 8);
+        memset(ioMainBuffer, 0, inIOBufferFrameSize * gDevice_BytesPerFrameInChannel * gDevice_ChannelsPerFrame);
 
     } else if (inOperationID == kAudioServerPlugInIOOperationWriteMix) {
-        if (inputBuffer) {
-            CAMutex::Locker locker(IOMutex);
+        AudioRingBuffer *buffer = acquireInputBuffer(inputBufferInUseByWriter);
+
+        // Right after the channel count changes, IO can start again before resizeInputBuffer has replaced
+        // inputBuffer with one for the new frame size
+        if (buffer && buffer->mBytesPerFrame == gDevice_BytesPerFrameInChannel * gDevice_ChannelsPerFrame) {
+            UInt32 epoch = inputResetEpoch.load(std::memory_order_acquire);
+
+            if (epoch != inputWriterEpoch) {
+                // resetInputData has been called since our last cycle. We're inputBuffer's only writer, so the
+                // clear takes effect with the Store below.
+                buffer->Clear();
+                inputWriterEpoch = epoch;
+            }
 
-            inputBuffer->Store((const Byte *)ioMainBuffer, inIOBufferFrameSize, inIOCycleInfo->mOutputTime.mSampleTime);
-            
-            lastInputFrameTime = inIOCycleInfo->mOutputTime.mSampleTime;
-            lastInputBufferFrameSize = inIOBufferFrameSize;
-            inputCycleCount += 1;
+            buffer->Store((const Byte *)ioMainBuffer, inIOBufferFrameSize, inIOCycleInfo->mOutputTime.mSampleTime);
+
+            // The HAL means to start this cycle a buffer and safety offset ahead of its output time, which only
+            // change while IO is stopped
+            Float64 framesUntilOutput =
+                Float64(SInt64(inIOCycleInfo->mOutputTime.mHostTime - inIOCycleInfo->mCurrentTime.mHostTime))
+                / gDevice_HostTicksPerFrame;
+            Float64 lateness = inIOBufferFrameSize + gDevice_SafetyOffset - framesUntilOutput;
+            bufferSizeTuningStats.RecordInputCycle(SInt32(std::max(lateness, 0.0)));
+            ioTelemetry.RecordInputCycle();
+
+            InputPosition position = {epoch,
+                                      inIOCycleInfo->mOutputTime.mSampleTime,
+                                      inIOCycleInfo->mOutputTime.mHostTime,
+                                      (Float64)inIOBufferFrameSize};
+            lastInputPosition.Store(position);
         }
+
+        inputBufferInUseByWriter.store(NULL, std::memory_order_release);
     }
 
 Done:
     return theAnswer;
 }
 
+static UInt64 threadCPUNanoseconds() {
+    // The CPU time the calling thread has used so far, or 0 if the kernel won't say. thread_info rather than
+    // clock_gettime_nsec_np, which needs macOS 10.12. It's a single trap that doesn't allocate or take any locks,
+    // and pthread_mach_thread_np doesn't take a port reference the way mach_thread_self does, so this is safe on an
+    // IO thread.
+    thread_extended_info_data_t info;
+    mach_msg_type_number_t count = THREAD_EXTENDED_INFO_COUNT;
+
+    if (thread_info(pthread_mach_thread_np(pthread_self()), THREAD_EXTENDED_INFO, (thread_info_t)&info, &count)
+        != KERN_SUCCESS) {
+        return 0;
+    }
+
+    return info.pth_user_time + info.pth_system_time;
+}
+
 OSStatus ProxyAudioDevice::outputDeviceIOProcStatic(AudioDeviceID inDevice,
                                                     const AudioTimeStamp *inNow,
                                                     const AudioBufferList *inInputData,
@@ -5313,6 +5864,22 @@ OSStatus ProxyAudioDevice::outputDeviceIOProcStatic(AudioDeviceID inDevice,
         ->outputDeviceIOProc(inDevice, inNow, inInputData, inInputTime, outOutputData, inOutputTime);
 }
 
+UInt32 ProxyAudioDevice::outputBufferFrameSize(const AudioBufferList *outputData) {
+    // Called from outputDeviceIOProc
+    UInt32 bytesPerSample =
+        outputIntegerConverter.IsActive() ? outputIntegerConverter.BytesPerSample() : UInt32(sizeof(Float32));
+
+    for (UInt32 i = 0; i < outputData->mNumberBuffers; i++) {
+        const AudioBuffer &buffer = outputData->mBuffers[i];
+
+        if (buffer.mNumberChannels > 0) {
+            return buffer.mDataByteSize / (buffer.mNumberChannels * bytesPerSample);
+        }
+    }
+
+    return outputDevice.bufferFrameSize;
+}
+
 OSStatus ProxyAudioDevice::outputDeviceIOProc(AudioDeviceID inDevice,
                                               const AudioTimeStamp *inNow,
                                               const AudioBufferList *inInputData,
@@ -5320,123 +5887,287 @@ OSStatus ProxyAudioDevice::outputDeviceIOProc(AudioDeviceID inDevice,
                                               AudioBufferList *outOutputData,
                                               const AudioTimeStamp *inOutputTime) {
 #pragma unused(inDevice)
-#pragma unused(inNow)
 #pragma unused(inInputData)
 #pragma unused(inInputTime)
-    CAMutex::Locker locker1(IOMutex);
+    UInt64 cycleStartHostTime = mach_absolute_time();
+    UInt64 cycleStartCPUNanoseconds = threadCPUNanoseconds();
+    ioTelemetry.RecordOutputCall();
 
     // In theory we don't need a locking mechanism here, because outputDevice will only be modified
-    // while it is not playing.
+    // while it is not playing. The exception is the buffer size, which the tuner changes on the running device, so
+    // go by the buffers we've been handed instead.
     Float64 currentOutputDeviceSampleRate = outputDevice.sampleRate;
-    UInt32 currentOutputDeviceBufferFrameSize = outputDevice.bufferFrameSize;
+    UInt32 currentOutputDeviceBufferFrameSize = outputBufferFrameSize(outOutputData);
     UInt32 currentOutputDeviceSafetyOffset = outputDevice.safetyOffset;
-    Float64 currentInputDeviceSampleRate;
-    UInt32 currentInputDeviceChannelCount;
-    Float32 currentVolumeR, currentVolumeL;
-    bool currentMute;
+    // The channel count the mixer and resampler were set up for, which can be behind gDevice_ChannelsPerFrame
+    // until reconfigureOutputChannels has run
+    UInt32 currentInputDeviceChannelCount = outputMixer.InputChannelCount();
+
+    // If a control thread happens to be in the middle of publishing new state, just use what we had last cycle
+    // rather than waiting for it; the change will be picked up next cycle.
+    ioState.TryLoad(ioProcState);
+    Float64 currentInputDeviceSampleRate = ioProcState.sampleRate;
+    
+    // Hand our time stamp to GetZeroTimeStamp, which keeps the HAL's clock locked to this device's
+    outputClockTimeStampCount += 1;
+    OutputClockTimeStamp outputTimeStamp = {
+        inOutputTime->mSampleTime, inOutputTime->mHostTime, outputClockTimeStampCount};
+    outputClockTimeStamp.Store(outputTimeStamp);
+    
+    UInt32 epoch = inputResetEpoch.load(std::memory_order_acquire);
 
-    {
-        CAMutex::Locker stateLocker(&stateMutex);
-        currentInputDeviceSampleRate = gDevice_SampleRate;
-        currentInputDeviceChannelCount = gDevice_ChannelsPerFrame;
-        currentVolumeR = gVolume_Output_R_Value;
-        currentVolumeL = gVolume_Output_L_Value;
-        currentMute = gMute_Output_Mute;
+    if (epoch != outputReaderEpoch) {
+        // resetInputData has been called since our last cycle
+        outputReaderEpoch = epoch;
+        inputOutputSampleDelta = -1;
+        lastOutputSampleTime = -1;
     }
-    
-    {
-        CAMutex::Locker locker(&getZeroTimestampMutex);
-        
-        // We don't need to keep taking samples of the device's ratio past
-        // 10000 samples. If we get that far then the device is idling.
-        if (outputAccumulatedRateRatioSamples < 10000) {
-            outputAccumulatedRateRatio += inOutputTime->mRateScalar;
-            outputAccumulatedRateRatioSamples += 1;
-        }
+
+    // The HAL skips the output device's sample time ahead when its IO thread misses a deadline
+    bool outputSkipped = (lastOutputSampleTime >= 0
+                          && inOutputTime->mSampleTime - lastOutputSampleTime > lastOutputBufferFrameSize);
+    lastOutputSampleTime = inOutputTime->mSampleTime;
+
+    if (currentOutputDeviceBufferFrameSize != lastOutputBufferFrameSize) {
+        // The buffer size has been tuned, which moves where we should be reading from
+        lastOutputBufferFrameSize = currentOutputDeviceBufferFrameSize;
+        inputOutputSampleDelta = -1;
     }
-    
-    inputCycleCount = 0;
 
-    if (lastInputFrameTime < 0 || lastInputBufferFrameSize < 0) {
+    // Like ioState, if the HAL's IO thread is in the middle of publishing, go with what we read last cycle
+    lastInputPosition.TryLoad(outputReaderInputPosition);
+    Float64 lastInputFrameTime = outputReaderInputPosition.frameTime;
+    Float64 lastInputBufferFrameSize = outputReaderInputPosition.bufferFrameSize;
+
+    // Anything written before the reset is stale, and inputBuffer may not have been cleared yet
+    if (outputReaderInputPosition.epoch != epoch || lastInputFrameTime < 0 || lastInputBufferFrameSize < 0) {
         return noErr;
     }
 
     if (currentOutputDeviceSampleRate != currentInputDeviceSampleRate) {
-        DebugMsg("ProxyAudio: cannot play, mismatched sample rate");
+        RTDebugMsg("ProxyAudio: cannot play, mismatched sample rate");
         return noErr;
     }
 
     if (inputOutputSampleDelta == -1) {
-        DebugMsg("ProxyAudio: outputDeviceIOProc recalculating inputOutputSampleDelta");
+        RTDebugMsg("ProxyAudio: outputDeviceIOProc recalculating inputOutputSampleDelta");
         Float64 targetFrameTime = (lastInputFrameTime - lastInputBufferFrameSize - currentOutputDeviceBufferFrameSize
                                    - currentOutputDeviceSafetyOffset);
         inputOutputSampleDelta = targetFrameTime - inOutputTime->mSampleTime;
+        resampledFrameOffset = 0;
+        outputPassthrough = false;
+        inputDriftEstimator.Reset();
+        // Whatever distance we measure this cycle is the one to hold from now on
+        inputFillLevelController.Reset(currentOutputDeviceSampleRate);
         smallestFramesToBufferEnd = -1;
+        ioTelemetry.ResetRingDistance();
     }
 
-    Float64 startFrame = inOutputTime->mSampleTime + inputOutputSampleDelta;
+    // The HAL's clock is kept close to the output device's by GetZeroTimeStamp, but not close enough for a fixed
+    // delta to hold for hours, so measure how far apart they drift and resample the input to make up for it. That
+    // alone would still let the read position wander, so on top of it keep steering the distance between the read
+    // position and the newest input back to where it started.
+    inputDriftEstimator.Update(
+        lastInputFrameTime, outputReaderInputPosition.hostTime, inOutputTime->mSampleTime, inOutputTime->mHostTime);
+    Float64 readPosition = inOutputTime->mSampleTime + inputOutputSampleDelta + resampledFrameOffset;
+
+    // The two sides write and read in whole buffers at unrelated times, so rather than the distance to the start
+    // of the newest input, which jumps a whole input buffer at a time, measure the distance to where the input
+    // time line is at this cycle's host time
+    Float64 hostTicksSinceLastInput = Float64(SInt64(inOutputTime->mHostTime - outputReaderInputPosition.hostTime));
+    Float64 inputFrameTimeNow = lastInputFrameTime + hostTicksSinceLastInput / ioProcState.hostTicksPerFrame;
+    Float64 ratio = inputDriftEstimator.Ratio()
+                    + inputFillLevelController.Update(inputFrameTimeNow - readPosition,
+                                                      currentOutputDeviceBufferFrameSize);
+    ratio = std::min(std::max(ratio, 1.0 - AudioResampler::kMaxRatioDeviation),
+                     1.0 + AudioResampler::kMaxRatioDeviation);
+    // The controller holds the distance at its target, so that's how far behind the HAL we play. monitorUserActivity
+    // picks this up and reports it as our latency.
+    inputLatencyFrames.store(inputFillLevelController.TargetDistance(), std::memory_order_relaxed);
+    Float64 startFrame = floor(readPosition);
 
     if (inputFinalFrameTime != -1 && startFrame >= inputFinalFrameTime) {
         return noErr;
     }
 
-    bool overrun = inputBuffer->Fetch(workBuffer, currentOutputDeviceBufferFrameSize, (SInt64)startFrame);
+    // The volume controls are for the first two channels. Any others get the average of the two.
+    Float32 channelGains[kAudioMixerMaxChannels];
+    channelGains[0] = ioProcState.volumeFactorL;
+    channelGains[1] = ioProcState.volumeFactorR;
+    std::fill(channelGains + 2,
+              channelGains + kAudioMixerMaxChannels,
+              0.5f * (ioProcState.volumeFactorL + ioProcState.volumeFactorR));
+    AudioMixGains gains;
+    gains.Set(channelGains, currentInputDeviceChannelCount);
+
+    AudioRingBuffer *buffer = acquireInputBuffer(inputBufferInUseByReader);
+    bool overrun;
+
+    if (buffer->mBytesPerFrame != gDevice_BytesPerFrameInChannel * currentInputDeviceChannelCount) {
+        // The input buffer has already been replaced for a new channel count, and we're about to be stopped and
+        // set up for it
+        inputBufferInUseByReader.store(NULL, std::memory_order_release);
+        return noErr;
+    }
+
+    // At unity gain, with every channel going to the output channel with the same number and nothing to convert,
+    // the input can go out exactly as it came in. That rules out resampling, so CanBypass only allows it while
+    // there's no drift to speak of to correct, and hands back to resampling before the read position has wandered
+    // far. Otherwise copying would leave the read position to follow the drift a whole frame at a time, and every
+    // frame it skipped or played twice would be a click. Whether to correct drift has nothing to do with the gain,
+    // so that's decided the same way whatever the volume.
+    bool passthrough = gains.unity && outputMixer.GetLayout() == AudioMixer::Layout::matchingInterleaved
+                       && !outputIntegerConverter.IsActive()
+                       && AudioResampler::CanBypass(ratio, inputFillLevelController.SmoothedError(), outputPassthrough);
+    outputPassthrough = passthrough;
+
+    if (passthrough) {
+        // Copying goes from a whole frame, so read from the nearest one. Coming from resampling, that moves the read
+        // position by up to half a frame, once per switch. After that it stays on whole frames, as the ratio is now
+        // exactly 1.
+        Float64 nearestFrame = floor(readPosition + 0.5);
+        resampledFrameOffset += nearestFrame - readPosition;
+        startFrame = nearestFrame;
+        ratio = 1.0;
+    }
+
+    // The mixer can't accumulate into integer buffers, so when the output device has an integer format, mix into
+    // float ones and convert them afterwards
+    AudioBufferList *mixBuffers = outputIntegerConverter.IsActive()
+                                      ? outputIntegerConverter.MixBuffers(currentOutputDeviceBufferFrameSize)
+                                      : outOutputData;
+
+    if (passthrough) {
+        overrun = buffer->Read(currentOutputDeviceBufferFrameSize,
+                               (SInt64)startFrame,
+                               [&](const Byte *span, UInt32 frameOffset, UInt32 spanFrames) {
+                                   const Float32 *input = (const Float32 *)span;
+
+                                   // Only if the HAL has changed the buffer layout on us does this have to mix
+                                   if (!outputMixer.Copy(input, frameOffset, spanFrames, outOutputData)) {
+                                       outputMixer.Mix(input, frameOffset, spanFrames, gains, outOutputData);
+                                   }
+                               });
+        ioTelemetry.RecordPassthroughCycle();
+    } else if (outputResampler.CanProcess(currentOutputDeviceBufferFrameSize)) {
+        // Resampling needs the input in one piece, with a frame of history before the read position
+        Float64 fraction = readPosition - startFrame;
+        UInt32 inputFrames =
+            AudioResampler::InputFramesNeeded(fraction, currentOutputDeviceBufferFrameSize, ratio);
+        overrun = buffer->Fetch((Byte *)outputResampler.InputBuffer(), inputFrames, SInt64(startFrame) - 1);
+        outputResampler.Process(fraction, ratio, currentOutputDeviceBufferFrameSize);
+        outputMixer.Mix(outputResampler.OutputBuffer(), 0, currentOutputDeviceBufferFrameSize, gains, mixBuffers);
+    } else {
+        // The resampler wasn't set up for cycles this long. Mix straight out of the ring buffer, one pass per
+        // contiguous span of it, rather than copying the input out first. Frames the ring doesn't have simply
+        // aren't mixed in. The read position still follows the ratio, just a whole frame at a time.
+        overrun = buffer->Read(currentOutputDeviceBufferFrameSize,
+                               (SInt64)startFrame,
+                               [&](const Byte *span, UInt32 frameOffset, UInt32 spanFrames) {
+                                   outputMixer.Mix(
+                                       (const Float32 *)span, frameOffset, spanFrames, gains, mixBuffers);
+                               });
+    }
+
+    if (outputIntegerConverter.IsActive()) {
+        outputIntegerConverter.Convert(outOutputData, currentOutputDeviceBufferFrameSize);
+    }
+
+    resampledFrameOffset += (ratio - 1.0) * currentOutputDeviceBufferFrameSize;
+
+    SInt64 framesToBufferEnd =
+        buffer->EndFrame() - (SInt64(startFrame) + SInt64(currentOutputDeviceBufferFrameSize));
+    bool unexpectedOverrun = (overrun && inputFinalFrameTime == -1 && startFrame >= buffer->StartFrame());
+
+    if (inputFinalFrameTime == -1) {
+        // Once the HAL has stopped, the input running out is expected rather than a sign of anything
+        Float64 framesUntilOutput =
+            Float64(SInt64(inOutputTime->mHostTime - inNow->mHostTime)) / ioProcState.hostTicksPerFrame;
+        Float64 lateness = currentOutputDeviceBufferFrameSize + currentOutputDeviceSafetyOffset - framesUntilOutput;
+        bufferSizeTuningStats.RecordOutputCycle(SInt32(std::min(std::max(framesToBufferEnd, SInt64(INT32_MIN)),
+                                                                SInt64(INT32_MAX))),
+                                                SInt32(std::max(lateness, 0.0)));
+
+        if (outputSkipped || unexpectedOverrun) {
+            bufferSizeTuningStats.RecordGlitch();
+        }
+
+        // Whatever part of the cycle fell outside the input in the ring went out as silence
+        SInt64 readStart = SInt64(startFrame);
+        SInt64 readEnd = readStart + SInt64(currentOutputDeviceBufferFrameSize);
+        SInt64 bufferStart = buffer->StartFrame();
+        SInt64 bufferEnd = buffer->EndFrame();
+        SInt64 framesAvailable = std::min(readEnd, bufferEnd) - std::max(readStart, bufferStart);
+        ioTelemetry.RecordOutputCycle(
+            UInt32(currentOutputDeviceBufferFrameSize - std::min(std::max(framesAvailable, SInt64(0)),
+                                                                 SInt64(currentOutputDeviceBufferFrameSize))),
+            readEnd > bufferEnd,
+            readStart < bufferStart,
+            bufferEnd - readStart);
+    }
 
 #if DEBUG
     // This is just some debugging info to tell when we might be gradually
     // approaching the end of the input buffer and headed for a buffer
     // overrun
-    SInt64 framesToBufferEnd =
-        inputBuffer->mEndFrame - (SInt64(startFrame) + SInt64(currentOutputDeviceBufferFrameSize));
-
     if (smallestFramesToBufferEnd == -1
         || (framesToBufferEnd < smallestFramesToBufferEnd && smallestFramesToBufferEnd >= 0)) {
         smallestFramesToBufferEnd = framesToBufferEnd;
-        //DebugMsg("ProxyAudio: frames to buffer end shrunk, is now: %lld", smallestFramesToBufferEnd);
+        //RTDebugMsg("ProxyAudio: frames to buffer end shrunk, is now: %lld", smallestFramesToBufferEnd);
     }
 #endif
 
-    if (overrun && inputFinalFrameTime == -1 && startFrame >= inputBuffer->mStartFrame) {
+    if (unexpectedOverrun) {
         // Since this warning could conceivably happen every cycle, explicitly make it
         // only appear once every five seconds at most
-        static time_t lastBufferOverrunWarning = 0;
-        time_t seconds;
-        time(&seconds);
+        UInt64 hostTicksPerSecond = UInt64(ioProcState.hostTicksPerFrame * currentInputDeviceSampleRate);
         
-        if ((seconds - lastBufferOverrunWarning) > 5) {
-            lastBufferOverrunWarning = seconds;
-            syslog(LOG_WARNING, "ProxyAudio: output unexpected overrun");
-            syslog(LOG_WARNING, "ProxyAudio: output frame: %lf", startFrame);
-            syslog(LOG_WARNING,
-                   "ProxyAudio: output buffer start: %llu    end: %llu",
-                   inputBuffer->mStartFrame,
-                   inputBuffer->mEndFrame);
+        if (cycleStartHostTime - lastBufferOverrunWarningHostTime > 5 * hostTicksPerSecond) {
+            lastBufferOverrunWarningHostTime = cycleStartHostTime;
+            RTLog(LOG_WARNING, "ProxyAudio: output unexpected overrun");
+            RTLog(LOG_WARNING, "ProxyAudio: output frame: %lf", startFrame);
+            RTLog(LOG_WARNING,
+                  "ProxyAudio: output buffer start: %lld    end: %lld",
+                  buffer->StartFrame(),
+                  buffer->EndFrame());
         }
     }
-    
-    Float32 volumeFactorL = 1.0, volumeFactorR = 1.0;
-    calculateVolumeFactors(currentVolumeL, currentVolumeR, currentMute, volumeFactorL, volumeFactorR);
-
-    for (UInt32 bufferIndex = 0; bufferIndex < outOutputData->mNumberBuffers; bufferIndex++) {
-        UInt32 outputChannelCount = outOutputData->mBuffers[bufferIndex].mNumberChannels;
-        UInt32 numChannelsToProcess = std::min(outputChannelCount, currentInputDeviceChannelCount);
-
-        for (UInt32 channelIndex = 0; channelIndex < numChannelsToProcess; channelIndex++) {
-            Float32 *in = (Float32 *)workBuffer + channelIndex;
-            Float32 *out = (Float32 *)outOutputData->mBuffers[bufferIndex].mData + channelIndex;
-            long framesize = outputChannelCount * sizeof(Float32);
-
-            for (UInt32 frame = 0; frame < outOutputData->mBuffers[bufferIndex].mDataByteSize; frame += framesize) {
-                *out += (*in * ((channelIndex == 0) ? volumeFactorL : volumeFactorR));
-                in += currentInputDeviceChannelCount;
-                out += outputChannelCount;
-            }
-        }
+
+    inputBufferInUseByReader.store(NULL, std::memory_order_release);
+    ioTelemetry.RecordOutputCycleWallTime(mach_absolute_time() - cycleStartHostTime);
+
+    if (cycleStartCPUNanoseconds != 0) {
+        ioTelemetry.RecordOutputCycleCPUTime(threadCPUNanoseconds() - cycleStartCPUNanoseconds);
     }
 
     return noErr;
 }
 
+void ProxyAudioDevice::publishIOStateNoLock() {
+    // Must be called with stateMutex held whenever any of the state that goes into IOState changes. The volume
+    // curve is worked out here so the IO proc doesn't have to call pow() every cycle.
+    IOState newState;
+    newState.sampleRate = gDevice_SampleRate;
+    newState.hostTicksPerFrame = gDevice_HostTicksPerFrame;
+
+    if (outputDeviceVolumeForwarded) {
+        // The output device attenuates for us, so play at unity gain, which lets outputDeviceIOProc copy the input
+        // straight out whenever there's no drift to correct. Silence is still up to us if the device can't mute.
+        bool silent = !outputDeviceMuteForwarded
+                      && (gMute_Output_Mute || (gVolume_Output_L_Value <= 0.0 && gVolume_Output_R_Value <= 0.0));
+        newState.volumeFactorL = silent ? 0.0f : 1.0f;
+        newState.volumeFactorR = newState.volumeFactorL;
+    } else {
+        calculateVolumeFactors(gVolume_Output_L_Value,
+                               gVolume_Output_R_Value,
+                               gMute_Output_Mute,
+                               newState.volumeFactorL,
+                               newState.volumeFactorR);
+    }
+
+    ioState.Store(newState);
+}
+
 void ProxyAudioDevice::calculateVolumeFactors(Float32 volumeL,
                                               Float32 volumeR,
                                               bool mute,
@@ -5474,14 +6205,14 @@ OSStatus ProxyAudioDevice::EndIOOperation(AudioServerPlugInDriverRef inDriver,
     OSStatus theAnswer = 0;
 
     //    check the arguments
-    FailWithAction(inDriver != gAudioServerPlugInDriverRef,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "EndIOOperation: bad driver reference");
-    FailWithAction(inDeviceObjectID != kObjectID_Device,
-                   theAnswer = kAudioHardwareBadObjectError,
-                   Done,
-                   "EndIOOperation: bad device ID");
+    RTFailWithAction(inDriver != gAudioServerPlugInDriverRef,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "EndIOOperation: bad driver reference");
+    RTFailWithAction(inDeviceObjectID != kObjectID_Device,
+                     theAnswer = kAudioHardwareBadObjectError,
+                     Done,
+                     "EndIOOperation: bad device ID");
 
 Done:
     return theAnswer;
@@ -5504,6 +6235,18 @@ void ProxyAudioDevice::parseConfigurationString(CFStringRef configString, Config
         action = ConfigType::deviceName;
     } else if (CFStringCompare(actionString, CFSTR("outputDeviceActiveCondition"), 0) == kCFCompareEqualTo) {
         action = ConfigType::deviceActiveCondition;
+    } else if (CFStringCompare(actionString, CFSTR("latencyBudget"), 0) == kCFCompareEqualTo) {
+        action = ConfigType::latencyBudget;
+    } else if (CFStringCompare(actionString, CFSTR("zeroTimeStampPeriod"), 0) == kCFCompareEqualTo) {
+        action = ConfigType::zeroTimeStampPeriod;
+    } else if (CFStringCompare(actionString, CFSTR("channelCount"), 0) == kCFCompareEqualTo) {
+        action = ConfigType::channelCount;
+    } else if (CFStringCompare(actionString, CFSTR("channelMap"), 0) == kCFCompareEqualTo) {
+        action = ConfigType::channelMap;
+    } else if (CFStringCompare(actionString, CFSTR("outputDeviceFormat"), 0) == kCFCompareEqualTo) {
+        action = ConfigType::outputDeviceFormat;
+    } else if (CFStringCompare(actionString, CFSTR("hardwareVolume"), 0) == kCFCompareEqualTo) {
+        action = ConfigType::hardwareVolume;
     } else {
         return;
     }
@@ -5538,6 +6281,30 @@ void ProxyAudioDevice::setConfigurationValue(ConfigType type, CFStringRef value)
         case ConfigType::deviceActiveCondition:
             setOutputDeviceActiveCondition((ActiveCondition)CFStringGetIntValue(value));
             break;
+
+        case ConfigType::latencyBudget:
+            setLatencyBudget(CFStringGetIntValue(value));
+            break;
+
+        case ConfigType::zeroTimeStampPeriod:
+            setZeroTimeStampPeriod(CFStringGetIntValue(value));
+            break;
+
+        case ConfigType::channelCount:
+            setChannelCount(CFStringGetIntValue(value));
+            break;
+
+        case ConfigType::channelMap:
+            setChannelMap(value);
+            break;
+
+        case ConfigType::outputDeviceFormat:
+            setOutputDeviceFormat((OutputFormat)CFStringGetIntValue(value));
+            break;
+
+        case ConfigType::hardwareVolume:
+            setHardwareVolume(CFStringGetIntValue(value) != 0);
+            break;
         
         default:
             break;
@@ -5559,6 +6326,24 @@ CFStringRef ProxyAudioDevice::copyConfigurationValue(ConfigType type) {
 
         case ConfigType::deviceActiveCondition:
             return CFStringCreateWithFormat(NULL, NULL, CFSTR("%u"), outputDeviceActiveCondition);
+
+        case ConfigType::latencyBudget:
+            return CFStringCreateWithFormat(NULL, NULL, CFSTR("%u"), latencyBudget);
+
+        case ConfigType::zeroTimeStampPeriod:
+            return CFStringCreateWithFormat(NULL, NULL, CFSTR("%u"), zeroTimeStampPeriod);
+
+        case ConfigType::channelCount:
+            return CFStringCreateWithFormat(NULL, NULL, CFSTR("%u"), requestedChannelsPerFrame);
+
+        case ConfigType::channelMap:
+            return copyChannelMapStringNoLock();
+
+        case ConfigType::outputDeviceFormat:
+            return CFStringCreateWithFormat(NULL, NULL, CFSTR("%u"), outputDeviceFormat);
+
+        case ConfigType::hardwareVolume:
+            return CFStringCreateWithFormat(NULL, NULL, CFSTR("%u"), hardwareVolume ? 1 : 0);
             
         default:
             return nullptr;
@@ -5721,7 +6506,10 @@ UInt32 ProxyAudioDevice::retrieveOutputDeviceBufferFrameSizeFromStorage() {
 
     SInt32 value;
     CFNumberGetValue(CFNumberRef(CFPropertyListRef(data)), kCFNumberSInt32Type, &value);
-    value = std::max(value, kOutputDeviceMinBufferFrameSize);
+
+    if (value != kOutputDeviceAutoBufferFrameSize) {
+        value = std::max(value, kOutputDeviceMinBufferFrameSize);
+    }
     
     DebugMsg("ProxyAudio: retrieveOutputDeviceBufferFrameSizeFromStorage finished returning stored buffer frame size");
     
@@ -5729,7 +6517,8 @@ UInt32 ProxyAudioDevice::retrieveOutputDeviceBufferFrameSizeFromStorage() {
 }
 
 void ProxyAudioDevice::setOutputDeviceBufferFrameSize(UInt32 newSize) {
-    if (newSize <= 0 || newSize > INT32_MAX) {
+    // kOutputDeviceAutoBufferFrameSize turns on tuning
+    if (newSize > INT32_MAX) {
         return;
     }
     
@@ -5741,10 +6530,62 @@ void ProxyAudioDevice::setOutputDeviceBufferFrameSize(UInt32 newSize) {
     }
     
     ExecuteInAudioOutputThread(^{
+        resizeInputBuffer();
         setupTargetOutputDevice();
     });
 }
 
+UInt32 ProxyAudioDevice::retrieveTunedBufferFrameSizeFromStorage(CFStringRef deviceUID) {
+    // Returns 0 if the device has never been tuned
+    DebugMsg("ProxyAudio: retrieveTunedBufferFrameSizeFromStorage");
+
+    if (!gPlugIn_Host || !deviceUID) {
+        return 0;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("tunedOutputDeviceBufferFrameSizes"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFDictionaryGetTypeID()) {
+        return 0;
+    }
+
+    CFTypeRef sizeRef = CFDictionaryGetValue(CFDictionaryRef(CFPropertyListRef(data)), deviceUID);
+
+    if (sizeRef == NULL || CFGetTypeID(sizeRef) != CFNumberGetTypeID()) {
+        return 0;
+    }
+
+    SInt32 value;
+    CFNumberGetValue(CFNumberRef(sizeRef), kCFNumberSInt32Type, &value);
+
+    return UInt32(std::max(value, 0));
+}
+
+void ProxyAudioDevice::storeTunedBufferFrameSize(CFStringRef deviceUID, UInt32 size) {
+    if (!deviceUID) {
+        return;
+    }
+
+    DebugMsg("ProxyAudio: storeTunedBufferFrameSize %u", size);
+    CAMutex::Locker locker(&stateMutex);
+
+    // Sizes are kept in one dictionary keyed by device UID
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("tunedOutputDeviceBufferFrameSizes"), &data);
+    CFTypeSmartRef<CFMutableDictionaryRef> sizes;
+
+    if (data != NULL && CFGetTypeID(data) == CFDictionaryGetTypeID()) {
+        sizes = CFDictionaryCreateMutableCopy(NULL, 0, CFDictionaryRef(CFPropertyListRef(data)));
+    } else {
+        sizes = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    }
+
+    CFNumberSmartRef sizeRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &size);
+    CFDictionarySetValue(sizes, deviceUID, sizeRef);
+    gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("tunedOutputDeviceBufferFrameSizes"), sizes);
+}
+
 ProxyAudioDevice::ActiveCondition ProxyAudioDevice::retrieveOutputDeviceActiveConditionFromStorage() {
     DebugMsg("ProxyAudio: retrieveOutputDeviceActiveConditionFromStorage");
 
@@ -5778,12 +6619,629 @@ void ProxyAudioDevice::setOutputDeviceActiveCondition(ActiveCondition newActiveC
     }
 }
 
+UInt32 ProxyAudioDevice::retrieveLatencyBudgetFromStorage() {
+    DebugMsg("ProxyAudio: retrieveLatencyBudgetFromStorage");
+
+    if (!gPlugIn_Host) {
+        DebugMsg("ProxyAudio: retrieveLatencyBudgetFromStorage no plugin host");
+        return kDefaultLatencyBudget;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("latencyBudget"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFNumberGetTypeID()) {
+        DebugMsg("ProxyAudio: retrieveLatencyBudgetFromStorage finished returning default latency budget");
+        return kDefaultLatencyBudget;
+    }
+
+    SInt32 value;
+    CFNumberGetValue(CFNumberRef(CFPropertyListRef(data)), kCFNumberSInt32Type, &value);
+    value = std::min(std::max(value, kMinLatencyBudget), kMaxLatencyBudget);
+
+    DebugMsg("ProxyAudio: retrieveLatencyBudgetFromStorage finished returning stored latency budget");
+
+    return UInt32(value);
+}
+
+void ProxyAudioDevice::setLatencyBudget(UInt32 newBudget) {
+    if (newBudget < kMinLatencyBudget || newBudget > kMaxLatencyBudget) {
+        return;
+    }
+
+    {
+        CAMutex::Locker locker(&stateMutex);
+        latencyBudget = newBudget;
+        CFNumberSmartRef newBudgetRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &newBudget);
+        gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("latencyBudget"), newBudgetRef);
+    }
+
+    ExecuteInAudioOutputThread(^{
+        resizeInputBuffer();
+    });
+}
+
+UInt32 ProxyAudioDevice::retrieveZeroTimeStampPeriodFromStorage() {
+    DebugMsg("ProxyAudio: retrieveZeroTimeStampPeriodFromStorage");
+
+    if (!gPlugIn_Host) {
+        DebugMsg("ProxyAudio: retrieveZeroTimeStampPeriodFromStorage no plugin host");
+        return 0;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("zeroTimeStampPeriod"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFNumberGetTypeID()) {
+        DebugMsg("ProxyAudio: retrieveZeroTimeStampPeriodFromStorage finished returning default period");
+        return 0;
+    }
+
+    SInt32 value;
+    CFNumberGetValue(CFNumberRef(CFPropertyListRef(data)), kCFNumberSInt32Type, &value);
+
+    DebugMsg("ProxyAudio: retrieveZeroTimeStampPeriodFromStorage finished returning stored period");
+
+    return UInt32(std::max(value, 0));
+}
+
+void ProxyAudioDevice::setZeroTimeStampPeriod(UInt32 newPeriod) {
+    if (newPeriod != 0 && (newPeriod < kMinZeroTimeStampPeriod || newPeriod > kMaxZeroTimeStampPeriod)) {
+        return;
+    }
+
+    Float64 sampleRate;
+
+    {
+        CAMutex::Locker locker(&stateMutex);
+        zeroTimeStampPeriod = newPeriod;
+        sampleRate = gDevice_SampleRate;
+        CFNumberSmartRef newPeriodRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &newPeriod);
+        gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("zeroTimeStampPeriod"), newPeriodRef);
+    }
+
+    // The period can't change under the HAL's feet while IO is running, so go through a configuration change at
+    // the current sample rate, which stops IO while PerformDeviceConfigurationChange picks up the new period
+    ExecuteInAudioOutputThread(^{
+        gPlugIn_Host->RequestDeviceConfigurationChange(gPlugIn_Host, kObjectID_Device, UInt64(sampleRate), NULL);
+    });
+}
+
+void ProxyAudioDevice::updateZeroTimeStampPeriodNoLock() {
+    // Must be called with stateMutex held, and only while IO is stopped
+    UInt32 period = zeroTimeStampPeriod;
+
+    if (period == 0) {
+        period = UInt32(gDevice_SampleRate * kDefaultZeroTimeStampPeriodSeconds);
+    }
+
+    gDevice_ZeroTimeStampPeriod = std::min(std::max(period, UInt32(kMinZeroTimeStampPeriod)),
+                                           UInt32(kMaxZeroTimeStampPeriod));
+    DebugMsg("ProxyAudio: zero time stamp period is now %u frames", gDevice_ZeroTimeStampPeriod);
+}
+
+UInt32 ProxyAudioDevice::retrieveChannelCountFromStorage() {
+    DebugMsg("ProxyAudio: retrieveChannelCountFromStorage");
+
+    if (!gPlugIn_Host) {
+        DebugMsg("ProxyAudio: retrieveChannelCountFromStorage no plugin host");
+        return kDevice_DefaultChannelsPerFrame;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("channelCount"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFNumberGetTypeID()) {
+        DebugMsg("ProxyAudio: retrieveChannelCountFromStorage finished returning default channel count");
+        return kDevice_DefaultChannelsPerFrame;
+    }
+
+    SInt32 value;
+    CFNumberGetValue(CFNumberRef(CFPropertyListRef(data)), kCFNumberSInt32Type, &value);
+    value = std::min(std::max(value, kDevice_MinChannelsPerFrame), kDevice_MaxChannelsPerFrame);
+
+    DebugMsg("ProxyAudio: retrieveChannelCountFromStorage finished returning stored channel count");
+
+    return UInt32(value);
+}
+
+void ProxyAudioDevice::setChannelCount(UInt32 newCount) {
+    if (newCount < kDevice_MinChannelsPerFrame || newCount > kDevice_MaxChannelsPerFrame) {
+        return;
+    }
+
+    Float64 sampleRate;
+
+    {
+        CAMutex::Locker locker(&stateMutex);
+        requestedChannelsPerFrame = newCount;
+        sampleRate = gDevice_SampleRate;
+        CFNumberSmartRef newCountRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &newCount);
+        gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("channelCount"), newCountRef);
+    }
+
+    // The stream format can only change while IO is stopped, so like the zero time stamp period this goes through
+    // a configuration change at the current sample rate
+    ExecuteInAudioOutputThread(^{
+        gPlugIn_Host->RequestDeviceConfigurationChange(gPlugIn_Host, kObjectID_Device, UInt64(sampleRate), NULL);
+    });
+}
+
+std::vector<UInt32> ProxyAudioDevice::retrieveChannelMapFromStorage() {
+    DebugMsg("ProxyAudio: retrieveChannelMapFromStorage");
+    std::vector<UInt32> result;
+
+    if (!gPlugIn_Host) {
+        DebugMsg("ProxyAudio: retrieveChannelMapFromStorage no plugin host");
+        return result;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("channelMap"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFArrayGetTypeID()) {
+        DebugMsg("ProxyAudio: retrieveChannelMapFromStorage finished returning default channel map");
+        return result;
+    }
+
+    CFArrayRef map = CFArrayRef(CFPropertyListRef(data));
+    CFIndex count = std::min(CFArrayGetCount(map), CFIndex(kDevice_MaxChannelsPerFrame));
+
+    for (CFIndex i = 0; i < count; i++) {
+        CFTypeRef entry = CFArrayGetValueAtIndex(map, i);
+        SInt32 value = 0;
+
+        if (entry && CFGetTypeID(entry) == CFNumberGetTypeID()) {
+            CFNumberGetValue(CFNumberRef(entry), kCFNumberSInt32Type, &value);
+        }
+
+        result.push_back(UInt32(std::max(value, 0)));
+    }
+
+    DebugMsg("ProxyAudio: retrieveChannelMapFromStorage finished returning stored channel map");
+
+    return result;
+}
+
+void ProxyAudioDevice::setChannelMap(CFStringRef newMapString) {
+    // A comma separated list of the 1-based output channel each proxied channel goes to, with 0 for none. An empty
+    // list goes back to playing each channel on the output channel with the same number.
+    std::vector<UInt32> newMap;
+
+    if (CFStringGetLength(newMapString) > 0) {
+        CFArraySmartRef entries = CFStringCreateArrayBySeparatingStrings(NULL, newMapString, CFSTR(","));
+        CFTypeSmartRef<CFCharacterSetRef> nonDigits =
+            CFCharacterSetCreateInvertedSet(NULL, CFCharacterSetGetPredefined(kCFCharacterSetDecimalDigit));
+
+        for (CFIndex i = 0; i < CFArrayGetCount(entries); i++) {
+            CFTypeSmartRef<CFMutableStringRef> entry =
+                CFStringCreateMutableCopy(NULL, 0, (CFStringRef)CFArrayGetValueAtIndex(entries, i));
+            CFStringTrimWhitespace(entry);
+            CFIndex length = CFStringGetLength(entry);
+
+            if (length == 0 || CFStringFindCharacterFromSet(entry, nonDigits, CFRangeMake(0, length), 0, NULL)
+                || newMap.size() >= kDevice_MaxChannelsPerFrame) {
+                syslog(LOG_WARNING, "ProxyAudio: ignoring invalid channel map");
+                return;
+            }
+
+            newMap.push_back(UInt32(CFStringGetIntValue(entry)));
+        }
+    }
+
+    {
+        CAMutex::Locker locker(&stateMutex);
+        channelMap = newMap;
+        CFTypeSmartRef<CFMutableArrayRef> newMapRef = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+        for (UInt32 channel : newMap) {
+            CFNumberSmartRef channelRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &channel);
+            CFArrayAppendValue(newMapRef, channelRef);
+        }
+
+        gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("channelMap"), newMapRef);
+    }
+
+    // The mixer's routes are worked out from the map when it's configured, which can only happen while the
+    // output device is stopped
+    ExecuteInAudioOutputThread(^{
+        reconfigureOutputChannels();
+    });
+}
+
+CFStringRef ProxyAudioDevice::copyChannelMapStringNoLock() {
+    // Must be called with stateMutex held
+    CFMutableStringRef result = CFStringCreateMutable(NULL, 0);
+
+    for (size_t i = 0; i < channelMap.size(); i++) {
+        CFStringAppendFormat(result, NULL, (i == 0) ? CFSTR("%u") : CFSTR(",%u"), channelMap[i]);
+    }
+
+    return result;
+}
+
+ProxyAudioDevice::OutputFormat ProxyAudioDevice::retrieveOutputDeviceFormatFromStorage() {
+    DebugMsg("ProxyAudio: retrieveOutputDeviceFormatFromStorage");
+
+    if (!gPlugIn_Host) {
+        DebugMsg("ProxyAudio: retrieveOutputDeviceFormatFromStorage no plugin host");
+        return OutputFormat::float32;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("outputDeviceFormat"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFNumberGetTypeID()) {
+        DebugMsg("ProxyAudio: retrieveOutputDeviceFormatFromStorage finished returning default format");
+        return OutputFormat::float32;
+    }
+
+    SInt32 value;
+    CFNumberGetValue(CFNumberRef(CFPropertyListRef(data)), kCFNumberSInt32Type, &value);
+
+    DebugMsg("ProxyAudio: retrieveOutputDeviceFormatFromStorage finished returning stored format");
+
+    if (value < SInt32(OutputFormat::float32) || value > SInt32(OutputFormat::ditheredInteger)) {
+        return OutputFormat::float32;
+    }
+
+    return OutputFormat(value);
+}
+
+void ProxyAudioDevice::setOutputDeviceFormat(OutputFormat newFormat) {
+    if (newFormat < OutputFormat::float32 || newFormat > OutputFormat::ditheredInteger) {
+        return;
+    }
+
+    {
+        CAMutex::Locker locker(&stateMutex);
+        outputDeviceFormat = newFormat;
+        SInt32 newFormatValue = SInt32(newFormat);
+        CFNumberSmartRef newFormatRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &newFormatValue);
+        gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("outputDeviceFormat"), newFormatRef);
+    }
+
+    // Tearing the output device down puts its own format back, and setting it up again applies the new one
+    ExecuteInAudioOutputThread(^{
+        deinitializeOutputDevice();
+        setupTargetOutputDevice();
+    });
+}
+
+bool ProxyAudioDevice::retrieveHardwareVolumeFromStorage() {
+    DebugMsg("ProxyAudio: retrieveHardwareVolumeFromStorage");
+
+    if (!gPlugIn_Host) {
+        DebugMsg("ProxyAudio: retrieveHardwareVolumeFromStorage no plugin host");
+        return false;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("hardwareVolume"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFNumberGetTypeID()) {
+        DebugMsg("ProxyAudio: retrieveHardwareVolumeFromStorage finished returning default");
+        return false;
+    }
+
+    SInt32 value;
+    CFNumberGetValue(CFNumberRef(CFPropertyListRef(data)), kCFNumberSInt32Type, &value);
+
+    DebugMsg("ProxyAudio: retrieveHardwareVolumeFromStorage finished returning stored value");
+
+    return value != 0;
+}
+
+void ProxyAudioDevice::setHardwareVolume(bool enabled) {
+    {
+        CAMutex::Locker locker(&stateMutex);
+        hardwareVolume = enabled;
+        SInt32 value = enabled ? 1 : 0;
+        CFNumberSmartRef valueRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &value);
+        gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("hardwareVolume"), valueRef);
+    }
+
+    ExecuteInAudioOutputThread(^{
+        CAMutex::Locker locker(outputDeviceMutex);
+        releaseHardwareVolumeNoLock();
+        configureHardwareVolumeNoLock();
+    });
+}
+
+VolumeForwarding::Settings ProxyAudioDevice::retrieveSavedOutputDeviceControlsFromStorage(CFStringRef deviceUID) {
+    // Returns empty settings if nothing is waiting to be put back on the device
+    DebugMsg("ProxyAudio: retrieveSavedOutputDeviceControlsFromStorage");
+    VolumeForwarding::Settings settings;
+
+    if (!gPlugIn_Host || !deviceUID) {
+        return settings;
+    }
+
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("savedOutputDeviceControls"), &data);
+
+    if (data == NULL || CFGetTypeID(data) != CFDictionaryGetTypeID()) {
+        return settings;
+    }
+
+    CFTypeRef entry = CFDictionaryGetValue(CFDictionaryRef(CFPropertyListRef(data)), deviceUID);
+
+    if (entry == NULL || CFGetTypeID(entry) != CFDictionaryGetTypeID()) {
+        return settings;
+    }
+
+    CFTypeRef decibels = CFDictionaryGetValue(CFDictionaryRef(entry), CFSTR("decibels"));
+    CFTypeRef mutes = CFDictionaryGetValue(CFDictionaryRef(entry), CFSTR("mutes"));
+
+    if (decibels == NULL || CFGetTypeID(decibels) != CFArrayGetTypeID() || mutes == NULL
+        || CFGetTypeID(mutes) != CFArrayGetTypeID()) {
+        return settings;
+    }
+
+    for (CFIndex i = 0; i < CFArrayGetCount(CFArrayRef(decibels)); i++) {
+        CFTypeRef value = CFArrayGetValueAtIndex(CFArrayRef(decibels), i);
+        Float32 decibel = NAN;
+
+        if (value && CFGetTypeID(value) == CFNumberGetTypeID()) {
+            CFNumberGetValue(CFNumberRef(value), kCFNumberFloat32Type, &decibel);
+        }
+
+        settings.decibels.push_back(decibel);
+    }
+
+    for (CFIndex i = 0; i < CFArrayGetCount(CFArrayRef(mutes)); i++) {
+        CFTypeRef value = CFArrayGetValueAtIndex(CFArrayRef(mutes), i);
+        SInt32 mute = 0;
+
+        if (value && CFGetTypeID(value) == CFNumberGetTypeID()) {
+            CFNumberGetValue(CFNumberRef(value), kCFNumberSInt32Type, &mute);
+        }
+
+        settings.mutes.push_back(mute != 0 ? 1 : 0);
+    }
+
+    return settings;
+}
+
+void ProxyAudioDevice::storeSavedOutputDeviceControls(CFStringRef deviceUID,
+                                                      const VolumeForwarding::Settings &settings) {
+    // Empty settings mean there's nothing left to put back on the device
+    if (!gPlugIn_Host || !deviceUID) {
+        return;
+    }
+
+    DebugMsg("ProxyAudio: storeSavedOutputDeviceControls");
+    CAMutex::Locker locker(&stateMutex);
+
+    // Kept in one dictionary keyed by device UID, like the tuned buffer sizes
+    CFPropertyListSmartRef data;
+    gPlugIn_Host->CopyFromStorage(gPlugIn_Host, CFSTR("savedOutputDeviceControls"), &data);
+    CFTypeSmartRef<CFMutableDictionaryRef> devices;
+
+    if (data != NULL && CFGetTypeID(data) == CFDictionaryGetTypeID()) {
+        devices = CFDictionaryCreateMutableCopy(NULL, 0, CFDictionaryRef(CFPropertyListRef(data)));
+    } else {
+        devices = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    }
+
+    if (settings.empty()) {
+        CFDictionaryRemoveValue(devices, deviceUID);
+    } else {
+        CFTypeSmartRef<CFMutableArrayRef> decibels = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        CFTypeSmartRef<CFMutableArrayRef> mutes = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+        for (Float32 decibel : settings.decibels) {
+            CFNumberSmartRef decibelRef = CFNumberCreate(NULL, kCFNumberFloat32Type, &decibel);
+            CFArrayAppendValue(decibels, decibelRef);
+        }
+
+        for (UInt32 mute : settings.mutes) {
+            CFNumberSmartRef muteRef = CFNumberCreate(NULL, kCFNumberSInt32Type, &mute);
+            CFArrayAppendValue(mutes, muteRef);
+        }
+
+        CFTypeSmartRef<CFMutableDictionaryRef> entry =
+            CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        CFDictionarySetValue(entry, CFSTR("decibels"), decibels);
+        CFDictionarySetValue(entry, CFSTR("mutes"), mutes);
+        CFDictionarySetValue(devices, deviceUID, entry);
+    }
+
+    gPlugIn_Host->WriteToStorage(gPlugIn_Host, CFSTR("savedOutputDeviceControls"), devices);
+}
+
+void ProxyAudioDevice::configureHardwareVolumeNoLock() {
+    // Must be called with outputDeviceMutex held, on the audio output queue
+    bool enabled;
+    UInt32 channelCount;
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        enabled = hardwareVolume;
+        channelCount = gDevice_ChannelsPerFrame;
+    }
+
+    if (!enabled || !outputDevice.isValid() || !forwardedControls.volumeElements.empty()) {
+        return;
+    }
+
+    const AudioObjectPropertyScope scope = kAudioObjectPropertyScopeOutput;
+    const AudioObjectPropertyElement master = kAudioObjectPropertyElementMaster;
+    UInt32 stereoChannels[2] = {1, 2};
+    AudioObjectPropertyAddress stereoAddress = {kAudioDevicePropertyPreferredChannelsForStereo, scope, master};
+    UInt32 size = sizeof(stereoChannels);
+    AudioObjectGetPropertyData(outputDevice.id, &stereoAddress, 0, NULL, &size, stereoChannels);
+
+    bool masterVolume = outputDevice.isPropertySettable(kAudioDevicePropertyVolumeDecibels, scope, master);
+    bool channelVolumes =
+        outputDevice.isPropertySettable(kAudioDevicePropertyVolumeDecibels, scope, stereoChannels[0])
+        && outputDevice.isPropertySettable(kAudioDevicePropertyVolumeDecibels, scope, stereoChannels[1]);
+    ForwardedControls controls;
+
+    // Separate left and right volumes keep the balance, but with more than two channels only the master volume
+    // reaches all of them
+    if (channelVolumes && !(masterVolume && channelCount > 2)) {
+        controls.volumeElements.assign(stereoChannels, stereoChannels + 2);
+    } else if (masterVolume) {
+        controls.volumeElements.assign(1, master);
+    } else {
+        syslog(LOG_WARNING, "ProxyAudio: output device has no volume control, so volume stays digital");
+        return;
+    }
+
+    if (outputDevice.isPropertySettable(kAudioDevicePropertyMute, scope, master)) {
+        controls.muteElements.assign(1, master);
+    } else if (outputDevice.isPropertySettable(kAudioDevicePropertyMute, scope, stereoChannels[0])
+               && outputDevice.isPropertySettable(kAudioDevicePropertyMute, scope, stereoChannels[1])) {
+        controls.muteElements.assign(stereoChannels, stereoChannels + 2);
+    }
+
+    VolumeForwarding::Settings current;
+
+    for (AudioObjectPropertyElement element : controls.volumeElements) {
+        Float32 decibels = NAN;
+        outputDevice.getFloatPropertyData(decibels, kAudioDevicePropertyVolumeDecibels, scope, element);
+        current.decibels.push_back(decibels);
+    }
+
+    for (AudioObjectPropertyElement element : controls.muteElements) {
+        UInt32 mute = 0;
+        outputDevice.getIntegerPropertyData(mute, kAudioDevicePropertyMute, scope, element);
+        current.mutes.push_back(mute);
+    }
+
+    // Keep what we're about to change in storage until it's been put back, so it isn't lost if coreaudiod goes
+    // away while we're forwarding. If it went away last time, the device still has what we forwarded then, and what
+    // to put back is what was stored.
+    CFStringSmartRef deviceUID = AudioDevice::copyDeviceUID(outputDevice.id);
+    VolumeForwarding::Settings saved = retrieveSavedOutputDeviceControlsFromStorage(deviceUID);
+    const VolumeForwarding::Settings &toRestore = VolumeForwarding::ToRestore(current, saved);
+
+    if (!saved.empty() && &toRestore != &saved) {
+        syslog(LOG_WARNING, "ProxyAudio: saved output device volume is for different controls, ignoring it");
+    }
+
+    controls.saved = toRestore;
+    storeSavedOutputDeviceControls(deviceUID, controls.saved);
+
+    AudioValueRange range;
+    AudioObjectPropertyAddress rangeAddress = {
+        kAudioDevicePropertyVolumeRangeDecibels, scope, controls.volumeElements[0]};
+    size = sizeof(range);
+
+    if (AudioObjectGetPropertyData(outputDevice.id, &rangeAddress, 0, NULL, &size, &range) == noErr) {
+        controls.minDecibels = Float32(range.mMinimum);
+    }
+
+    forwardedControls = controls;
+    DebugMsg("ProxyAudio: forwarding volume to %u volume and %u mute controls of the output device",
+             (UInt32)controls.volumeElements.size(),
+             (UInt32)controls.muteElements.size());
+
+    // Turn the device down before we stop attenuating, rather than after, so nothing plays too loud in between
+    forwardVolumeToOutputDeviceNoLock();
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        outputDeviceVolumeForwarded = true;
+        outputDeviceMuteForwarded = !controls.muteElements.empty();
+        publishIOStateNoLock();
+    }
+}
+
+void ProxyAudioDevice::releaseHardwareVolumeNoLock() {
+    // Must be called with outputDeviceMutex held, on the audio output queue
+    if (forwardedControls.volumeElements.empty()) {
+        return;
+    }
+
+    // The other way round from configureHardwareVolumeNoLock: start attenuating again before turning the device
+    // back up
+    {
+        CAMutex::Locker locker(stateMutex);
+        outputDeviceVolumeForwarded = false;
+        outputDeviceMuteForwarded = false;
+        publishIOStateNoLock();
+    }
+
+    if (outputDevice.isValid()) {
+        const AudioObjectPropertyScope scope = kAudioObjectPropertyScopeOutput;
+        const VolumeForwarding::Settings &saved = forwardedControls.saved;
+
+        for (size_t i = 0; i < forwardedControls.volumeElements.size(); i++) {
+            if (!std::isnan(saved.decibels[i])) {
+                outputDevice.setFloatPropertyData(
+                    saved.decibels[i], kAudioDevicePropertyVolumeDecibels, scope, forwardedControls.volumeElements[i]);
+            }
+        }
+
+        for (size_t i = 0; i < forwardedControls.muteElements.size(); i++) {
+            outputDevice.setIntegerPropertyData(
+                saved.mutes[i], kAudioDevicePropertyMute, scope, forwardedControls.muteElements[i]);
+        }
+
+        // Put back, so there's nothing left to restore next time. Without the device, it stays in storage for
+        // whenever we next forward to it.
+        CFStringSmartRef deviceUID = AudioDevice::copyDeviceUID(outputDevice.id);
+        storeSavedOutputDeviceControls(deviceUID, VolumeForwarding::Settings());
+    }
+
+    forwardedControls = ForwardedControls();
+}
+
+void ProxyAudioDevice::forwardVolumeToOutputDeviceNoLock() {
+    // Must be called with outputDeviceMutex held, on the audio output queue
+    if (forwardedControls.volumeElements.empty() || !outputDevice.isValid()) {
+        return;
+    }
+
+    Float32 volumeL, volumeR;
+    bool mute;
+
+    {
+        CAMutex::Locker locker(stateMutex);
+        volumeL = gVolume_Output_L_Value;
+        volumeR = gVolume_Output_R_Value;
+        mute = gMute_Output_Mute;
+    }
+
+    // Use the same curve as the gain we'd otherwise apply ourselves, so turning hardwareVolume on or off doesn't
+    // change how loud anything is. Our volume at zero is silence, which the device's lowest volume may not be.
+    Float32 factorL, factorR;
+    calculateVolumeFactors(volumeL, volumeR, false, factorL, factorR);
+    VolumeForwarding::Settings settings =
+        VolumeForwarding::Forward(factorL,
+                                  factorR,
+                                  mute || (volumeL <= 0.0f && volumeR <= 0.0f),
+                                  forwardedControls.minDecibels,
+                                  forwardedControls.volumeElements.size(),
+                                  forwardedControls.muteElements.size());
+    const AudioObjectPropertyScope scope = kAudioObjectPropertyScopeOutput;
+
+    for (size_t i = 0; i < forwardedControls.volumeElements.size(); i++) {
+        outputDevice.setFloatPropertyData(
+            settings.decibels[i], kAudioDevicePropertyVolumeDecibels, scope, forwardedControls.volumeElements[i]);
+    }
+
+    for (size_t i = 0; i < forwardedControls.muteElements.size(); i++) {
+        outputDevice.setIntegerPropertyData(
+            settings.mutes[i], kAudioDevicePropertyMute, scope, forwardedControls.muteElements[i]);
+    }
+}
+
+void ProxyAudioDevice::forwardVolumeToOutputDevice() {
+    CAMutex::Locker locker(outputDeviceMutex);
+    forwardVolumeToOutputDeviceNoLock();
+}
+
 #pragma mark Other stuff!
 
 void ProxyAudioDevice::monitorUserActivity() {
     {
         CAMutex::Locker outputMutexLocker(outputDeviceMutex);
         updateOutputDeviceStartedState();
+        updateReportedLatencyNoLock();
+        tuneOutputDeviceBufferFrameSizeNoLock();
     }
 }
 
@@ -7,7 +7,16 @@
 #include <atomic>
 
 #include "AudioDevice.h"
+#include "AudioIntegerConverter.h"
+#include "AudioMixer.h"
+#include "AudioResampler.h"
+#include "BufferSizeTuner.h"
 #include "CAMutex.h"
+#include "FillLevelController.h"
+#include "IOTelemetry.h"
+#include "SeqLock.h"
+#include "VolumeForwarding.h"
+#include "ZeroTimeStampClock.h"
 
 class AudioRingBuffer;
 
@@ -22,20 +31,84 @@ enum {
     kObjectID_DataSource_Output_Master = 8
 };
 
+// A custom property of the device holding a CFDictionary of IOTelemetry's counters
+enum { kProxyAudioDevicePropertyTelemetry = 'PAtl' };
+
 #define kPlugIn_BundleID "net.briankendall.ProxyAudioDevice"
 #define kBox_UID "ProxyAudioBox_UID"
 #define kDevice_UID "ProxyAudioDevice_UID"
 #define kDevice_ModelUID "ProxyAudioDevice_ModelUID"
 #define kOutputDeviceDefaultBufferFrameSize 512
+// An outputDeviceBufferFrameSize of this has BufferSizeTuner find one for each target device
+#define kOutputDeviceAutoBufferFrameSize 0
 #define kOutputDeviceMinBufferFrameSize 4
 #define kOutputDeviceDefaultActiveCondition ActiveCondition::userActive
+// How far behind the newest input the output device may fall, in milliseconds, before input is lost
+#define kDefaultLatencyBudget 1000
+#define kMinLatencyBudget 10
+#define kMaxLatencyBudget 10000
+// HAL clients practically never use IO buffers larger than this. The input buffer always has room for two of them
+// on top of the latency budget.
+#define kDevice_MaxExpectedIOBufferFrameSize 4096
+// The input buffer is only locked into memory while IO is running if it's no bigger than this
+#define kMaxWiredInputBufferBytes (16 * 1024 * 1024)
+// The zero time stamp period is this long unless it's been set explicitly. It can't be shorter than an IO buffer.
+#define kDefaultZeroTimeStampPeriodSeconds 0.1
+#define kMinZeroTimeStampPeriod kDevice_MaxExpectedIOBufferFrameSize
+#define kMaxZeroTimeStampPeriod 131072
+// How many channels the proxy device's stream has
+#define kDevice_DefaultChannelsPerFrame 2
+#define kDevice_MinChannelsPerFrame 1
+#define kDevice_MaxChannelsPerFrame kAudioMixerMaxChannels
 
 class ProxyAudioDevice {
   public:
-    enum class ConfigType { none, outputDevice, outputDeviceBufferFrameSize, deviceName, deviceActiveCondition };
+    enum class ConfigType {
+        none,
+        outputDevice,
+        outputDeviceBufferFrameSize,
+        deviceName,
+        deviceActiveCondition,
+        latencyBudget,
+        zeroTimeStampPeriod,
+        channelCount,
+        channelMap,
+        outputDeviceFormat,
+        hardwareVolume
+    };
     enum class ActiveCondition { proxiedDeviceActive = 0, userActive = 1, always = 2 };
+    // What the output device is driven with. The integer formats are the device's own, which we convert to
+    // ourselves, optionally with dither, but they take the device away from any other app.
+    enum class OutputFormat { float32 = 0, integer = 1, ditheredInteger = 2 };
+
+    // The control state outputDeviceIOProc needs, published through ioState so the IO proc can read it without
+    // taking stateMutex
+    struct IOState {
+        Float64 sampleRate;
+        Float64 hostTicksPerFrame;
+        Float32 volumeFactorL;
+        Float32 volumeFactorR;
+    };
+
+    // The output device's own volume and mute that ours are forwarded to in hardwareVolume mode, as elements of its
+    // output scope, along with what they were set to before so they can be put back. The volume is either the
+    // master element, or the left and right channels.
+    struct ForwardedControls {
+        std::vector<AudioObjectPropertyElement> volumeElements;
+        Float32 minDecibels = -96.0f;
+        std::vector<AudioObjectPropertyElement> muteElements;
+        VolumeForwarding::Settings saved;
+    };
+
+    // Where the HAL's IO thread last wrote into inputBuffer, tagged with the input reset epoch it was written in
+    struct InputPosition {
+        UInt32 epoch;
+        Float64 frameTime;
+        UInt64 hostTime;
+        Float64 bufferFrameSize;
+    };
 
-    ProxyAudioDevice() : inputIOIsActive(false) {};
+    ProxyAudioDevice();
     AudioDevice findTargetOutputAudioDevice();
     static int outputDeviceAliveListenerStatic(AudioObjectID inObjectID,
                                                UInt32 inNumberAddresses,
@@ -51,6 +124,13 @@ class ProxyAudioDevice {
     int outputDeviceSampleRateListener(AudioObjectID inObjectID,
                                        UInt32 inNumberAddresses,
                                        const AudioObjectPropertyAddress *inAddresses);
+    static int outputDeviceStreamConfigurationListenerStatic(AudioObjectID inObjectID,
+                                                             UInt32 inNumberAddresses,
+                                                             const AudioObjectPropertyAddress *inAddresses,
+                                                             void *inClientData);
+    int outputDeviceStreamConfigurationListener(AudioObjectID inObjectID,
+                                                UInt32 inNumberAddresses,
+                                                const AudioObjectPropertyAddress *inAddresses);
     void updateOutputDeviceStartedState();
     void matchOutputDeviceSampleRateNoLock();
     void matchOutputDeviceSampleRate();
@@ -67,6 +147,17 @@ class ProxyAudioDevice {
     void deinitializeOutputDeviceNoLock();
     void deinitializeOutputDevice();
     void resetInputData();
+    void updateReportedLatencyNoLock();
+    UInt32 tunedOutputDeviceBufferFrameSizeNoLock(AudioObjectID deviceID);
+    void tuneOutputDeviceBufferFrameSizeNoLock();
+    UInt32 maxOutputDeviceBufferFrameSizeNoLock();
+    UInt32 inputBufferCapacityFrames(Float64 sampleRate, UInt32 targetBufferFrameSize, UInt32 latencyBudget);
+    void resizeInputBuffer();
+    void retireInputBuffer(AudioRingBuffer *buffer);
+    bool wireInputBuffer(AudioRingBuffer *buffer);
+    void setIOBuffersWired(bool wired);
+    void setOutputIOBuffersWired(bool wired);
+    AudioRingBuffer *acquireInputBuffer(std::atomic<AudioRingBuffer *> &inUse);
     static OSStatus outputDeviceIOProcStatic(AudioDeviceID inDevice,
                                              const AudioTimeStamp *inNow,
                                              const AudioBufferList *inInputData,
@@ -80,6 +171,8 @@ class ProxyAudioDevice {
                                 const AudioTimeStamp *inInputTime,
                                 AudioBufferList *outOutputData,
                                 const AudioTimeStamp *inOutputTime);
+    UInt32 outputBufferFrameSize(const AudioBufferList *outputData);
+    void publishIOStateNoLock();
     void calculateVolumeFactors(Float32 volumeL,
                                 Float32 volumeR,
                                 bool mute,
@@ -96,8 +189,34 @@ class ProxyAudioDevice {
     void setOutputDevice(CFStringRef deviceUID);
     UInt32 retrieveOutputDeviceBufferFrameSizeFromStorage();
     void setOutputDeviceBufferFrameSize(UInt32 size);
+    UInt32 retrieveTunedBufferFrameSizeFromStorage(CFStringRef deviceUID);
+    void storeTunedBufferFrameSize(CFStringRef deviceUID, UInt32 size);
     ActiveCondition retrieveOutputDeviceActiveConditionFromStorage();
     void setOutputDeviceActiveCondition(ActiveCondition newActiveCondition);
+    UInt32 retrieveLatencyBudgetFromStorage();
+    void setLatencyBudget(UInt32 newBudget);
+    UInt32 retrieveZeroTimeStampPeriodFromStorage();
+    void setZeroTimeStampPeriod(UInt32 newPeriod);
+    void updateZeroTimeStampPeriodNoLock();
+    UInt32 retrieveChannelCountFromStorage();
+    void setChannelCount(UInt32 newCount);
+    std::vector<UInt32> retrieveChannelMapFromStorage();
+    void setChannelMap(CFStringRef newMapString);
+    CFStringRef copyChannelMapStringNoLock();
+    OutputFormat retrieveOutputDeviceFormatFromStorage();
+    void setOutputDeviceFormat(OutputFormat newFormat);
+    void configureOutputFormatNoLock();
+    bool retrieveHardwareVolumeFromStorage();
+    void setHardwareVolume(bool enabled);
+    VolumeForwarding::Settings retrieveSavedOutputDeviceControlsFromStorage(CFStringRef deviceUID);
+    void storeSavedOutputDeviceControls(CFStringRef deviceUID, const VolumeForwarding::Settings &settings);
+    void configureHardwareVolumeNoLock();
+    void releaseHardwareVolumeNoLock();
+    void forwardVolumeToOutputDeviceNoLock();
+    void forwardVolumeToOutputDevice();
+    void configureOutputChannelsNoLock();
+    void reconfigureOutputChannelsNoLock();
+    void reconfigureOutputChannels();
 
     static ProxyAudioDevice *deviceForDriver(void *inDriver);
 
@@ -472,31 +591,91 @@ class ProxyAudioDevice {
     void ExecuteInAudioOutputThread(void (^block)());
     
     CAMutex stateMutex = CAMutex("ProxyAudioStateMutex");
-    CAMutex IOMutex = CAMutex("ProxyAudioIOMutex");
     CAMutex outputDeviceMutex = CAMutex("ProxyAudioOutputDeviceMutex");
-    CAMutex getZeroTimestampMutex = CAMutex("ProxyAudioGetZeroTimestampMutex");
+    // Serializes replacing and wiring inputBuffer, and only held briefly for either. Never taken by the IO threads.
+    CAMutex inputBufferMutex = CAMutex("ProxyAudioInputBufferMutex");
     dispatch_queue_t audioOutputQueue = NULL;
     dispatch_source_t inputMonitoringTimer = NULL;
-    AudioRingBuffer *inputBuffer = NULL;
-    Byte *workBuffer = NULL;
+    // Replaced by resizeInputBuffer whenever the sizes it depends on change. Each IO thread marks the buffer it's
+    // using in its inputBufferInUseBy* for the length of its cycle, so resizeInputBuffer knows when nothing
+    // references the old one any more.
+    std::atomic<AudioRingBuffer *> inputBuffer{NULL};
+    std::atomic<AudioRingBuffer *> inputBufferInUseByWriter{NULL};
+    std::atomic<AudioRingBuffer *> inputBufferInUseByReader{NULL};
+    // Whether inputBuffer and the real-time log are locked into memory, which they are while either IO thread
+    // could be running
+    bool inputBufferWired = false;
     AudioDevice outputDevice;
+    // Like outputDevice, these are only reconfigured while the output device isn't playing
+    AudioMixer outputMixer;
+    AudioResampler outputResampler;
+    AudioIntegerConverter outputIntegerConverter;
     bool outputDeviceReady = false;
     std::atomic_bool inputIOIsActive;
-    Float64 lastInputFrameTime = -1;
-    Float64 lastInputBufferFrameSize = -1;
+    // Bumped by resetInputData. Neither IO thread may block, so rather than resetting their state for them, each
+    // one notices the new epoch on its next cycle and resets its own.
+    std::atomic<UInt32> inputResetEpoch{0};
+    // Owned by the HAL's IO thread (DoIOOperation)
+    UInt32 inputWriterEpoch = 0;
+    // Written by the HAL's IO thread, read by outputDeviceIOProc
+    SeqLock<InputPosition> lastInputPosition{InputPosition{0, -1, 0, -1}};
+    // Owned by outputDeviceIOProc
+    UInt32 outputReaderEpoch = 0;
+    InputPosition outputReaderInputPosition = {0, -1, 0, -1};
     Float64 inputOutputSampleDelta = -1;
-    Float64 inputFinalFrameTime = -1;
-    int inputCycleCount = 0;
+    // How far the resampler has moved the read position away from inputOutputSampleDelta to follow the drift
+    // between the two devices' clocks. Owned by outputDeviceIOProc.
+    Float64 resampledFrameOffset = 0;
+    ClockDriftEstimator inputDriftEstimator;
+    FillLevelController inputFillLevelController;
+    // Whether the last output cycle copied the input out rather than resampling it. Owned by outputDeviceIOProc.
+    bool outputPassthrough = false;
+    // Set by StopIO and cleared by resetInputData, read by outputDeviceIOProc
+    std::atomic<Float64> inputFinalFrameTime{-1};
+    // How far behind the HAL's time line outputDeviceIOProc is playing, in frames, or -1 if it hasn't played yet
+    std::atomic<Float64> inputLatencyFrames{-1};
     ConfigType nextConfigurationToRead = ConfigType::none;
     pid_t configuratorPid = 0;
     CFStringRef deviceName = NULL;
     CFStringRef boxName = NULL;
     CFStringRef outputDeviceUID = NULL;
     UInt32 outputDeviceBufferFrameSize = kOutputDeviceDefaultBufferFrameSize;
+    // Owned by outputDeviceIOProc
     SInt64 smallestFramesToBufferEnd = -1;
-    Float64 outputAccumulatedRateRatio = 0.0;
-    UInt64 outputAccumulatedRateRatioSamples = 0;
+    Float64 lastOutputSampleTime = -1;
+    UInt32 lastOutputBufferFrameSize = 0;
+    UInt64 lastBufferOverrunWarningHostTime = 0;
+    // Recorded into by both IO threads and read by GetDevicePropertyData
+    IOTelemetry ioTelemetry;
+    // Recorded into by both IO threads and collected by tuneOutputDeviceBufferFrameSizeNoLock
+    BufferSizeTuningStats bufferSizeTuningStats;
+    // Only touched with outputDeviceMutex held. bufferSizeTunerDeviceID is the device bufferSizeTuner is tuning.
+    BufferSizeTuner bufferSizeTuner;
+    AudioObjectID bufferSizeTunerDeviceID = kAudioObjectUnknown;
+    // Published by outputDeviceIOProc (its only writer) for GetZeroTimeStamp
+    SeqLock<OutputClockTimeStamp> outputClockTimeStamp;
+    UInt64 outputClockTimeStampCount = 0;
     ActiveCondition outputDeviceActiveCondition = ActiveCondition::userActive;
+    UInt32 latencyBudget = kDefaultLatencyBudget;
+    // In frames, or 0 to use kDefaultZeroTimeStampPeriodSeconds
+    UInt32 zeroTimeStampPeriod = 0;
+    // The stream's channel count changes how the HAL does IO, so a new one waits in requestedChannelsPerFrame for
+    // PerformDeviceConfigurationChange to apply it to gDevice_ChannelsPerFrame
+    UInt32 requestedChannelsPerFrame = kDevice_DefaultChannelsPerFrame;
+    // The 1-based output channel each proxied channel goes to, or 0 for none, as AudioMixer::Configure takes it
+    std::vector<UInt32> channelMap;
+    OutputFormat outputDeviceFormat = OutputFormat::float32;
+    // Whether to forward our volume and mute to the output device's own controls rather than apply them ourselves
+    bool hardwareVolume = false;
+    // Whether that's actually happening, which depends on the output device having the controls. Written by
+    // configureHardwareVolumeNoLock with stateMutex held, so publishIOStateNoLock can leave the gain to the device.
+    bool outputDeviceVolumeForwarded = false;
+    bool outputDeviceMuteForwarded = false;
+    // Only touched with outputDeviceMutex held
+    ForwardedControls forwardedControls;
+    // Written with stateMutex held, read by outputDeviceIOProc, which keeps its last good copy in ioProcState
+    SeqLock<IOState> ioState;
+    IOState ioProcState = {44100.0, 0.0, 0.0, 0.0};
     
     UInt32 gPlugIn_RefCount = 0;
     AudioServerPlugInHostRef gPlugIn_Host = NULL;
@@ -504,12 +683,12 @@ class ProxyAudioDevice {
     Float64 gDevice_SampleRate = 44100.0;
     std::vector<Float64> gDevice_SampleRates = {22050, 44100, 48000, 88200, 96000, 176400, 192000};
     UInt64 gDevice_IOIsRunning = 0;
-    const UInt32 kDevice_RingBufferSize = 16384;
+    // Worked out by updateZeroTimeStampPeriodNoLock, and only changed while IO is stopped
+    UInt32 gDevice_ZeroTimeStampPeriod = 16384;
     Float64 gDevice_HostTicksPerFrame = 0.0;
-    UInt64 gDevice_NumberTimeStamps = 0;
-    Float64 gDevice_AnchorSampleTime = 0.0;
-    Float64 gDevice_ElapsedTicks = 0.0;
-    UInt64 gDevice_AnchorHostTime = 0;
+    // Only started by StartIO when IO isn't running yet and otherwise only used by GetZeroTimeStamp, which the HAL
+    // only calls while IO is running
+    ZeroTimeStampClock gDevice_ZeroTimeStampClock;
     bool gStream_Output_IsActive = true;
     const Float32 kVolume_MinDB = -25.0;
     const Float32 kVolume_MaxDB = 0.0;
@@ -517,8 +696,13 @@ class ProxyAudioDevice {
     Float32 gVolume_Output_R_Value = 0.0;
     bool gMute_Output_Mute = false;
     const UInt32 gDevice_BytesPerFrameInChannel = 4;
-    const UInt32 gDevice_ChannelsPerFrame = 2;
-    const UInt32 gDevice_SafetyOffset = 0;
+    UInt32 gDevice_ChannelsPerFrame = kDevice_DefaultChannelsPerFrame;
+    // Worked out from the target by updateReportedLatencyNoLock. The safety offset changes how the HAL does IO,
+    // so a new one waits in requestedSafetyOffset for PerformDeviceConfigurationChange to apply it.
+    UInt32 gDevice_SafetyOffset = 0;
+    UInt32 gDevice_Latency = 0;
+    UInt32 gStream_Output_Latency = 0;
+    UInt32 requestedSafetyOffset = 0;
 };
 
 extern "C" void *ProxyAudio_Create(CFAllocatorRef inAllocator, CFUUIDRef inRequestedTypeUUID);
@@ -0,0 +1,174 @@
+#include "RealTimeLog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "RealTimeMemory.h"
+
+const UInt32 RealTimeLog::kMaxArgs;
+const UInt32 RealTimeLog::kCapacity;
+
+// Constructed at load time rather than on first use, so logging never has to wait on a static initialisation guard
+static RealTimeLog sSharedLog;
+
+RealTimeLog &RealTimeLog::Shared() {
+    return sSharedLog;
+}
+
+RealTimeLog::RealTimeLog() : mWriteIndex{0}, mReadIndex(0), mDropped{0} {
+    // This also touches every page of the records, so the first messages logged don't fault them in
+    for (UInt32 i = 0; i < kCapacity; i++) {
+        mRecords[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+void RealTimeLog::Push(int priority, const char *format, const Arg *args, UInt32 argCount) {
+    UInt32 index = mWriteIndex.load(std::memory_order_relaxed);
+    Record *record;
+
+    while (true) {
+        record = &mRecords[index % kCapacity];
+        UInt32 sequence = record->sequence.load(std::memory_order_acquire);
+        SInt32 difference = SInt32(sequence - index);
+
+        if (difference == 0) {
+            // The record is free for this lap, so claim it if no other thread got there first
+            if (mWriteIndex.compare_exchange_weak(index, index + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // Drain hasn't got to this record since the last lap, so we're full
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            index = mWriteIndex.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->priority = priority;
+    record->format = format;
+    record->argCount = argCount;
+    memcpy(record->args, args, argCount * sizeof(Arg));
+    record->sequence.store(index + 1, std::memory_order_release);
+}
+
+bool RealTimeLog::SetWired(bool wired) {
+    if (!wired) {
+        UnwireMemory(mRecords, sizeof(mRecords));
+        return true;
+    }
+
+    return WireMemory(mRecords, sizeof(mRecords));
+}
+
+void RealTimeLog::Drain() {
+    char line[512];
+
+    while (true) {
+        Record &record = mRecords[mReadIndex % kCapacity];
+
+        if (record.sequence.load(std::memory_order_acquire) != mReadIndex + 1) {
+            break;
+        }
+
+        Format(record, line, sizeof(line));
+        int priority = record.priority;
+        // Hand the record back for the next lap before the syslog call, which is the slow part
+        record.sequence.store(mReadIndex + kCapacity, std::memory_order_release);
+        mReadIndex++;
+        syslog(priority, "%s", line);
+    }
+
+    UInt32 dropped = mDropped.exchange(0, std::memory_order_relaxed);
+
+    if (dropped > 0) {
+        syslog(LOG_WARNING, "ProxyAudio: real-time log dropped %u messages", dropped);
+    }
+}
+
+void RealTimeLog::Format(const Record &record, char *output, size_t outputSize) {
+    size_t length = 0;
+    UInt32 argIndex = 0;
+    const char *position = record.format;
+
+    while (*position && length + 1 < outputSize) {
+        if (*position != '%') {
+            output[length++] = *position++;
+            continue;
+        }
+
+        if (position[1] == '%') {
+            output[length++] = '%';
+            position += 2;
+            continue;
+        }
+
+        // Copy the conversion specification without its length modifier, then put back the one that matches how
+        // the argument was stored
+        char spec[32];
+        size_t specLength = 0;
+        spec[specLength++] = *position++;
+
+        while (*position && strchr("-+ #0123456789.", *position) && specLength < sizeof(spec) - 4) {
+            spec[specLength++] = *position++;
+        }
+
+        while (*position && strchr("hlLqjzt", *position)) {
+            position++;
+        }
+
+        char conversion = *position;
+
+        if (!conversion) {
+            break;
+        }
+
+        position++;
+
+        if (argIndex >= record.argCount) {
+            int written = snprintf(output + length, outputSize - length, "<missing>");
+            length += std::min(size_t(std::max(written, 0)), outputSize - length - 1);
+            continue;
+        }
+
+        const Arg &arg = record.args[argIndex++];
+        int written;
+
+        if (conversion == 'c') {
+            spec[specLength++] = 'c';
+            spec[specLength] = 0;
+            written = snprintf(output + length, outputSize - length, spec, int(arg.s));
+        } else if (strchr("diouxX", conversion)) {
+            spec[specLength++] = 'l';
+            spec[specLength++] = 'l';
+            spec[specLength++] = conversion;
+            spec[specLength] = 0;
+            // Signed and unsigned are stored in the same bits, so only floats need converting
+            long long value = arg.type == Arg::kFloat ? (long long)arg.f : (long long)arg.s;
+            written = snprintf(output + length, outputSize - length, spec, value);
+        } else if (strchr("eEfFgGaA", conversion)) {
+            spec[specLength++] = conversion;
+            spec[specLength] = 0;
+            Float64 value = arg.type == Arg::kFloat      ? arg.f
+                            : arg.type == Arg::kUnsigned ? Float64(arg.u)
+                                                         : Float64(arg.s);
+            written = snprintf(output + length, outputSize - length, spec, value);
+        } else if (conversion == 's') {
+            spec[specLength++] = 's';
+            spec[specLength] = 0;
+            written = snprintf(output + length,
+                               outputSize - length,
+                               spec,
+                               arg.type == Arg::kString && arg.string ? arg.string : "<not a string>");
+        } else if (conversion == 'p') {
+            written = snprintf(output + length, outputSize - length, "%p", arg.pointer);
+        } else {
+            written = snprintf(output + length, outputSize - length, "<bad conversion>");
+        }
+
+        length += std::min(size_t(std::max(written, 0)), outputSize - length - 1);
+    }
+
+    output[length] = 0;
+}
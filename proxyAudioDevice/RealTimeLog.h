@@ -0,0 +1,143 @@
+#ifndef __RealTimeLog_h__
+#define __RealTimeLog_h__
+
+#include <MacTypes.h>
+#include <sys/syslog.h>
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+// Logging for the IO threads, which mustn't call syslog as it can block and allocate.
+//
+// Log just copies the format string pointer and its arguments into a preallocated record, without formatting
+// anything, and Drain later formats the records and hands them to syslog from an ordinary thread. Any number of
+// threads can log at once, lock-free. If the records are all in use the message is dropped and counted instead.
+//
+// The format must be a string literal, or at least outlive the record, and so must any %s arguments. Only the
+// printf conversions for numbers, strings and pointers are supported, and length modifiers are ignored since every
+// argument is stored at full width.
+class RealTimeLog {
+  public:
+    static const UInt32 kMaxArgs = 6;
+
+    static RealTimeLog &Shared();
+
+    RealTimeLog();
+
+    template <typename... Args>
+    void Log(int priority, const char *format, Args... args) {
+        static_assert(sizeof...(Args) <= kMaxArgs, "too many arguments for RealTimeLog");
+        // One spare so the array isn't empty when there are no arguments
+        Arg packedArgs[sizeof...(Args) + 1] = {MakeArg(args)...};
+        Push(priority, format, packedArgs, sizeof...(Args));
+    }
+
+    // Writes out everything logged so far. Only one thread may drain at a time.
+    void Drain();
+
+    // Locks the records into memory while wired, so logging can't page fault. Not real-time safe. Returns false if
+    // locking them failed.
+    bool SetWired(bool wired);
+
+  private:
+    static const UInt32 kCapacity = 256;
+
+    struct Arg {
+        enum Type : UInt8 { kSigned, kUnsigned, kFloat, kString, kPointer } type;
+
+        union {
+            SInt64 s;
+            UInt64 u;
+            Float64 f;
+            const char *string;
+            const void *pointer;
+        };
+    };
+
+    struct Record {
+        // Which lap around the records this one is ready for, as in Dmitry Vyukov's bounded queue
+        std::atomic<UInt32> sequence;
+        int priority;
+        const char *format;
+        UInt32 argCount;
+        Arg args[kMaxArgs];
+    };
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, Arg>::type MakeArg(T value) {
+        Arg arg;
+        arg.type = Arg::kSigned;
+        arg.s = value;
+        return arg;
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, Arg>::type MakeArg(
+        T value) {
+        Arg arg;
+        arg.type = Arg::kUnsigned;
+        arg.u = value;
+        return arg;
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value, Arg>::type MakeArg(T value) {
+        Arg arg;
+        arg.type = Arg::kFloat;
+        arg.f = value;
+        return arg;
+    }
+
+    static Arg MakeArg(const char *value) {
+        Arg arg;
+        arg.type = Arg::kString;
+        arg.string = value;
+        return arg;
+    }
+
+    static Arg MakeArg(const void *value) {
+        Arg arg;
+        arg.type = Arg::kPointer;
+        arg.pointer = value;
+        return arg;
+    }
+
+    void Push(int priority, const char *format, const Arg *args, UInt32 argCount);
+    static void Format(const Record &record, char *output, size_t outputSize);
+
+    Record mRecords[kCapacity];
+    std::atomic<UInt32> mWriteIndex;
+    UInt32 mReadIndex;
+    std::atomic<UInt32> mDropped;
+};
+
+// For the IO threads, in place of syslog and DebugMsg
+#define RTLog(inPriority, inFormat, ...) RealTimeLog::Shared().Log(inPriority, inFormat, ##__VA_ARGS__)
+
+#if DEBUG
+
+#define RTDebugMsg(inFormat, ...) RTLog(LOG_NOTICE, inFormat, ##__VA_ARGS__)
+
+#define RTFailWithAction(inCondition, inAction, inHandler, inMessage)                                                  \
+    if (inCondition) {                                                                                                 \
+        RTDebugMsg("ProxyAudio error: " inMessage);                                                                    \
+        { inAction; }                                                                                                  \
+        goto inHandler;                                                                                                \
+    }
+
+#else
+
+#define RTDebugMsg(inFormat, ...)
+
+#define RTFailWithAction(inCondition, inAction, inHandler, inMessage)                                                  \
+    if (inCondition) {                                                                                                 \
+        {                                                                                                              \
+            inAction;                                                                                                  \
+        }                                                                                                              \
+        goto inHandler;                                                                                                \
+    }
+
+#endif
+
+#endif // __RealTimeLog_h__
@@ -0,0 +1,79 @@
+#ifndef __RealTimeMemory_h__
+#define __RealTimeMemory_h__
+
+#include <MacTypes.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Memory the IO threads touch has to be resident, or the first cycle after it has been paged out takes the page
+// faults. Like AudioRingBuffer's, buffers for the IO threads are allocated in whole pages of their own and touched
+// up front, then locked into memory while IO is running.
+
+// Locks the pages spanning [address, address + bytes) into memory, which also faults back in any that were paged
+// out. Not real-time safe.
+inline bool WireMemory(const void *address, size_t bytes) {
+    return bytes == 0 || mlock(address, bytes) == 0;
+}
+
+inline void UnwireMemory(const void *address, size_t bytes) {
+    if (bytes > 0) {
+        munlock(address, bytes);
+    }
+}
+
+// Allocates in whole, zeroed, prefaulted pages that no other allocation shares, so wiring and unwiring one buffer
+// never affects another
+template <typename T> class PageAllocator {
+  public:
+    typedef T value_type;
+
+    PageAllocator() {}
+    template <typename U> PageAllocator(const PageAllocator<U> &) {}
+
+    T *allocate(size_t count) {
+        size_t bytes = RoundedBytes(count);
+        void *memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+        // The pages aren't backed until they're first written
+        memset(memory, 0, bytes);
+        return static_cast<T *>(memory);
+    }
+
+    void deallocate(T *pointer, size_t count) { munmap(pointer, RoundedBytes(count)); }
+
+    static size_t RoundedBytes(size_t count) {
+        size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+        return (count * sizeof(T) + pageSize - 1) / pageSize * pageSize;
+    }
+};
+
+template <typename T, typename U> bool operator==(const PageAllocator<T> &, const PageAllocator<U> &) {
+    return true;
+}
+
+template <typename T, typename U> bool operator!=(const PageAllocator<T> &, const PageAllocator<U> &) {
+    return false;
+}
+
+// A buffer for the IO threads. Size it with assign rather than reserve, so every element is written before IO
+// starts.
+template <typename T> using RealTimeVector = std::vector<T, PageAllocator<T>>;
+
+template <typename T> inline bool WireVector(const RealTimeVector<T> &vector) {
+    return WireMemory(vector.data(), vector.capacity() * sizeof(T));
+}
+
+template <typename T> inline void UnwireVector(const RealTimeVector<T> &vector) {
+    UnwireMemory(vector.data(), vector.capacity() * sizeof(T));
+}
+
+#endif // __RealTimeMemory_h__
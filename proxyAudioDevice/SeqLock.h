@@ -0,0 +1,69 @@
+#ifndef __SeqLock_h__
+#define __SeqLock_h__
+
+#include <MacTypes.h>
+#include <atomic>
+#include <type_traits>
+
+// A sequence lock for publishing a small, trivially copyable struct from control threads to real-time threads.
+// Readers never block and never write anything, so a real-time thread can read it every cycle without being
+// held up by whatever the writer is doing.
+//
+// Writers are not synchronized with each other; callers have to make sure only one thread writes at a time
+// (normally by only writing while holding some mutex the readers never take).
+template <typename T> class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock can only hold trivially copyable types");
+
+  public:
+    SeqLock() : mSequence(0), mValue() {}
+    explicit SeqLock(const T &value) : mSequence(0), mValue(value) {}
+
+    void Store(const T &value) {
+        UInt32 sequence = mSequence.load(std::memory_order_relaxed);
+
+        // An odd sequence number tells readers a write is in progress
+        mSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        mValue = value;
+        mSequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Copies the current value into outValue and returns true, unless a writer was in the middle of storing for
+    // all of our attempts. In that case outValue is left alone, so real-time callers can keep using whatever
+    // they read last time rather than spinning on a writer that may have been preempted.
+    bool TryLoad(T &outValue, UInt32 attempts = 4) const {
+        for (UInt32 attempt = 0; attempt < attempts; attempt++) {
+            UInt32 sequenceBefore = mSequence.load(std::memory_order_acquire);
+
+            if (sequenceBefore & 1) {
+                continue;
+            }
+
+            T value = mValue;
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (mSequence.load(std::memory_order_relaxed) == sequenceBefore) {
+                outValue = value;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // For readers that can afford to wait for a writer to finish
+    T Load() const {
+        T value;
+
+        while (!TryLoad(value)) {
+        }
+
+        return value;
+    }
+
+  private:
+    std::atomic<UInt32> mSequence;
+    T mValue;
+};
+
+#endif // __SeqLock_h__
@@ -0,0 +1,38 @@
+#include "VolumeForwarding.h"
+
+#include <algorithm>
+#include <cmath>
+
+VolumeForwarding::Settings VolumeForwarding::Forward(Float32 factorL,
+                                                     Float32 factorR,
+                                                     bool silent,
+                                                     Float32 minDecibels,
+                                                     size_t volumeElementCount,
+                                                     size_t muteElementCount) {
+    Float32 factors[2] = {factorL, factorR};
+    Float32 decibels[2];
+
+    for (int i = 0; i < 2; i++) {
+        decibels[i] = factors[i] > 0.0f ? std::max(20.0f * log10f(factors[i]), minDecibels) : minDecibels;
+    }
+
+    Settings settings;
+
+    if (volumeElementCount == 1) {
+        settings.decibels.assign(1, 0.5f * (decibels[0] + decibels[1]));
+    } else if (volumeElementCount == 2) {
+        settings.decibels.assign(decibels, decibels + 2);
+    }
+
+    settings.mutes.assign(muteElementCount, silent ? 1 : 0);
+    return settings;
+}
+
+const VolumeForwarding::Settings &VolumeForwarding::ToRestore(const Settings &current, const Settings &saved) {
+    if (!saved.empty() && saved.decibels.size() == current.decibels.size()
+        && saved.mutes.size() == current.mutes.size()) {
+        return saved;
+    }
+
+    return current;
+}
@@ -0,0 +1,39 @@
+#ifndef __VolumeForwarding_h__
+#define __VolumeForwarding_h__
+
+#include <MacTypes.h>
+
+#include <cstddef>
+#include <vector>
+
+// Works out what the output device's own volume and mute controls are set to in hardwareVolume mode, and what gets
+// put back on them afterwards. Talking to the device is left to ProxyAudioDevice.
+class VolumeForwarding {
+  public:
+    // What a device's volume controls, in decibels, and mute controls are set to, in the order of their elements.
+    // The volume is either the master element, or the left and right channels.
+    struct Settings {
+        std::vector<Float32> decibels;
+        std::vector<UInt32> mutes;
+
+        bool empty() const { return decibels.empty() && mutes.empty(); }
+    };
+
+    // The settings that play at the gains factorL and factorR, or not at all if silent, on volumeElementCount volume
+    // controls and muteElementCount mute controls. The device can't go quieter than minDecibels, so anything below
+    // that gets minDecibels. A single volume control gets the average of the two sides.
+    static Settings Forward(Float32 factorL,
+                            Float32 factorR,
+                            bool silent,
+                            Float32 minDecibels,
+                            size_t volumeElementCount,
+                            size_t muteElementCount);
+
+    // Which settings to put back when forwarding stops, given what the device's controls had when it started and
+    // what was saved to storage the last time it started. If that earlier forwarding never got to put them back,
+    // because coreaudiod went away first, the device still has what we forwarded, so the saved settings win as long
+    // as they're for the same controls.
+    static const Settings &ToRestore(const Settings &current, const Settings &saved);
+};
+
+#endif // __VolumeForwarding_h__
@@ -0,0 +1,128 @@
+#include "ZeroTimeStampClock.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Loop bandwidths in Hz, and how long the wider one is used for before narrowing to the other
+static const Float64 kLockingBandwidth = 1.0;
+static const Float64 kLockedBandwidth = 0.1;
+static const Float64 kLockingSeconds = 10.0;
+// An output time stamp this far off from where the loop expects it isn't jitter, the output device's time line must
+// have jumped, so start following it again from there
+static const Float64 kMaxErrorSeconds = 0.05;
+// How far the loop may ever take the rate from nominal
+static const Float64 kMaxRateDeviation = 0.01;
+
+void ZeroTimeStampClock::Start(UInt64 hostTime, UInt32 period, Float64 sampleRate, Float64 nominalHostTicksPerFrame) {
+    State state;
+    state.anchorHostTime = hostTime;
+    state.elapsedTicks = 0;
+    state.numberTimeStamps = 0;
+    state.period = period;
+    state.sampleRate = sampleRate;
+    state.nominalHostTicksPerFrame = nominalHostTicksPerFrame;
+    state.loopLocked = false;
+    state.loopSampleTime = 0;
+    state.loopHostTime = 0;
+    state.loopHostTicksPerFrame = nominalHostTicksPerFrame;
+    state.loopStartSampleTime = 0;
+    state.lastOutputTimeStampCount = 0;
+    mState.Store(state);
+    Publish(state);
+}
+
+void ZeroTimeStampClock::Publish(const State &state) {
+    ZeroTimeStamp stamp;
+    stamp.sampleTime = state.numberTimeStamps * state.period;
+    stamp.hostTime = state.anchorHostTime + state.elapsedTicks;
+    mPublished[0].Store(stamp);
+    mPublished[1].Store(stamp);
+}
+
+ZeroTimeStampClock::ZeroTimeStamp ZeroTimeStampClock::LoadPublished() const {
+    // Only one copy is ever being written at a time, so if both reads fail, it's because the updating thread has
+    // finished one copy and moved on to the other in between, not because it's stuck. Going round again is then
+    // sure to find the one it finished.
+    ZeroTimeStamp stamp;
+
+    while (!mPublished[0].TryLoad(stamp, 1) && !mPublished[1].TryLoad(stamp, 1)) {
+    }
+
+    return stamp;
+}
+
+void ZeroTimeStampClock::UpdateLoop(State &state, const OutputClockTimeStamp &timeStamp) {
+    Float64 hostTime = Float64(SInt64(timeStamp.hostTime - state.anchorHostTime));
+    Float64 frames = timeStamp.sampleTime - state.loopSampleTime;
+    Float64 predictedHostTime = state.loopHostTime + state.loopHostTicksPerFrame * frames;
+    Float64 error = hostTime - predictedHostTime;
+
+    if (!state.loopLocked || frames < 0
+        || std::fabs(error) > kMaxErrorSeconds * state.sampleRate * state.nominalHostTicksPerFrame) {
+        // Start following the output device from this time stamp, keeping whatever rate we'd measured
+        if (!state.loopLocked) {
+            state.loopStartSampleTime = timeStamp.sampleTime;
+        }
+
+        state.loopLocked = true;
+        state.loopSampleTime = timeStamp.sampleTime;
+        state.loopHostTime = hostTime;
+        return;
+    }
+
+    if (frames == 0) {
+        return;
+    }
+
+    // The loop's natural frequency over the time since its last update. The time stamps don't arrive at regular
+    // intervals, so the usual DLL coefficients are scaled by how long it's been.
+    Float64 bandwidth = (timeStamp.sampleTime - state.loopStartSampleTime < kLockingSeconds * state.sampleRate)
+                            ? kLockingBandwidth
+                            : kLockedBandwidth;
+    Float64 omega = std::min(2.0 * M_PI * bandwidth * frames / state.sampleRate, 1.0);
+
+    state.loopSampleTime = timeStamp.sampleTime;
+    state.loopHostTime = predictedHostTime + M_SQRT2 * omega * error;
+    state.loopHostTicksPerFrame += omega * omega * error / frames;
+    state.loopHostTicksPerFrame = std::min(std::max(state.loopHostTicksPerFrame,
+                                                    state.nominalHostTicksPerFrame * (1.0 - kMaxRateDeviation)),
+                                           state.nominalHostTicksPerFrame * (1.0 + kMaxRateDeviation));
+}
+
+void ZeroTimeStampClock::GetZeroTimeStamp(UInt64 currentHostTime,
+                                          const OutputClockTimeStamp *latestOutputTimeStamp,
+                                          Float64 &outSampleTime,
+                                          UInt64 &outHostTime) {
+    if (mUpdating.test_and_set(std::memory_order_acquire)) {
+        // Another thread is moving the time line on right now. Rather than wait for it, hand out the last zero time
+        // stamp published, which is what we'd have returned a moment ago anyway.
+        ZeroTimeStamp stamp = LoadPublished();
+        outSampleTime = stamp.sampleTime;
+        outHostTime = stamp.hostTime;
+        return;
+    }
+
+    // No other thread writes mState while we hold mUpdating, so this never has to wait
+    State state = mState.Load();
+
+    if (latestOutputTimeStamp && latestOutputTimeStamp->count != state.lastOutputTimeStampCount) {
+        UpdateLoop(state, *latestOutputTimeStamp);
+        state.lastOutputTimeStampCount = latestOutputTimeStamp->count;
+    }
+
+    // Go to the next time stamp if its host time has passed
+    Float64 hostTicksPerPeriod = state.loopHostTicksPerFrame * state.period;
+    UInt64 nextHostTime = state.anchorHostTime + ((UInt64)(state.elapsedTicks + hostTicksPerPeriod));
+
+    if (nextHostTime <= currentHostTime) {
+        ++state.numberTimeStamps;
+        state.elapsedTicks += hostTicksPerPeriod;
+    }
+
+    mState.Store(state);
+    Publish(state);
+    mUpdating.clear(std::memory_order_release);
+
+    outSampleTime = state.numberTimeStamps * state.period;
+    outHostTime = state.anchorHostTime + state.elapsedTicks;
+}
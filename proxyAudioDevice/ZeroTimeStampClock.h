@@ -0,0 +1,80 @@
+#ifndef __ZeroTimeStampClock_h__
+#define __ZeroTimeStampClock_h__
+
+#include <MacTypes.h>
+#include <atomic>
+
+#include "SeqLock.h"
+
+// A time stamp from the output device's IO proc, published for ZeroTimeStampClock to follow
+struct OutputClockTimeStamp {
+    Float64 sampleTime;
+    UInt64 hostTime;
+    // Bumped with every new time stamp
+    UInt64 count;
+};
+
+// The device's time line as handed out by GetZeroTimeStamp: a zero time stamp every period frames, spaced however
+// many host ticks the output device takes to play that many frames.
+//
+// The output device's rate is tracked by a second order delay-locked loop fed with its IO proc's time stamps. The
+// loop filters out the jitter in those while following the device's actual clock, including slow changes such as
+// its crystal warming up, so the zero time stamps come out evenly spaced and locked to the device. Its bandwidth
+// starts out wide so it locks on quickly, and narrows once it has.
+//
+// Nothing in here reads a clock. The host time is always passed in, so the time line is entirely determined by the
+// host times and output time stamps it's given.
+class ZeroTimeStampClock {
+  public:
+    // Anchors the time line at hostTime, with a zero time stamp every period frames, starting from the nominal
+    // host ticks per frame for the sample rate. Must not be called at the same time as GetZeroTimeStamp.
+    void Start(UInt64 hostTime, UInt32 period, Float64 sampleRate, Float64 nominalHostTicksPerFrame);
+
+    // Moves on to the next zero time stamp if currentHostTime has reached it, and returns the current one.
+    // latestOutputTimeStamp may be NULL if there's no fresh output time stamp, in which case the loop just carries
+    // on with its current estimate. Lock-free and safe to call from any number of threads: the HAL calls it from
+    // whichever thread wants a time stamp. Only one of them moves the time line on at a time, and any that come in
+    // while it is just get the last zero time stamp published, without waiting for it, even if it's been preempted
+    // halfway through.
+    void GetZeroTimeStamp(UInt64 currentHostTime,
+                          const OutputClockTimeStamp *latestOutputTimeStamp,
+                          Float64 &outSampleTime,
+                          UInt64 &outHostTime);
+
+  private:
+    struct State {
+        UInt64 anchorHostTime;
+        Float64 elapsedTicks;
+        UInt64 numberTimeStamps;
+        UInt32 period;
+        Float64 sampleRate;
+        Float64 nominalHostTicksPerFrame;
+
+        // The loop's estimate of the host time (relative to anchorHostTime) that the output device plays
+        // loopSampleTime at, and of the host ticks it takes per frame
+        bool loopLocked;
+        Float64 loopSampleTime;
+        Float64 loopHostTime;
+        Float64 loopHostTicksPerFrame;
+        Float64 loopStartSampleTime;
+        UInt64 lastOutputTimeStampCount;
+    };
+
+    struct ZeroTimeStamp {
+        Float64 sampleTime;
+        UInt64 hostTime;
+    };
+
+    static void UpdateLoop(State &state, const OutputClockTimeStamp &timeStamp);
+    void Publish(const State &state);
+    ZeroTimeStamp LoadPublished() const;
+
+    SeqLock<State> mState;
+    // Held by whichever GetZeroTimeStamp is updating mState, as SeqLock only allows one writer
+    std::atomic_flag mUpdating = ATOMIC_FLAG_INIT;
+    // The last zero time stamp, for callers that find mUpdating taken. It's published twice over, one copy after
+    // the other, so however far the updating thread has got, at least one copy isn't being written.
+    SeqLock<ZeroTimeStamp> mPublished[2];
+};
+
+#endif // __ZeroTimeStampClock_h__
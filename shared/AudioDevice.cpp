@@ -4,10 +4,44 @@
 #include "debugHelpers.h"
 #include "CFTypeHelpers.h"
 
+#include <algorithm>
+#include <dispatch/dispatch.h>
+
+// Whether format is one of the integer layouts AudioMixKernels::ConvertToInteger can write: native endian, 16, 24
+// or 32 valid bits, in 2, 3 or 4 byte samples
+static bool isUsableIntegerFormat(const AudioStreamBasicDescription &format) {
+    bool nativeEndian = (format.mFormatFlags & kAudioFormatFlagIsBigEndian)
+                        == (kAudioFormatFlagsNativeEndian & kAudioFormatFlagIsBigEndian);
+
+    if (format.mFormatID != kAudioFormatLinearPCM || !(format.mFormatFlags & kAudioFormatFlagIsSignedInteger)
+        || (format.mFormatFlags & kAudioFormatFlagIsFloat) || !nativeEndian || format.mChannelsPerFrame == 0) {
+        return false;
+    }
+
+    UInt32 channelsPerBuffer = (format.mFormatFlags & kAudioFormatFlagIsNonInterleaved) ? 1 : format.mChannelsPerFrame;
+    UInt32 bytesPerSample = format.mBytesPerFrame / channelsPerBuffer;
+
+    return (format.mBitsPerChannel == 16 || format.mBitsPerChannel == 24 || format.mBitsPerChannel == 32)
+           && bytesPerSample >= 2 && bytesPerSample <= 4 && bytesPerSample * channelsPerBuffer == format.mBytesPerFrame
+           && format.mBitsPerChannel <= bytesPerSample * 8;
+}
+
+// Whether two integer formats store their samples the same way, whatever their channel counts
+static bool haveSameSampleLayout(const AudioStreamBasicDescription &a, const AudioStreamBasicDescription &b) {
+    UInt32 flags = kAudioFormatFlagIsNonInterleaved | kAudioFormatFlagIsAlignedHigh | kAudioFormatFlagIsPacked;
+    UInt32 channelsPerBufferA = (a.mFormatFlags & kAudioFormatFlagIsNonInterleaved) ? 1 : a.mChannelsPerFrame;
+    UInt32 channelsPerBufferB = (b.mFormatFlags & kAudioFormatFlagIsNonInterleaved) ? 1 : b.mChannelsPerFrame;
+
+    return a.mBitsPerChannel == b.mBitsPerChannel && (a.mFormatFlags & flags) == (b.mFormatFlags & flags)
+           && a.mBytesPerFrame / channelsPerBufferA == b.mBytesPerFrame / channelsPerBufferB;
+}
+
 AudioDevice::AudioDevice(AudioObjectID inId, bool inIsOutput) {
     id = inId;
     isOutput = inIsOutput;
     safetyOffset = 0;
+    latency = 0;
+    streamLatency = 0;
     bufferFrameSize = 0;
     procId = nullptr;
     isStarted = false;
@@ -48,6 +82,19 @@ OSStatus AudioDevice::updateStreamInfo() {
         return err;
     }
 
+    // Not every device reports its latency, and we can play without knowing it, so these aren't fatal
+    if (getIntegerPropertyData(latency,
+                               kAudioDevicePropertyLatency,
+                               isOutput ? kAudioObjectPropertyScopeOutput : kAudioObjectPropertyScopeInput,
+                               kAudioObjectPropertyElementMaster)
+        != noErr) {
+        latency = 0;
+    }
+
+    if (getFirstStreamLatency(streamLatency) != noErr) {
+        streamLatency = 0;
+    }
+
     err = getIntegerPropertyData(bufferFrameSize,
                                  kAudioDevicePropertyBufferFrameSize,
                                  isOutput ? kAudioObjectPropertyScopeOutput : kAudioObjectPropertyScopeInput,
@@ -68,6 +115,13 @@ OSStatus AudioDevice::updateStreamInfo() {
         return err;
     }
 
+    err = getStreamChannelCounts(streamChannelCounts);
+
+    if (err != noErr) {
+        syslog(LOG_WARNING, "ProxyAudio: error: failed to get stream configuration of device %u", id);
+        return err;
+    }
+
     return noErr;
 }
 
@@ -154,6 +208,316 @@ OSStatus AudioDevice::getDoublePropertyData(Float64 &outValue,
     return noErr;
 }
 
+OSStatus AudioDevice::getFloatPropertyData(Float32 &outValue,
+                                           AudioObjectPropertySelector selector,
+                                           AudioObjectPropertyScope scope,
+                                           AudioObjectPropertyElement element) {
+    AudioObjectPropertyAddress propertyAddress = {selector, scope, element};
+    UInt32 size = sizeof(Float32);
+    Float32 value = 0;
+    OSStatus err = AudioObjectGetPropertyData(id, &propertyAddress, 0, NULL, &size, &value);
+
+    if (err != noErr) {
+        return err;
+    }
+
+    outValue = value;
+
+    return noErr;
+}
+
+OSStatus AudioDevice::setIntegerPropertyData(UInt32 value,
+                                             AudioObjectPropertySelector selector,
+                                             AudioObjectPropertyScope scope,
+                                             AudioObjectPropertyElement element) {
+    AudioObjectPropertyAddress propertyAddress = {selector, scope, element};
+    return AudioObjectSetPropertyData(id, &propertyAddress, 0, NULL, sizeof(UInt32), &value);
+}
+
+OSStatus AudioDevice::setFloatPropertyData(Float32 value,
+                                           AudioObjectPropertySelector selector,
+                                           AudioObjectPropertyScope scope,
+                                           AudioObjectPropertyElement element) {
+    AudioObjectPropertyAddress propertyAddress = {selector, scope, element};
+    return AudioObjectSetPropertyData(id, &propertyAddress, 0, NULL, sizeof(Float32), &value);
+}
+
+bool AudioDevice::isPropertySettable(AudioObjectPropertySelector selector,
+                                     AudioObjectPropertyScope scope,
+                                     AudioObjectPropertyElement element) {
+    AudioObjectPropertyAddress propertyAddress = {selector, scope, element};
+    Boolean settable = false;
+
+    return AudioObjectHasProperty(id, &propertyAddress)
+           && AudioObjectIsPropertySettable(id, &propertyAddress, &settable) == noErr && settable;
+}
+
+OSStatus AudioDevice::getStreamChannelCounts(std::vector<UInt32> &outChannelCounts) {
+    AudioObjectPropertyAddress propertyAddress = {kAudioDevicePropertyStreamConfiguration,
+                                                  isOutput ? kAudioObjectPropertyScopeOutput
+                                                           : kAudioObjectPropertyScopeInput,
+                                                  kAudioObjectPropertyElementMaster};
+    UInt32 size = 0;
+    OSStatus err = AudioObjectGetPropertyDataSize(id, &propertyAddress, 0, NULL, &size);
+
+    if (err != noErr) {
+        return err;
+    }
+
+    outChannelCounts.clear();
+
+    if (size < sizeof(AudioBufferList)) {
+        return noErr;
+    }
+
+    std::vector<Byte> bufferListData(size);
+    AudioBufferList *bufferList = (AudioBufferList *)bufferListData.data();
+    err = AudioObjectGetPropertyData(id, &propertyAddress, 0, NULL, &size, bufferList);
+
+    if (err != noErr) {
+        return err;
+    }
+
+    for (UInt32 i = 0; i < bufferList->mNumberBuffers; i++) {
+        outChannelCounts.push_back(bufferList->mBuffers[i].mNumberChannels);
+    }
+
+    return noErr;
+}
+
+OSStatus AudioDevice::getFirstStreamLatency(UInt32 &outLatency) {
+    AudioObjectPropertyAddress propertyAddress = {kAudioDevicePropertyStreams,
+                                                  isOutput ? kAudioObjectPropertyScopeOutput
+                                                           : kAudioObjectPropertyScopeInput,
+                                                  kAudioObjectPropertyElementMaster};
+    AudioObjectID stream = kAudioObjectUnknown;
+    UInt32 size = sizeof(AudioObjectID);
+    OSStatus err = AudioObjectGetPropertyData(id, &propertyAddress, 0, NULL, &size, &stream);
+
+    if (err != noErr) {
+        return err;
+    }
+
+    outLatency = 0;
+
+    if (size < sizeof(AudioObjectID) || stream == kAudioObjectUnknown) {
+        return noErr;
+    }
+
+    propertyAddress = {kAudioStreamPropertyLatency, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster};
+    size = sizeof(UInt32);
+    return AudioObjectGetPropertyData(stream, &propertyAddress, 0, NULL, &size, &outLatency);
+}
+
+OSStatus AudioDevice::getStreams(std::vector<AudioObjectID> &outStreams) {
+    AudioObjectPropertyAddress propertyAddress = {kAudioDevicePropertyStreams,
+                                                  isOutput ? kAudioObjectPropertyScopeOutput
+                                                           : kAudioObjectPropertyScopeInput,
+                                                  kAudioObjectPropertyElementMaster};
+    UInt32 size = 0;
+    OSStatus err = AudioObjectGetPropertyDataSize(id, &propertyAddress, 0, NULL, &size);
+
+    if (err != noErr) {
+        return err;
+    }
+
+    outStreams.resize(size / sizeof(AudioObjectID));
+
+    if (outStreams.empty()) {
+        return noErr;
+    }
+
+    err = AudioObjectGetPropertyData(id, &propertyAddress, 0, NULL, &size, outStreams.data());
+    outStreams.resize(err == noErr ? size / sizeof(AudioObjectID) : 0);
+    return err;
+}
+
+bool AudioDevice::getVirtualFormat(AudioObjectID stream, AudioStreamBasicDescription &outFormat) {
+    AudioObjectPropertyAddress propertyAddress = {
+        kAudioStreamPropertyVirtualFormat, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster};
+    UInt32 size = sizeof(AudioStreamBasicDescription);
+    return AudioObjectGetPropertyData(stream, &propertyAddress, 0, NULL, &size, &outFormat) == noErr;
+}
+
+static OSStatus virtualFormatChangedListener(AudioObjectID inObjectID,
+                                             UInt32 inNumberAddresses,
+                                             const AudioObjectPropertyAddress *inAddresses,
+                                             void *inClientData) {
+#pragma unused(inObjectID, inNumberAddresses, inAddresses)
+    dispatch_semaphore_signal(static_cast<dispatch_semaphore_t>(inClientData));
+    return noErr;
+}
+
+bool AudioDevice::setVirtualFormat(AudioObjectID stream, const AudioStreamBasicDescription &format) {
+    AudioObjectPropertyAddress propertyAddress = {
+        kAudioStreamPropertyVirtualFormat, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster};
+
+    // The HAL may finish switching formats asynchronously, and the IO proc mustn't get buffers in a format other
+    // than the one we've been told about, so wait for it, for up to a second. It tells us when the format changes,
+    // and in case it already has or the notification goes missing, check again every few milliseconds anyway.
+    dispatch_semaphore_t formatChanged = dispatch_semaphore_create(0);
+    bool listening =
+        AudioObjectAddPropertyListener(stream, &propertyAddress, virtualFormatChangedListener, formatChanged) == noErr;
+    bool switched = false;
+
+    if (AudioObjectSetPropertyData(stream, &propertyAddress, 0, NULL, sizeof(format), &format) == noErr) {
+        // Only the flags that change how the buffers are laid out matter
+        UInt32 flags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsNonInterleaved
+                       | kAudioFormatFlagIsAlignedHigh | kAudioFormatFlagIsNonMixable;
+        dispatch_time_t deadline = dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC);
+
+        for (;;) {
+            AudioStreamBasicDescription currentFormat;
+
+            if (getVirtualFormat(stream, currentFormat)
+                && (currentFormat.mFormatFlags & flags) == (format.mFormatFlags & flags)
+                && currentFormat.mBitsPerChannel == format.mBitsPerChannel
+                && currentFormat.mBytesPerFrame == format.mBytesPerFrame) {
+                switched = true;
+                break;
+            }
+
+            if (dispatch_time(DISPATCH_TIME_NOW, 0) >= deadline) {
+                break;
+            }
+
+            dispatch_semaphore_wait(formatChanged, dispatch_time(DISPATCH_TIME_NOW, 2 * NSEC_PER_MSEC));
+        }
+    }
+
+    if (listening) {
+        AudioObjectRemovePropertyListener(stream, &propertyAddress, virtualFormatChangedListener, formatChanged);
+    }
+
+    dispatch_release(formatChanged);
+    return switched;
+}
+
+OSStatus AudioDevice::setIntegerVirtualFormat(AudioStreamBasicDescription &outFormat) {
+    std::vector<AudioObjectID> streams;
+    OSStatus err = getStreams(streams);
+
+    if (err != noErr || streams.empty()) {
+        return err != noErr ? err : OSStatus(kAudioHardwareUnsupportedOperationError);
+    }
+
+    // The integer formats each stream can have at the current sample rate and channel count
+    std::vector<std::vector<AudioStreamBasicDescription>> candidates(streams.size());
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        AudioStreamBasicDescription currentFormat;
+        AudioObjectPropertyAddress propertyAddress = {kAudioStreamPropertyAvailableVirtualFormats,
+                                                      kAudioObjectPropertyScopeGlobal,
+                                                      kAudioObjectPropertyElementMaster};
+        UInt32 size = 0;
+
+        if (!getVirtualFormat(streams[i], currentFormat)
+            || AudioObjectGetPropertyDataSize(streams[i], &propertyAddress, 0, NULL, &size) != noErr) {
+            return kAudioHardwareUnspecifiedError;
+        }
+
+        std::vector<AudioStreamRangedDescription> available(size / sizeof(AudioStreamRangedDescription));
+
+        if (!available.empty()
+            && AudioObjectGetPropertyData(streams[i], &propertyAddress, 0, NULL, &size, available.data()) != noErr) {
+            return kAudioHardwareUnspecifiedError;
+        }
+
+        for (const AudioStreamRangedDescription &description : available) {
+            AudioStreamBasicDescription format = description.mFormat;
+            bool rateMatches = format.mSampleRate == kAudioStreamAnyRate
+                                   ? description.mSampleRateRange.mMinimum <= sampleRate
+                                         && sampleRate <= description.mSampleRateRange.mMaximum
+                                   : format.mSampleRate == sampleRate;
+
+            if (rateMatches && (format.mFormatFlags & kAudioFormatFlagIsNonMixable)
+                && format.mChannelsPerFrame == currentFormat.mChannelsPerFrame && isUsableIntegerFormat(format)) {
+                format.mSampleRate = sampleRate;
+                candidates[i].push_back(format);
+            }
+        }
+    }
+
+    // Go through the first stream's formats from the most valid bits down, looking for one every other stream has
+    std::vector<AudioStreamBasicDescription> chosen;
+    std::vector<AudioStreamBasicDescription> &firstCandidates = candidates[0];
+    std::stable_sort(firstCandidates.begin(),
+                     firstCandidates.end(),
+                     [](const AudioStreamBasicDescription &a, const AudioStreamBasicDescription &b) {
+                         return a.mBitsPerChannel > b.mBitsPerChannel;
+                     });
+
+    for (const AudioStreamBasicDescription &first : firstCandidates) {
+        chosen.assign(1, first);
+
+        for (size_t i = 1; i < streams.size(); i++) {
+            for (const AudioStreamBasicDescription &format : candidates[i]) {
+                if (haveSameSampleLayout(first, format)) {
+                    chosen.push_back(format);
+                    break;
+                }
+            }
+        }
+
+        if (chosen.size() == streams.size()) {
+            break;
+        }
+
+        chosen.clear();
+    }
+
+    if (chosen.empty()) {
+        syslog(LOG_WARNING, "ProxyAudio: device %u has no integer format all its streams can use", id);
+        return kAudioHardwareUnsupportedOperationError;
+    }
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        // If we've switched this stream before, what it has now is our format rather than the one to restore
+        AudioObjectID stream = streams[i];
+        bool alreadySaved = std::any_of(savedVirtualFormats.begin(),
+                                        savedVirtualFormats.end(),
+                                        [stream](const std::pair<AudioObjectID, AudioStreamBasicDescription> &saved) {
+                                            return saved.first == stream;
+                                        });
+        AudioStreamBasicDescription previousFormat;
+
+        if (!alreadySaved && getVirtualFormat(streams[i], previousFormat)) {
+            savedVirtualFormats.push_back(std::make_pair(streams[i], previousFormat));
+        }
+
+        if (!setVirtualFormat(streams[i], chosen[i])) {
+            syslog(LOG_WARNING,
+                   "ProxyAudio: failed to switch stream %u of device %u to an integer format",
+                   streams[i],
+                   id);
+            restoreVirtualFormats();
+            return kAudioHardwareUnspecifiedError;
+        }
+    }
+
+    outFormat = chosen[0];
+    return noErr;
+}
+
+void AudioDevice::restoreVirtualFormats() {
+    Float64 currentSampleRate = sampleRate;
+    getDoublePropertyData(currentSampleRate,
+                          kAudioDevicePropertyNominalSampleRate,
+                          kAudioObjectPropertyScopeGlobal,
+                          kAudioObjectPropertyElementMaster);
+
+    for (auto &saved : savedVirtualFormats) {
+        // The device's sample rate may have changed since, and putting the old one back would change it again
+        saved.second.mSampleRate = currentSampleRate;
+
+        if (!setVirtualFormat(saved.first, saved.second)) {
+            syslog(LOG_WARNING, "ProxyAudio: failed to restore the format of stream %u of device %u", saved.first, id);
+        }
+    }
+
+    savedVirtualFormats.clear();
+}
+
 void AudioDevice::setBufferFrameSize(UInt32 newBufferFrameSize) {
     AudioObjectPropertyAddress propertyAddress = {kAudioDevicePropertyBufferFrameSize,
                                                   isOutput ? kAudioObjectPropertyScopeOutput
@@ -3,6 +3,7 @@
 
 #include <CoreAudio/CoreAudio.h>
 #include <CoreServices/CoreServices.h>
+#include <utility>
 #include <vector>
 
 class AudioDevice {
@@ -24,6 +25,31 @@ class AudioDevice {
                                    AudioObjectPropertySelector selector,
                                    AudioObjectPropertyScope scope,
                                    AudioObjectPropertyElement element);
+    OSStatus getFloatPropertyData(Float32 &outValue,
+                                  AudioObjectPropertySelector selector,
+                                  AudioObjectPropertyScope scope,
+                                  AudioObjectPropertyElement element);
+    OSStatus setIntegerPropertyData(UInt32 value,
+                                    AudioObjectPropertySelector selector,
+                                    AudioObjectPropertyScope scope,
+                                    AudioObjectPropertyElement element);
+    OSStatus setFloatPropertyData(Float32 value,
+                                  AudioObjectPropertySelector selector,
+                                  AudioObjectPropertyScope scope,
+                                  AudioObjectPropertyElement element);
+    bool isPropertySettable(AudioObjectPropertySelector selector,
+                            AudioObjectPropertyScope scope,
+                            AudioObjectPropertyElement element);
+    OSStatus getStreamChannelCounts(std::vector<UInt32> &outChannelCounts);
+    OSStatus getFirstStreamLatency(UInt32 &outLatency);
+    OSStatus getStreams(std::vector<AudioObjectID> &outStreams);
+    // Switches every stream to a non-mixable signed integer virtual format at the current sample rate, so the IO
+    // proc gets the samples the hardware plays rather than floats, and returns the format the first stream ended up
+    // with. All the streams get the same sample layout, the widest they have in common. If any of them can't be
+    // switched, they're all put back as they were.
+    OSStatus setIntegerVirtualFormat(AudioStreamBasicDescription &outFormat);
+    // Puts back the formats setIntegerVirtualFormat replaced, at the current sample rate
+    void restoreVirtualFormats();
     void setBufferFrameSize(UInt32 bufferFrameSize);
     void setupIOProc(AudioDeviceIOProc inProc, void *clientData);
     void destroyIOProc();
@@ -43,13 +69,22 @@ class AudioDevice {
     AudioObjectID id;
     bool isOutput;
     UInt32 safetyOffset;
+    // The device's own presentation latency, and that of its first stream, in frames
+    UInt32 latency;
+    UInt32 streamLatency;
     UInt32 bufferFrameSize;
     Float64 sampleRate;
+    // Number of channels in each of the buffers the device's IO proc gets, in order
+    std::vector<UInt32> streamChannelCounts;
     AudioDeviceIOProcID procId;
     bool isStarted;
+    // Each stream setIntegerVirtualFormat switched, with the virtual format it had before
+    std::vector<std::pair<AudioObjectID, AudioStreamBasicDescription>> savedVirtualFormats;
 
   protected:
     void initialize();
+    static bool getVirtualFormat(AudioObjectID stream, AudioStreamBasicDescription &outFormat);
+    static bool setVirtualFormat(AudioObjectID stream, const AudioStreamBasicDescription &format);
 };
 
 #endif
@@ -0,0 +1,41 @@
+#ifndef __ProxyAudioShim_CoreAudioTypes_h__
+#define __ProxyAudioShim_CoreAudioTypes_h__
+
+// The few CoreAudio types the real-time core uses, laid out as in the SDK
+
+#include <MacTypes.h>
+
+struct AudioBuffer {
+    UInt32 mNumberChannels;
+    UInt32 mDataByteSize;
+    void *mData;
+};
+
+struct AudioBufferList {
+    UInt32 mNumberBuffers;
+    AudioBuffer mBuffers[1];
+};
+
+struct AudioStreamBasicDescription {
+    Float64 mSampleRate;
+    UInt32 mFormatID;
+    UInt32 mFormatFlags;
+    UInt32 mBytesPerPacket;
+    UInt32 mFramesPerPacket;
+    UInt32 mBytesPerFrame;
+    UInt32 mChannelsPerFrame;
+    UInt32 mBitsPerChannel;
+    UInt32 mReserved;
+};
+
+enum {
+    kAudioFormatFlagIsFloat = (1U << 0),
+    kAudioFormatFlagIsBigEndian = (1U << 1),
+    kAudioFormatFlagIsSignedInteger = (1U << 2),
+    kAudioFormatFlagIsPacked = (1U << 3),
+    kAudioFormatFlagIsAlignedHigh = (1U << 4),
+    kAudioFormatFlagIsNonInterleaved = (1U << 5),
+    kAudioFormatFlagIsNonMixable = (1U << 6)
+};
+
+#endif // __ProxyAudioShim_CoreAudioTypes_h__
@@ -0,0 +1,21 @@
+#ifndef __ProxyAudioShim_MacTypes_h__
+#define __ProxyAudioShim_MacTypes_h__
+
+// Stand-in for the SDK's MacTypes.h, so the real-time core can be built and benchmarked off macOS. The integer
+// types are the same widths as Apple's, and spelled the same way, so printf formats behave the same on both.
+
+typedef unsigned char UInt8;
+typedef signed char SInt8;
+typedef unsigned short UInt16;
+typedef signed short SInt16;
+typedef unsigned int UInt32;
+typedef signed int SInt32;
+typedef unsigned long long UInt64;
+typedef signed long long SInt64;
+typedef float Float32;
+typedef double Float64;
+typedef UInt8 Byte;
+typedef unsigned char Boolean;
+typedef SInt32 OSStatus;
+
+#endif // __ProxyAudioShim_MacTypes_h__
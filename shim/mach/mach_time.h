@@ -0,0 +1,29 @@
+#ifndef __ProxyAudioShim_mach_time_h__
+#define __ProxyAudioShim_mach_time_h__
+
+// mach_absolute_time on top of CLOCK_MONOTONIC, with a timebase of one tick per nanosecond
+
+#include <MacTypes.h>
+#include <time.h>
+
+struct mach_timebase_info {
+    UInt32 numer;
+    UInt32 denom;
+};
+
+typedef struct mach_timebase_info mach_timebase_info_data_t;
+typedef struct mach_timebase_info *mach_timebase_info_t;
+
+static inline int mach_timebase_info(mach_timebase_info_t info) {
+    info->numer = 1;
+    info->denom = 1;
+    return 0;
+}
+
+static inline UInt64 mach_absolute_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return UInt64(now.tv_sec) * 1000000000ULL + UInt64(now.tv_nsec);
+}
+
+#endif // __ProxyAudioShim_mach_time_h__
@@ -0,0 +1,167 @@
+// Checks AudioMixKernels::ConvertToInteger for every integer layout the driver drives output devices with: that the
+// full scale, clipping and NaN handling come out as documented, and that the vector kernel Initialize picks for this
+// CPU writes exactly what the scalar one does, through both its vector loop and its tail.
+
+#include "AudioMixKernels.h"
+#include "TestSupport.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+struct Layout {
+    AudioMixKernels::IntegerFormat format;
+    const char *name;
+};
+
+static const Layout kLayouts[] = {
+    {{2, 16, false, false}, "16 bit"},
+    {{3, 24, false, false}, "24 bit packed"},
+    {{4, 24, false, false}, "24 bit in 32, aligned low"},
+    {{4, 24, true, false}, "24 bit in 32, aligned high"},
+    {{4, 32, false, false}, "32 bit"},
+};
+
+// 41 samples, so a vector kernel does five blocks of eight and leaves one for the tail, with the special values in
+// both
+static std::vector<Float32> TestInput() {
+    const Float32 special[] = {0.0f,
+                               -0.0f,
+                               0.5f,
+                               -0.5f,
+                               1.0f,
+                               -1.0f,
+                               2.0f,
+                               -2.0f,
+                               std::numeric_limits<Float32>::infinity(),
+                               -std::numeric_limits<Float32>::infinity(),
+                               std::numeric_limits<Float32>::quiet_NaN(),
+                               0.99999994f,
+                               1e-9f};
+    std::vector<Float32> input(special, special + sizeof(special) / sizeof(special[0]));
+    UInt32 random = 12345;
+
+    while (input.size() < 40) {
+        random = random * 1664525 + 1013904223;
+        input.push_back(Float32(random >> 8) / 8388608.0f - 1.0f);
+    }
+
+    input.push_back(std::numeric_limits<Float32>::quiet_NaN());
+    return input;
+}
+
+// Reads sample index back as a sign-extended integer, with the valid bits at the bottom
+static SInt64 ReadSample(const std::vector<Byte> &output, UInt32 index, const AudioMixKernels::IntegerFormat &format) {
+    const Byte *sample = output.data() + index * format.bytesPerSample;
+    SInt64 value;
+
+    switch (format.bytesPerSample) {
+    case 2:
+        value = *reinterpret_cast<const SInt16 *>(sample);
+        break;
+    case 3:
+        value = SInt32(UInt32(sample[0]) << 8 | UInt32(sample[1]) << 16 | UInt32(sample[2]) << 24) >> 8;
+        break;
+    default:
+        value = *reinterpret_cast<const SInt32 *>(sample);
+        break;
+    }
+
+    return format.alignedHigh ? value >> (format.bytesPerSample * 8 - format.validBits) : value;
+}
+
+static std::vector<Byte> Convert(const std::vector<Float32> &input, const AudioMixKernels::IntegerFormat &format) {
+    std::vector<Byte> output(input.size() * format.bytesPerSample, 0xaa);
+    UInt32 ditherState[4] = {1, 2, 3, 4};
+    AudioMixKernels::ConvertToInteger(input.data(), output.data(), UInt32(input.size()), format, ditherState);
+    return output;
+}
+
+static void CheckValues(const Layout &layout, const std::vector<Float32> &input, const std::vector<Byte> &output) {
+    const AudioMixKernels::IntegerFormat &format = layout.format;
+    SInt64 maximum = (SInt64(1) << (format.validBits - 1)) - 1;
+    SInt64 minimum = -(SInt64(1) << (format.validBits - 1));
+
+    for (UInt32 i = 0; i < input.size(); i++) {
+        SInt64 value = ReadSample(output, i, format);
+        Float32 x = input[i];
+
+        if (std::isnan(x)) {
+            CHECK_MESSAGE(value == 0, "%s, %s: NaN came out as %lld", layout.name, AudioMixKernels::Name(), value);
+        } else if (x >= 1.0f) {
+            // Past 24 bits the largest float below full scale is a little short of the largest integer
+            CHECK_MESSAGE(maximum - value < 256,
+                          "%s, %s: %g came out as %lld",
+                          layout.name,
+                          AudioMixKernels::Name(),
+                          x,
+                          value);
+        } else if (x <= -1.0f) {
+            CHECK_MESSAGE(value == minimum,
+                          "%s, %s: %g came out as %lld",
+                          layout.name,
+                          AudioMixKernels::Name(),
+                          x,
+                          value);
+        } else {
+            SInt64 expected = SInt64(std::llrint(Float64(x) * Float64(SInt64(1) << (format.validBits - 1))));
+            CHECK_MESSAGE(llabs(value - expected) <= 1,
+                          "%s, %s: %g came out as %lld, not %lld",
+                          layout.name,
+                          AudioMixKernels::Name(),
+                          x,
+                          value,
+                          expected);
+        }
+    }
+}
+
+int main() {
+    std::vector<Float32> input = TestInput();
+    std::vector<std::vector<Byte>> scalarOutputs;
+
+    for (const Layout &layout : kLayouts) {
+        scalarOutputs.push_back(Convert(input, layout.format));
+        CheckValues(layout, input, scalarOutputs.back());
+    }
+
+    AudioMixKernels::Initialize();
+
+    for (size_t i = 0; i < sizeof(kLayouts) / sizeof(kLayouts[0]); i++) {
+        const Layout &layout = kLayouts[i];
+        std::vector<Byte> output = Convert(input, layout.format);
+        CheckValues(layout, input, output);
+
+        for (UInt32 sample = 0; sample < input.size(); sample++) {
+            SInt64 value = ReadSample(output, sample, layout.format);
+            SInt64 scalarValue = ReadSample(scalarOutputs[i], sample, layout.format);
+            CHECK_MESSAGE(value == scalarValue,
+                          "%s: %s wrote %lld for %g, scalar %lld",
+                          layout.name,
+                          AudioMixKernels::Name(),
+                          value,
+                          input[sample],
+                          scalarValue);
+        }
+
+        // Dither moves samples by at most a step either way, and a NaN is still silence
+        AudioMixKernels::IntegerFormat ditheredFormat = layout.format;
+        ditheredFormat.dither = true;
+        std::vector<Byte> dithered = Convert(input, ditheredFormat);
+
+        for (UInt32 sample = 0; sample < input.size(); sample++) {
+            SInt64 value = ReadSample(dithered, sample, layout.format);
+            SInt64 undithered = ReadSample(output, sample, layout.format);
+            CHECK_MESSAGE(llabs(value - undithered) <= 1,
+                          "%s, %s: dithered %g came out as %lld, undithered %lld",
+                          layout.name,
+                          AudioMixKernels::Name(),
+                          input[sample],
+                          value,
+                          undithered);
+        }
+    }
+
+    return TestResult("ConvertToIntegerTest");
+}
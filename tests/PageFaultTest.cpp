@@ -0,0 +1,143 @@
+// Runs the output side of the IO pipeline the way the two IO threads do (store into the ring, fetch into the
+// resampler, mix into the integer converter's scratch buffers, convert, log) and checks that once the buffers are
+// configured and wired, steady-state IO takes no page faults at all, minor or major.
+//
+// The first cycles of any process fault in the code they run, which prefaulting data can't help with, so an
+// identically configured pipeline is run first to page the code in. The pipeline under test has then only had its
+// buffers touched by configuring them.
+
+#include "AudioIntegerConverter.h"
+#include "AudioMixer.h"
+#include "AudioResampler.h"
+#include "AudioRingBuffer.h"
+#include "RealTimeLog.h"
+#include "RealTimeMemory.h"
+#include "TestSupport.h"
+
+#include <sys/resource.h>
+
+static const UInt32 kChannels = 2;
+static const UInt32 kFrames = 512;
+static const UInt32 kCycles = 2000;
+
+struct Pipeline {
+    Pipeline() : ring(kChannels * sizeof(Float32), 65536), outputSamples(kFrames * kChannels, 0) {
+        std::vector<UInt32> bufferChannelCounts(1, kChannels);
+        AudioStreamBasicDescription format = {};
+        format.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
+        format.mBytesPerFrame = kChannels * sizeof(SInt16);
+        format.mChannelsPerFrame = kChannels;
+        format.mBitsPerChannel = 16;
+
+        mixer.Configure(kChannels, std::vector<UInt32>(), bufferChannelCounts);
+        resampler.Configure(kChannels, kFrames);
+        converter.Configure(format, true, bufferChannelCounts, kFrames);
+        input.assign(kFrames * kChannels, 0.25f);
+
+        // The output device's buffer, which the HAL would have ready for us
+        outputList.mNumberBuffers = 1;
+        outputList.mBuffers[0].mNumberChannels = kChannels;
+        outputList.mBuffers[0].mDataByteSize = UInt32(outputSamples.size() * sizeof(SInt16));
+        outputList.mBuffers[0].mData = outputSamples.data();
+
+        Float32 channelGains[kChannels] = {0.5f, 0.75f};
+        gains.Set(channelGains, kChannels);
+    }
+
+    bool Wire() {
+        bool ringWired = ring.Wire();
+        bool resamplerWired = resampler.SetWired(true);
+        bool converterWired = converter.SetWired(true);
+        return ringWired && resamplerWired && converterWired && WireVector(input) && WireVector(outputSamples);
+    }
+
+    void Unwire() {
+        ring.Unwire();
+        resampler.SetWired(false);
+        converter.SetWired(false);
+        UnwireVector(input);
+        UnwireVector(outputSamples);
+    }
+
+    void Cycle(UInt32 cycle) {
+        SInt64 frame = SInt64(cycle) * kFrames;
+        ring.Store((const Byte *)input.data(), kFrames, frame);
+
+        // Read a little over a cycle behind, at a ratio just off 1, as when following drift
+        Float64 ratio = 1.0001;
+        Float64 fraction = 0.5;
+        UInt32 inputFrames = AudioResampler::InputFramesNeeded(fraction, kFrames, ratio);
+        bool overrun = ring.Fetch((Byte *)resampler.InputBuffer(), inputFrames, frame - kFrames - 2);
+        resampler.Process(fraction, ratio, kFrames);
+
+        AudioBufferList *mixBuffers = converter.MixBuffers(kFrames);
+        mixer.Mix(resampler.OutputBuffer(), 0, kFrames, gains, mixBuffers);
+        converter.Convert(&outputList, kFrames);
+
+        if (overrun && cycle > 2) {
+            RTLog(LOG_WARNING, "PageFaultTest: unexpected overrun in cycle %u", cycle);
+        }
+
+        RTLog(LOG_DEBUG, "PageFaultTest: cycle %u at frame %lld", cycle, frame);
+    }
+
+    AudioRingBuffer ring;
+    AudioResampler resampler;
+    AudioMixer mixer;
+    AudioIntegerConverter converter;
+    AudioMixGains gains;
+    RealTimeVector<Float32> input;
+    RealTimeVector<SInt16> outputSamples;
+    AudioBufferList outputList;
+};
+
+static void PageFaults(long &outMinor, long &outMajor) {
+    struct rusage usage;
+#if defined(RUSAGE_THREAD)
+    getrusage(RUSAGE_THREAD, &usage);
+#else
+    getrusage(RUSAGE_SELF, &usage);
+#endif
+    outMinor = usage.ru_minflt;
+    outMajor = usage.ru_majflt;
+}
+
+int main() {
+    AudioMixKernels::Initialize();
+
+    {
+        Pipeline warmUp;
+
+        for (UInt32 cycle = 0; cycle < 16; cycle++) {
+            warmUp.Cycle(cycle);
+        }
+    }
+
+    Pipeline pipeline;
+
+    if (!pipeline.Wire() || !RealTimeLog::Shared().SetWired(true)) {
+        // Not a failure: it's only the locked memory limit, and the buffers are still prefaulted
+        printf("Couldn't lock everything into memory, checking prefaulting alone\n");
+    }
+
+    long minorBefore, majorBefore, minorAfter, majorAfter;
+    PageFaults(minorBefore, majorBefore);
+
+    for (UInt32 cycle = 0; cycle < kCycles; cycle++) {
+        pipeline.Cycle(cycle);
+    }
+
+    PageFaults(minorAfter, majorAfter);
+
+    pipeline.Unwire();
+    RealTimeLog::Shared().SetWired(false);
+
+    printf("%u cycles: %ld minor and %ld major page faults\n",
+           kCycles,
+           minorAfter - minorBefore,
+           majorAfter - majorBefore);
+    CHECK(minorAfter - minorBefore == 0);
+    CHECK(majorAfter - majorBefore == 0);
+
+    return TestResult("PageFaultTest");
+}
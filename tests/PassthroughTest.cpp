@@ -0,0 +1,110 @@
+// At unity gain outputDeviceIOProc copies the input out rather than mixing and resampling it. Checks the pieces that
+// decision is made from: that only all-1 gains count as unity, that AudioMixer::Copy then writes out exactly the
+// bits that came in, that any other gain goes through the mixer and comes out scaled, and that
+// AudioResampler::CanBypass only lets the copy through while there's no drift to correct.
+
+#include "AudioMixer.h"
+#include "AudioResampler.h"
+#include "TestSupport.h"
+
+#include <cstring>
+#include <limits>
+#include <vector>
+
+static const UInt32 kChannels = 2;
+static const UInt32 kFrames = 37;
+
+static std::vector<Float32> TestInput() {
+    const Float32 special[] = {0.0f,
+                               -0.0f,
+                               1.0f,
+                               -1.0f,
+                               std::numeric_limits<Float32>::denorm_min(),
+                               -std::numeric_limits<Float32>::denorm_min(),
+                               std::numeric_limits<Float32>::min() / 3.0f,
+                               0.99999994f};
+    std::vector<Float32> input(special, special + sizeof(special) / sizeof(special[0]));
+    UInt32 random = 54321;
+
+    while (input.size() < kChannels * kFrames) {
+        random = random * 1664525 + 1013904223;
+        input.push_back(Float32(random >> 8) / 8388608.0f - 1.0f);
+    }
+
+    return input;
+}
+
+static AudioMixGains Gains(Float32 left, Float32 right) {
+    Float32 channelGains[kChannels] = {left, right};
+    AudioMixGains gains;
+    gains.Set(channelGains, kChannels);
+    return gains;
+}
+
+// One interleaved buffer with the same number of channels as the input, which the mixer copies straight into
+struct OutputBuffer {
+    OutputBuffer() : samples(kChannels * kFrames, 0.0f) {
+        bufferList.mNumberBuffers = 1;
+        bufferList.mBuffers[0].mNumberChannels = kChannels;
+        bufferList.mBuffers[0].mDataByteSize = UInt32(samples.size() * sizeof(Float32));
+        bufferList.mBuffers[0].mData = samples.data();
+    }
+
+    std::vector<Float32> samples;
+    AudioBufferList bufferList;
+};
+
+int main() {
+    std::vector<Float32> input = TestInput();
+    AudioMixer mixer;
+    mixer.Configure(kChannels, std::vector<UInt32>(), std::vector<UInt32>(1, kChannels));
+    CHECK(mixer.GetLayout() == AudioMixer::Layout::matchingInterleaved);
+
+    // Unity gain: copied out bit for bit, negative zeros and denormals included, in two pieces the way a read
+    // that wraps around the ring buffer hands it over
+    AudioMixGains unityGains = Gains(1.0f, 1.0f);
+    CHECK(unityGains.unity);
+
+    OutputBuffer copied;
+    UInt32 firstPiece = 16;
+    CHECK(mixer.Copy(input.data(), 0, firstPiece, &copied.bufferList));
+    CHECK(mixer.Copy(input.data() + firstPiece * kChannels, firstPiece, kFrames - firstPiece, &copied.bufferList));
+    CHECK_MESSAGE(memcmp(copied.samples.data(), input.data(), input.size() * sizeof(Float32)) == 0,
+                  "copying at unity gain changed the samples");
+
+    // Any other gain, even on one channel, goes through the mixer and comes out scaled
+    const Float32 otherGains[][kChannels] = {{0.5f, 0.5f}, {1.0f, 0.25f}, {0.0f, 1.0f}};
+
+    for (const Float32 *channelGains : otherGains) {
+        AudioMixGains gains = Gains(channelGains[0], channelGains[1]);
+        CHECK_MESSAGE(!gains.unity, "gains %g and %g counted as unity", channelGains[0], channelGains[1]);
+
+        OutputBuffer mixed;
+        mixer.Mix(input.data(), 0, kFrames, gains, &mixed.bufferList);
+
+        for (UInt32 i = 0; i < input.size(); i++) {
+            Float32 expected = input[i] * channelGains[i % kChannels];
+            CHECK_MESSAGE(mixed.samples[i] == expected,
+                          "gains %g and %g: sample %u came out as %g, not %g",
+                          channelGains[0],
+                          channelGains[1],
+                          i,
+                          mixed.samples[i],
+                          expected);
+        }
+    }
+
+    // Copying only starts with no drift to speak of and the read position close to where it should be...
+    CHECK(AudioResampler::CanBypass(1.0, 0.0, false));
+    CHECK(!AudioResampler::CanBypass(1.0 + 10 * AudioResampler::kBypassTolerance, 0.0, false));
+    CHECK(!AudioResampler::CanBypass(1.0 - 10 * AudioResampler::kBypassTolerance, 0.0, false));
+    CHECK(!AudioResampler::CanBypass(1.0, AudioResampler::kMaxBypassError, false));
+
+    // ...then carries on through ratio noise, until the read position has wandered too far
+    CHECK(AudioResampler::CanBypass(1.0 + 10 * AudioResampler::kBypassTolerance, 0.0, true));
+    CHECK(AudioResampler::CanBypass(1.0, 0.9 * AudioResampler::kMaxBypassError, true));
+    CHECK(!AudioResampler::CanBypass(1.0, 1.1 * AudioResampler::kMaxBypassError, true));
+    CHECK(!AudioResampler::CanBypass(1.0, -1.1 * AudioResampler::kMaxBypassError, true));
+
+    return TestResult("PassthroughTest");
+}
@@ -0,0 +1,452 @@
+// Runs the driver's IO pipeline against virtual clocks, so drop-outs and timing regressions can be reproduced
+// without coreaudiod, or a Mac.
+//
+// Two simulated IO threads take turns in host time order. The HAL's runs on the time line ZeroTimeStampClock hands
+// out, converting sample times to host times from the last two zero time stamps the way the HAL does, and stores
+// each cycle into the ring with a time stamp the way DoIOOperation's WriteMix does. The output device's runs on its
+// own crystal, some ppm off the host clock, publishes its time stamps for ZeroTimeStampClock to follow and reads
+// the ring back the way outputDeviceIOProc does: ClockDriftEstimator, FillLevelController and AudioResampler,
+// steering the read position exactly as the driver does. Both threads wake late by a random amount up to the
+// jitter, and the output device's time stamps are off by up to that much either way.
+//
+// Run with no arguments, it checks that at +/-100 ppm with jitter, the zero time stamp period converges to the
+// output device's, the phase between the two time lines settles, the latency holds still, and nothing underruns
+// or overruns. Given options it runs one scenario and prints a report:
+//
+//     PipelineSimulator [--ppm N] [--jitter-us N] [--hal-frames N] [--hal-safety N] [--output-frames N]
+//                       [--output-safety N] [--seconds N] [--latency-budget MS] [--seed N] [--unity-gain 1]
+
+#include "AudioResampler.h"
+#include "AudioRingBuffer.h"
+#include "FillLevelController.h"
+#include "TestSupport.h"
+#include "ZeroTimeStampClock.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const UInt32 kChannels = 2;
+static const Float64 kSampleRate = 48000.0;
+// Host ticks are nanoseconds here, as with a 1/1 mach timebase
+static const Float64 kNominalHostTicksPerFrame = 1e9 / kSampleRate;
+// As in the driver
+static const UInt32 kZeroTimeStampPeriod = UInt32(kSampleRate * 0.1);
+static const UInt32 kMaxExpectedIOBufferFrameSize = 4096;
+
+struct SimulatorConfig {
+    // How fast the output device's crystal runs compared to the host clock
+    Float64 driftPPM = 0;
+    Float64 jitterMicroseconds = 0;
+    UInt32 halBufferFrames = 512;
+    UInt32 halSafetyOffset = 0;
+    UInt32 outputBufferFrames = 512;
+    UInt32 outputSafetyOffset = 0;
+    Float64 seconds = 60;
+    UInt32 latencyBudget = 1000;
+    UInt32 seed = 1;
+    // Whether the output is at unity gain, with every channel going to the output channel with the same number, so
+    // cycles may be copied out untouched
+    bool unityGain = false;
+};
+
+// Everything measured after the first half of the run, once the loops have settled, except for the glitch counts,
+// which cover the whole run
+struct SimulatorReport {
+    UInt32 outputCycles = 0;
+    UInt32 underruns = 0;
+    UInt32 overruns = 0;
+    UInt32 passthroughCycles = 0;
+    UInt32 passthroughStarts = 0;
+    // The furthest a cycle started reading from where the one before left off, in frames. A whole frame is an
+    // audible skip or repeat.
+    Float64 maxReadJumpFrames = 0;
+    // From the host time the HAL gave a frame to when the output device actually played it
+    Float64 latencyMinMs = 0;
+    Float64 latencyMedianMs = 0;
+    Float64 latency999Ms = 0;
+    Float64 latencyMaxMs = 0;
+    // How far the zero time stamps' host ticks per frame were from the output device's, on average and at worst
+    Float64 meanPeriodErrorPPM = 0;
+    Float64 maxPeriodErrorPPM = 0;
+    // How far the HAL's time line moved against the output device's, in frames
+    Float64 phaseWanderFrames = 0;
+};
+
+class PipelineSimulator {
+  public:
+    explicit PipelineSimulator(const SimulatorConfig &config)
+        : mConfig(config),
+          mRandom(config.seed),
+          mRing(kChannels * sizeof(Float32),
+                UInt32(kSampleRate * config.latencyBudget / 1000.0)
+                    + 2 * (kMaxExpectedIOBufferFrameSize + config.outputBufferFrames)),
+          mInput(config.halBufferFrames * kChannels, 0.25f),
+          mOutputHostTicksPerFrame(kNominalHostTicksPerFrame / (1.0 + config.driftPPM * 1e-6)) {
+        mResampler.Configure(kChannels, config.outputBufferFrames);
+    }
+
+    SimulatorReport Run();
+
+  private:
+    Float64 Jitter() { return mConfig.jitterMicroseconds * 1000.0 * (mRandom() / 4294967296.0); }
+    Float64 HALHostTicksPerFrame() const;
+    UInt64 HALHostTime(Float64 sampleTime) const;
+    UInt64 OutputDeviceHostTime(Float64 sampleTime) const {
+        return mOutputStartHostTime + UInt64(sampleTime * mOutputHostTicksPerFrame);
+    }
+    void UpdateZeroTimeStamp(UInt64 hostTime);
+    void HALCycle();
+    void OutputCycle();
+    bool Settled(UInt64 hostTime) const { return hostTime >= mSettledHostTime; }
+
+    SimulatorConfig mConfig;
+    std::mt19937 mRandom;
+    SimulatorReport mReport;
+    UInt64 mSettledHostTime = 0;
+    std::vector<Float64> mLatencies;
+    Float64 mMinPhase = HUGE_VAL;
+    Float64 mMaxPhase = -HUGE_VAL;
+    Float64 mFirstSettledZeroSampleTime = -1;
+    UInt64 mFirstSettledZeroHostTime = 0;
+
+    // The HAL's side
+    ZeroTimeStampClock mClock;
+    Float64 mZeroSampleTimes[2] = {-1, -1};
+    UInt64 mZeroHostTimes[2] = {0, 0};
+    UInt64 mHALCycle = 0;
+    UInt64 mHALWakeHostTime = 0;
+    AudioRingBuffer mRing;
+    std::vector<Float32> mInput;
+    SInt64 mFirstStoredFrame = 0;
+    bool mHaveInputPosition = false;
+    Float64 mLastInputFrameTime = 0;
+    UInt64 mLastInputHostTime = 0;
+
+    // The output device's side
+    Float64 mOutputHostTicksPerFrame;
+    UInt64 mOutputStartHostTime = 0;
+    UInt64 mOutputCycle = 0;
+    UInt64 mOutputWakeHostTime = 0;
+    bool mHaveOutputTimeStamp = false;
+    OutputClockTimeStamp mOutputTimeStamp = {0, 0, 0};
+    Float64 mInputOutputSampleDelta = -1;
+    Float64 mResampledFrameOffset = 0;
+    Float64 mNextReadPosition = -1;
+    bool mPassthrough = false;
+    ClockDriftEstimator mDriftEstimator;
+    FillLevelController mFillLevelController;
+    AudioResampler mResampler;
+};
+
+Float64 PipelineSimulator::HALHostTicksPerFrame() const {
+    if (mZeroSampleTimes[0] < 0) {
+        return kNominalHostTicksPerFrame;
+    }
+
+    return Float64(mZeroHostTimes[1] - mZeroHostTimes[0]) / (mZeroSampleTimes[1] - mZeroSampleTimes[0]);
+}
+
+UInt64 PipelineSimulator::HALHostTime(Float64 sampleTime) const {
+    return UInt64(SInt64(mZeroHostTimes[1]) + SInt64((sampleTime - mZeroSampleTimes[1]) * HALHostTicksPerFrame()));
+}
+
+void PipelineSimulator::UpdateZeroTimeStamp(UInt64 hostTime) {
+    Float64 sampleTime;
+    UInt64 zeroHostTime;
+    mClock.GetZeroTimeStamp(hostTime, mHaveOutputTimeStamp ? &mOutputTimeStamp : NULL, sampleTime, zeroHostTime);
+
+    if (sampleTime == mZeroSampleTimes[1]) {
+        return;
+    }
+
+    mZeroSampleTimes[0] = mZeroSampleTimes[1];
+    mZeroHostTimes[0] = mZeroHostTimes[1];
+    mZeroSampleTimes[1] = sampleTime;
+    mZeroHostTimes[1] = zeroHostTime;
+
+    if (Settled(zeroHostTime) && mZeroSampleTimes[0] >= 0) {
+        Float64 periodError = (HALHostTicksPerFrame() / mOutputHostTicksPerFrame - 1.0) * 1e6;
+        mReport.maxPeriodErrorPPM = std::max(mReport.maxPeriodErrorPPM, std::fabs(periodError));
+
+        if (mFirstSettledZeroSampleTime < 0) {
+            mFirstSettledZeroSampleTime = mZeroSampleTimes[0];
+            mFirstSettledZeroHostTime = mZeroHostTimes[0];
+        }
+
+        // The output device's sample time at the zero time stamp's host time, against the zero time stamp's
+        Float64 phase = sampleTime - Float64(SInt64(zeroHostTime - mOutputStartHostTime)) / mOutputHostTicksPerFrame;
+        mMinPhase = std::min(mMinPhase, phase);
+        mMaxPhase = std::max(mMaxPhase, phase);
+    }
+}
+
+void PipelineSimulator::HALCycle() {
+    UpdateZeroTimeStamp(mHALWakeHostTime);
+
+    // As with the HAL, this cycle's output time is a buffer and the safety offset ahead of when it woke up
+    Float64 outputSampleTime = Float64(mHALCycle * mConfig.halBufferFrames);
+    mRing.Store((const Byte *)mInput.data(), mConfig.halBufferFrames, SInt64(outputSampleTime));
+
+    if (!mHaveInputPosition) {
+        mFirstStoredFrame = SInt64(outputSampleTime);
+    }
+
+    mHaveInputPosition = true;
+    mLastInputFrameTime = outputSampleTime;
+    mLastInputHostTime = HALHostTime(outputSampleTime);
+
+    mHALCycle++;
+    Float64 nextOutputSampleTime = Float64(mHALCycle * mConfig.halBufferFrames);
+    Float64 wakeSampleTime = nextOutputSampleTime - mConfig.halBufferFrames - mConfig.halSafetyOffset;
+    mHALWakeHostTime = std::max(mHALWakeHostTime, HALHostTime(wakeSampleTime) + UInt64(Jitter()));
+}
+
+void PipelineSimulator::OutputCycle() {
+    UInt32 frames = mConfig.outputBufferFrames;
+    Float64 outputSampleTime = Float64(mOutputCycle * frames);
+    UInt64 outputHostTime = OutputDeviceHostTime(outputSampleTime);
+    // The host time the output device reports is off by up to the jitter either way
+    UInt64 reportedHostTime = outputHostTime + UInt64(SInt64(Jitter() - Jitter()));
+
+    mOutputCycle++;
+    Float64 wakeSampleTime = Float64(mOutputCycle * frames) - frames - mConfig.outputSafetyOffset;
+    mOutputWakeHostTime = std::max(mOutputWakeHostTime, OutputDeviceHostTime(wakeSampleTime) + UInt64(Jitter()));
+
+    mOutputTimeStamp.sampleTime = outputSampleTime;
+    mOutputTimeStamp.hostTime = reportedHostTime;
+    mOutputTimeStamp.count++;
+    mHaveOutputTimeStamp = true;
+
+    if (!mHaveInputPosition) {
+        return;
+    }
+
+    // From here on, as in outputDeviceIOProc
+    if (mInputOutputSampleDelta == -1) {
+        Float64 targetFrameTime =
+            mLastInputFrameTime - mConfig.halBufferFrames - frames - mConfig.outputSafetyOffset;
+        mInputOutputSampleDelta = targetFrameTime - outputSampleTime;
+        mResampledFrameOffset = 0;
+        mDriftEstimator.Reset();
+        mFillLevelController.Reset(kSampleRate);
+        mNextReadPosition = -1;
+        mPassthrough = false;
+    }
+
+    mDriftEstimator.Update(mLastInputFrameTime, mLastInputHostTime, outputSampleTime, reportedHostTime);
+    Float64 readPosition = outputSampleTime + mInputOutputSampleDelta + mResampledFrameOffset;
+    Float64 hostTicksSinceLastInput = Float64(SInt64(reportedHostTime - mLastInputHostTime));
+    Float64 inputFrameTimeNow = mLastInputFrameTime + hostTicksSinceLastInput / kNominalHostTicksPerFrame;
+    Float64 ratio = mDriftEstimator.Ratio() + mFillLevelController.Update(inputFrameTimeNow - readPosition, frames);
+    ratio = std::min(std::max(ratio, 1.0 - AudioResampler::kMaxRatioDeviation),
+                     1.0 + AudioResampler::kMaxRatioDeviation);
+    Float64 startFrame = floor(readPosition);
+    bool passthrough = mConfig.unityGain
+                       && AudioResampler::CanBypass(ratio, mFillLevelController.SmoothedError(), mPassthrough);
+
+    if (passthrough && !mPassthrough) {
+        mReport.passthroughStarts++;
+    }
+
+    mPassthrough = passthrough;
+
+    if (passthrough) {
+        Float64 nearestFrame = floor(readPosition + 0.5);
+        mResampledFrameOffset += nearestFrame - readPosition;
+        readPosition = nearestFrame;
+        startFrame = nearestFrame;
+        ratio = 1.0;
+    }
+
+    if (mNextReadPosition >= 0) {
+        mReport.maxReadJumpFrames = std::max(mReport.maxReadJumpFrames, std::fabs(readPosition - mNextReadPosition));
+    }
+
+    mNextReadPosition = readPosition + ratio * frames;
+    Float64 fraction = readPosition - startFrame;
+    // Copying reads exactly the cycle's frames, resampling a frame of history and however many the ratio takes
+    UInt32 inputFrames = passthrough ? frames : AudioResampler::InputFramesNeeded(fraction, frames, ratio);
+    SInt64 firstFrame = passthrough ? SInt64(startFrame) : SInt64(startFrame) - 1;
+
+    if (firstFrame + SInt64(inputFrames) > mRing.EndFrame()) {
+        mReport.underruns++;
+    } else if (firstFrame < mRing.StartFrame() && mRing.StartFrame() > mFirstStoredFrame) {
+        // Reading from before the first input is just the start of IO, as in the driver
+        mReport.overruns++;
+    }
+
+    if (passthrough) {
+        mReport.passthroughCycles++;
+    } else {
+        mRing.Fetch((Byte *)mResampler.InputBuffer(), inputFrames, firstFrame);
+        mResampler.Process(fraction, ratio, frames);
+    }
+
+    mResampledFrameOffset += (ratio - 1.0) * frames;
+    mReport.outputCycles++;
+
+    if (Settled(outputHostTime)) {
+        // When the HAL said the first frame would be played, going by the newest input's time stamp
+        Float64 halHostTime = mLastInputHostTime + (readPosition - mLastInputFrameTime) * HALHostTicksPerFrame();
+        mLatencies.push_back((outputHostTime - halHostTime) / 1e6);
+    }
+}
+
+SimulatorReport PipelineSimulator::Run() {
+    UInt64 endHostTime = UInt64(mConfig.seconds * 1e9);
+    mSettledHostTime = endHostTime / 2;
+
+    // The HAL starts IO, the HAL's first cycle is due a buffer and the safety offset after that, and the output
+    // device is started once it has been
+    mClock.Start(0, kZeroTimeStampPeriod, kSampleRate, kNominalHostTicksPerFrame);
+    UpdateZeroTimeStamp(0);
+    mHALCycle = 1 + (mConfig.halSafetyOffset + mConfig.halBufferFrames - 1) / mConfig.halBufferFrames;
+    mHALWakeHostTime = HALHostTime(Float64(mHALCycle * mConfig.halBufferFrames) - mConfig.halBufferFrames
+                                   - mConfig.halSafetyOffset);
+    mOutputStartHostTime = mHALWakeHostTime + UInt64(0.01 * 1e9);
+    mOutputCycle = 1 + (mConfig.outputSafetyOffset + mConfig.outputBufferFrames - 1) / mConfig.outputBufferFrames;
+    mOutputWakeHostTime = OutputDeviceHostTime(Float64(mOutputCycle * mConfig.outputBufferFrames)
+                                               - mConfig.outputBufferFrames - mConfig.outputSafetyOffset);
+
+    while (std::min(mHALWakeHostTime, mOutputWakeHostTime) < endHostTime) {
+        if (mHALWakeHostTime <= mOutputWakeHostTime) {
+            HALCycle();
+        } else {
+            OutputCycle();
+        }
+    }
+
+    if (!mLatencies.empty()) {
+        std::sort(mLatencies.begin(), mLatencies.end());
+        mReport.latencyMinMs = mLatencies.front();
+        mReport.latencyMedianMs = mLatencies[mLatencies.size() / 2];
+        mReport.latency999Ms = mLatencies[std::min(mLatencies.size() - 1, mLatencies.size() * 999 / 1000)];
+        mReport.latencyMaxMs = mLatencies.back();
+    }
+
+    if (mMaxPhase >= mMinPhase) {
+        Float64 hostTicksPerFrame = Float64(mZeroHostTimes[1] - mFirstSettledZeroHostTime)
+                                    / (mZeroSampleTimes[1] - mFirstSettledZeroSampleTime);
+        mReport.meanPeriodErrorPPM = std::fabs(hostTicksPerFrame / mOutputHostTicksPerFrame - 1.0) * 1e6;
+        mReport.phaseWanderFrames = mMaxPhase - mMinPhase;
+    }
+
+    return mReport;
+}
+
+static void PrintReport(const SimulatorConfig &config, const SimulatorReport &report) {
+    printf("%+.0f ppm, %.0f us jitter, HAL %u+%u frames, output %u+%u frames, %.0f s%s:\n",
+           config.driftPPM,
+           config.jitterMicroseconds,
+           config.halBufferFrames,
+           config.halSafetyOffset,
+           config.outputBufferFrames,
+           config.outputSafetyOffset,
+           config.seconds,
+           config.unityGain ? ", unity gain" : "");
+    printf("    %u output cycles, %u underruns, %u overruns, %u copied untouched in %u runs, read position jumped up "
+           "to %.3f frames\n",
+           report.outputCycles,
+           report.underruns,
+           report.overruns,
+           report.passthroughCycles,
+           report.passthroughStarts,
+           report.maxReadJumpFrames);
+    printf("    latency min %.3f ms, median %.3f ms, 99.9%% %.3f ms, max %.3f ms\n",
+           report.latencyMinMs,
+           report.latencyMedianMs,
+           report.latency999Ms,
+           report.latencyMaxMs);
+    printf("    zero time stamp period error mean %.3f ppm, max %.3f ppm, phase wander %.3f frames\n",
+           report.meanPeriodErrorPPM,
+           report.maxPeriodErrorPPM,
+           report.phaseWanderFrames);
+}
+
+static void CheckScenario(const SimulatorConfig &config) {
+    SimulatorReport report = PipelineSimulator(config).Run();
+    PrintReport(config, report);
+
+    CHECK(report.outputCycles > 0);
+    CHECK_MESSAGE(report.underruns == 0, "%u underruns", report.underruns);
+    CHECK_MESSAGE(report.overruns == 0, "%u overruns", report.overruns);
+    // Copying out untouched may move the read position by up to half a frame when it starts, but drift must
+    // never be made up by skipping or repeating a frame
+    CHECK_MESSAGE(report.maxReadJumpFrames <= 0.5, "read position jumped %.3f frames", report.maxReadJumpFrames);
+    // Uncorrected, 100 ppm would be 100 ppm off, and move the phase 4.8 frames a second. Period to period, the
+    // jitter still gets through a little.
+    CHECK_MESSAGE(report.meanPeriodErrorPPM < 0.5, "period off by %.3f ppm", report.meanPeriodErrorPPM);
+    CHECK_MESSAGE(report.maxPeriodErrorPPM < 20, "period off by up to %.3f ppm", report.maxPeriodErrorPPM);
+    CHECK_MESSAGE(report.phaseWanderFrames < 4, "phase wandered %.3f frames", report.phaseWanderFrames);
+    // Within a frame or so either way of where it settled
+    CHECK_MESSAGE(report.latencyMaxMs - report.latencyMinMs < 0.1,
+                  "latency wandered %.3f ms",
+                  report.latencyMaxMs - report.latencyMinMs);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        SimulatorConfig config;
+
+        for (int i = 1; i + 1 < argc; i += 2) {
+            Float64 value = strtod(argv[i + 1], NULL);
+
+            if (strcmp(argv[i], "--ppm") == 0) {
+                config.driftPPM = value;
+            } else if (strcmp(argv[i], "--jitter-us") == 0) {
+                config.jitterMicroseconds = value;
+            } else if (strcmp(argv[i], "--hal-frames") == 0) {
+                config.halBufferFrames = UInt32(value);
+            } else if (strcmp(argv[i], "--hal-safety") == 0) {
+                config.halSafetyOffset = UInt32(value);
+            } else if (strcmp(argv[i], "--output-frames") == 0) {
+                config.outputBufferFrames = UInt32(value);
+            } else if (strcmp(argv[i], "--output-safety") == 0) {
+                config.outputSafetyOffset = UInt32(value);
+            } else if (strcmp(argv[i], "--seconds") == 0) {
+                config.seconds = value;
+            } else if (strcmp(argv[i], "--latency-budget") == 0) {
+                config.latencyBudget = UInt32(value);
+            } else if (strcmp(argv[i], "--seed") == 0) {
+                config.seed = UInt32(value);
+            } else if (strcmp(argv[i], "--unity-gain") == 0) {
+                config.unityGain = value != 0;
+            } else {
+                fprintf(stderr, "Unknown option %s\n", argv[i]);
+                return 2;
+            }
+        }
+
+        SimulatorReport report = PipelineSimulator(config).Run();
+        PrintReport(config, report);
+        return (report.underruns == 0 && report.overruns == 0) ? 0 : 1;
+    }
+
+    const Float64 drifts[] = {-100, 0, 100};
+
+    for (Float64 drift : drifts) {
+        SimulatorConfig config;
+        config.driftPPM = drift;
+        config.jitterMicroseconds = 200;
+        config.seconds = 120;
+        CheckScenario(config);
+
+        // Small buffers, where the jitter is a good part of a cycle
+        config.halBufferFrames = 64;
+        config.halSafetyOffset = 16;
+        config.outputBufferFrames = 32;
+        config.outputSafetyOffset = 24;
+        config.jitterMicroseconds = 100;
+        CheckScenario(config);
+
+        // Where cycles can be copied out untouched, as long as the drift is corrected
+        config.unityGain = true;
+        CheckScenario(config);
+    }
+
+    return TestResult("PipelineSimulator");
+}
@@ -0,0 +1,198 @@
+// Checks AudioRingBuffer's frame-number semantics, then hammers it from a producer and a consumer thread at once,
+// the way the two IO threads use it. Every sample the producer stores encodes its frame number and channel, so the
+// consumer can tell a correct frame from one the producer was overwriting while it was being read. Fetch must
+// never hand out the latter (it silences them and reports an overrun), and Read must report an overrun whenever it
+// might have.
+//
+// Pass a number of seconds to run the stress part for longer than the default.
+
+#include "AudioRingBuffer.h"
+#include "TestSupport.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+static const UInt32 kChannels = 2;
+static const UInt32 kBytesPerFrame = kChannels * sizeof(Float32);
+
+// Never zero, so it can't be mistaken for a silenced frame, and exact in a float for any frame number we reach
+static Float32 SampleFor(SInt64 frame, UInt32 channel) {
+    return Float32((UInt64(frame) * kChannels + channel) % 16000000 + 1);
+}
+
+static void FillFrames(std::vector<Float32> &samples, SInt64 startFrame, UInt32 frameCount) {
+    samples.resize(frameCount * kChannels);
+
+    for (UInt32 frame = 0; frame < frameCount; frame++) {
+        for (UInt32 channel = 0; channel < kChannels; channel++) {
+            samples[frame * kChannels + channel] = SampleFor(startFrame + frame, channel);
+        }
+    }
+}
+
+// Whether every sample is either right for its frame or, if allowZero, silence
+static bool FramesAreIntact(const Float32 *samples, SInt64 startFrame, UInt32 frameCount, bool allowZero) {
+    for (UInt32 frame = 0; frame < frameCount; frame++) {
+        for (UInt32 channel = 0; channel < kChannels; channel++) {
+            Float32 sample = samples[frame * kChannels + channel];
+
+            if (sample != SampleFor(startFrame + frame, channel) && !(allowZero && sample == 0)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void TestSingleThreaded() {
+    AudioRingBuffer ring(kBytesPerFrame, 1000);
+    std::vector<Float32> in, out(256 * kChannels);
+
+    CHECK(ring.mCapacityFrames == 1024);
+
+    // Round trip, including across the end of the ring
+    FillFrames(in, 1000, 100);
+    CHECK(ring.Store((const Byte *)in.data(), 100, 1000));
+    CHECK(!ring.Fetch((Byte *)out.data(), 100, 1000));
+    CHECK(FramesAreIntact(out.data(), 1000, 100, false));
+
+    // Skipping ahead zeroes the frames in between
+    FillFrames(in, 1200, 50);
+    ring.Store((const Byte *)in.data(), 50, 1200);
+    CHECK(ring.StartFrame() == 1000 && ring.EndFrame() == 1250);
+    CHECK(!ring.Fetch((Byte *)out.data(), 150, 1100));
+
+    for (UInt32 i = 0; i < 100 * kChannels; i++) {
+        CHECK(out[i] == 0);
+    }
+
+    CHECK(FramesAreIntact(out.data() + 100 * kChannels, 1200, 50, false));
+
+    // Frames outside the valid range come back as silence and an overrun
+    CHECK(ring.Fetch((Byte *)out.data(), 100, 1200));
+    CHECK(FramesAreIntact(out.data(), 1200, 50, false));
+    CHECK(out[50 * kChannels] == 0);
+
+    // Writing more than the capacity ahead starts a new range
+    FillFrames(in, 5000, 10);
+    ring.Store((const Byte *)in.data(), 10, 5000);
+    CHECK(ring.StartFrame() == 5000 && ring.EndFrame() == 5010);
+
+    // Wrapping the ring drops the oldest frames out of the valid range
+    for (SInt64 frame = 5010; frame < 5010 + 2048; frame += 256) {
+        FillFrames(in, frame, 256);
+        ring.Store((const Byte *)in.data(), 256, frame);
+    }
+
+    CHECK(ring.EndFrame() - ring.StartFrame() == 1024);
+    CHECK(ring.Fetch((Byte *)out.data(), 10, 5000));
+
+    // Writing over frames that are still valid keeps them valid, with the new data, and the frames after them too.
+    // But a read that was under way while they were rewritten has to report an overrun.
+    SInt64 rewriteFrame = ring.EndFrame() - 100;
+    SInt64 endBeforeRewrite = ring.EndFrame();
+    FillFrames(in, rewriteFrame, 50);
+    bool rewriteOverrun = ring.Read(50, rewriteFrame, [&](const Byte *, UInt32, UInt32) {
+        ring.Store((const Byte *)in.data(), 50, rewriteFrame);
+    });
+    CHECK_MESSAGE(rewriteOverrun, "a read of frames rewritten under it didn't report an overrun");
+    CHECK(ring.EndFrame() == endBeforeRewrite);
+    CHECK(!ring.Fetch((Byte *)out.data(), 100, rewriteFrame));
+    CHECK(FramesAreIntact(out.data(), rewriteFrame, 100, false));
+
+    // So does going back in time, and Clear
+    FillFrames(in, 100, 10);
+    ring.Store((const Byte *)in.data(), 10, 100);
+    CHECK(ring.StartFrame() == 100 && ring.EndFrame() == 110);
+    ring.Clear();
+    CHECK(ring.Fetch((Byte *)out.data(), 10, 100));
+    CHECK(out[0] == 0);
+
+    // Too much for the ring at once is refused
+    std::vector<Float32> tooMuch(2048 * kChannels);
+    CHECK(!ring.Store((const Byte *)tooMuch.data(), 2048, 0));
+}
+
+static void TestTwoThreads(double seconds) {
+    // Small, so the producer laps the consumer often
+    AudioRingBuffer ring(kBytesPerFrame, 1024);
+    std::atomic<bool> done(false);
+    std::atomic<SInt64> producedEnd(0);
+
+    std::thread producer([&] {
+        std::vector<Float32> samples;
+        SInt64 frame = 0;
+        UInt32 step = 0;
+
+        while (!done.load(std::memory_order_relaxed)) {
+            UInt32 frameCount = 1 + (step * 7919) % 300;
+            step++;
+
+            // Now and again skip ahead, jump back in time, or clear, to exercise the gap and restart paths
+            if (step % 1000 == 0) {
+                frame += 97;
+            } else if (step % 4999 == 0) {
+                frame -= 3000;
+            } else if (step % 7001 == 0) {
+                ring.Clear();
+            }
+
+            FillFrames(samples, frame, frameCount);
+            ring.Store((const Byte *)samples.data(), frameCount, frame);
+            frame += frameCount;
+            producedEnd.store(frame, std::memory_order_relaxed);
+        }
+    });
+
+    std::vector<Float32> out(512 * kChannels);
+    UInt64 reads = 0, overruns = 0, corruptFetches = 0, unreportedReads = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        // Read from near the oldest end of the ring, which is where the producer overwrites
+        UInt32 frameCount = 1 + UInt32(reads * 131) % 512;
+        SInt64 startFrame = producedEnd.load(std::memory_order_relaxed) - 1024 + SInt64(reads % 64);
+        reads++;
+
+        if (reads % 2) {
+            bool overrun = ring.Fetch((Byte *)out.data(), frameCount, startFrame);
+            overruns += overrun;
+
+            // Gaps and overwritten frames are silenced, but nothing may ever come back wrong
+            if (!FramesAreIntact(out.data(), startFrame, frameCount, true)) {
+                corruptFetches++;
+            }
+        } else {
+            std::fill(out.begin(), out.end(), 0.0f);
+            bool overrun = ring.Read(frameCount, startFrame, [&](const Byte *span, UInt32 frameOffset, UInt32 spans) {
+                memcpy(out.data() + frameOffset * kChannels, span, spans * kBytesPerFrame);
+            });
+            overruns += overrun;
+
+            // Read can't silence frames that were overwritten under it, but it has to say so
+            if (!overrun && !FramesAreIntact(out.data(), startFrame, frameCount, true)) {
+                unreportedReads++;
+            }
+        }
+    }
+
+    done.store(true);
+    producer.join();
+
+    printf("%llu reads, %llu overruns reported\n", reads, overruns);
+    CHECK_MESSAGE(corruptFetches == 0, "%llu fetches returned overwritten frames", corruptFetches);
+    CHECK_MESSAGE(unreportedReads == 0, "%llu reads saw overwritten frames without reporting it", unreportedReads);
+    CHECK(overruns > 0);
+}
+
+int main(int argc, char **argv) {
+    TestSingleThreaded();
+    TestTwoThreads(argc > 1 ? atof(argv[1]) : 2.0);
+
+    return TestResult("RingBufferStressTest");
+}
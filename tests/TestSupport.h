@@ -0,0 +1,38 @@
+#ifndef __TestSupport_h__
+#define __TestSupport_h__
+
+#include <cstdio>
+
+// The tests are plain executables that ctest runs, and fail by returning nonzero. CHECK reports a failed
+// condition and carries on, so one run shows everything that's wrong.
+
+static int sFailedChecks = 0;
+
+#define CHECK(inCondition)                                                                                             \
+    do {                                                                                                               \
+        if (!(inCondition)) {                                                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #inCondition);                          \
+            sFailedChecks++;                                                                                           \
+        }                                                                                                              \
+    } while (0)
+
+#define CHECK_MESSAGE(inCondition, inFormat, ...)                                                                      \
+    do {                                                                                                               \
+        if (!(inCondition)) {                                                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed: " inFormat "\n", __FILE__, __LINE__, #inCondition,               \
+                    ##__VA_ARGS__);                                                                                    \
+            sFailedChecks++;                                                                                           \
+        }                                                                                                              \
+    } while (0)
+
+static inline int TestResult(const char *testName) {
+    if (sFailedChecks == 0) {
+        printf("%s passed\n", testName);
+        return 0;
+    }
+
+    fprintf(stderr, "%s: %d checks failed\n", testName, sFailedChecks);
+    return 1;
+}
+
+#endif // __TestSupport_h__
@@ -0,0 +1,65 @@
+// In hardwareVolume mode the proxy device's volume and mute are forwarded to the output device's own controls.
+// Checks what VolumeForwarding sets those controls to for one master volume or separate left and right volumes,
+// with and without mute controls, and that what was saved from the device is what gets put back, even when the
+// forwarding that saved it never got to put it back itself.
+
+#include "TestSupport.h"
+#include "VolumeForwarding.h"
+
+#include <cmath>
+
+static bool Near(Float32 a, Float32 b) {
+    return std::fabs(a - b) < 1e-4f;
+}
+
+int main() {
+    const Float32 minDecibels = -60.0f;
+
+    // Full volume is 0 dB, and separate left and right controls keep the balance
+    VolumeForwarding::Settings stereo = VolumeForwarding::Forward(1.0f, 0.1f, false, minDecibels, 2, 2);
+    CHECK(stereo.decibels.size() == 2 && stereo.mutes.size() == 2);
+    CHECK_MESSAGE(Near(stereo.decibels[0], 0.0f) && Near(stereo.decibels[1], -20.0f),
+                  "gains 1 and 0.1 forwarded as %g and %g dB",
+                  stereo.decibels[0],
+                  stereo.decibels[1]);
+    CHECK(stereo.mutes[0] == 0 && stereo.mutes[1] == 0);
+
+    // A single master volume gets the average
+    VolumeForwarding::Settings master = VolumeForwarding::Forward(1.0f, 0.1f, false, minDecibels, 1, 1);
+    CHECK(master.decibels.size() == 1 && master.mutes.size() == 1);
+    CHECK_MESSAGE(Near(master.decibels[0], -10.0f), "master volume forwarded as %g dB", master.decibels[0]);
+
+    // Nothing goes below what the device can do, and zero gain is its lowest volume rather than -inf dB
+    VolumeForwarding::Settings quiet = VolumeForwarding::Forward(1e-6f, 0.0f, false, minDecibels, 2, 0);
+    CHECK(quiet.decibels.size() == 2 && quiet.mutes.empty());
+    CHECK_MESSAGE(quiet.decibels[0] == minDecibels && quiet.decibels[1] == minDecibels,
+                  "quiet volume forwarded as %g and %g dB",
+                  quiet.decibels[0],
+                  quiet.decibels[1]);
+
+    // Silence mutes every mute control and leaves the volume where it is
+    VolumeForwarding::Settings silent = VolumeForwarding::Forward(0.5f, 0.5f, true, minDecibels, 1, 2);
+    CHECK(silent.mutes.size() == 2 && silent.mutes[0] == 1 && silent.mutes[1] == 1);
+    CHECK_MESSAGE(
+        Near(silent.decibels[0], 20.0f * log10f(0.5f)), "muted volume forwarded as %g dB", silent.decibels[0]);
+
+    // Put back what the device had, unless an earlier forwarding saved something for the same controls, in which
+    // case the device only has what that one forwarded
+    VolumeForwarding::Settings current;
+    current.decibels.assign(2, -20.0f);
+    current.mutes.assign(1, 0);
+    VolumeForwarding::Settings none;
+    CHECK(&VolumeForwarding::ToRestore(current, none) == &current);
+
+    VolumeForwarding::Settings saved;
+    saved.decibels.assign(2, -6.0f);
+    saved.mutes.assign(1, 1);
+    CHECK(&VolumeForwarding::ToRestore(current, saved) == &saved);
+
+    VolumeForwarding::Settings savedForMaster;
+    savedForMaster.decibels.assign(1, -6.0f);
+    savedForMaster.mutes.assign(1, 1);
+    CHECK(&VolumeForwarding::ToRestore(current, savedForMaster) == &current);
+
+    return TestResult("VolumeForwardingTest");
+}
@@ -0,0 +1,179 @@
+// The HAL calls GetZeroTimeStamp from whichever thread wants a time stamp. Checks that with several threads calling
+// it at once while the time line moves on, every thread only ever sees whole zero time stamps, that they never go
+// backwards, and that the time line ends up where a single caller would have taken it. Then checks that a caller
+// that comes in while another thread is stuck halfway through moving the time line on doesn't wait for it.
+
+#include "TestSupport.h"
+#include "ZeroTimeStampClock.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+static const UInt32 kPeriod = 4800;
+static const Float64 kHostTicksPerFrame = 1e9 / 48000.0;
+static const UInt32 kThreads = 4;
+// Host ticks the shared host time moves on by per step, a tenth of a period
+static const UInt64 kTicksPerStep = UInt64(kPeriod * kHostTicksPerFrame / 10);
+
+// Set while the updating thread is held in SuspendHandler
+static std::atomic<bool> sSuspended(false);
+
+static void SuspendHandler(int) {
+    sSuspended.store(true);
+
+    while (sSuspended.load()) {
+        sched_yield();
+    }
+}
+
+// Freezes a thread that keeps moving the time line on at random points, which is sometimes in the middle of an
+// update, and checks that a call from another thread still returns while it's frozen
+static void CheckLosersDontWait() {
+    const UInt32 kSuspensions = 500;
+    const auto kTimeout = std::chrono::milliseconds(200);
+    ZeroTimeStampClock clock;
+    clock.Start(0, kPeriod, 48000.0, kHostTicksPerFrame);
+
+    std::atomic<UInt64> hostTime(0);
+    std::atomic<bool> stop(false);
+    struct sigaction action = {};
+    action.sa_handler = SuspendHandler;
+    sigaction(SIGUSR1, &action, NULL);
+
+    std::thread updater([&] {
+        while (!stop.load(std::memory_order_relaxed)) {
+            Float64 sampleTime;
+            UInt64 zeroHostTime;
+            clock.GetZeroTimeStamp(hostTime.fetch_add(kTicksPerStep) + kTicksPerStep, NULL, sampleTime, zeroHostTime);
+        }
+    });
+
+    // Calls GetZeroTimeStamp whenever asked to, so the main thread can give up on it without getting stuck itself
+    std::atomic<UInt32> requested(0), answered(0);
+    std::thread caller([&] {
+        UInt32 handled = 0;
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            if (requested.load() != handled) {
+                Float64 sampleTime;
+                UInt64 zeroHostTime;
+                clock.GetZeroTimeStamp(hostTime.load(), NULL, sampleTime, zeroHostTime);
+                answered.store(++handled);
+            }
+
+            std::this_thread::yield();
+        }
+    });
+
+    UInt32 waits = 0;
+
+    for (UInt32 i = 0; i < kSuspensions && waits == 0; i++) {
+        pthread_kill(updater.native_handle(), SIGUSR1);
+
+        while (!sSuspended.load()) {
+            std::this_thread::yield();
+        }
+
+        requested.store(i + 1);
+        auto deadline = std::chrono::steady_clock::now() + kTimeout;
+
+        while (answered.load() != i + 1 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+
+        if (answered.load() != i + 1) {
+            waits++;
+        }
+
+        sSuspended.store(false);
+
+        // Let it finish now that the updater is going again, and give the updater time to get back into an update
+        while (answered.load() != i + 1) {
+            std::this_thread::yield();
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    stop = true;
+    updater.join();
+    caller.join();
+
+    CHECK_MESSAGE(waits == 0, "a call waited for the thread moving the time line on while it was frozen");
+}
+
+int main(int argc, char **argv) {
+    Float64 seconds = (argc > 1) ? strtod(argv[1], NULL) : 1.0;
+    ZeroTimeStampClock clock;
+    clock.Start(0, kPeriod, 48000.0, kHostTicksPerFrame);
+
+    std::atomic<UInt64> hostTime(0);
+    std::atomic<UInt32> tornStamps(0);
+    std::atomic<UInt32> backwardStamps(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+
+    for (UInt32 i = 0; i < kThreads; i++) {
+        threads.push_back(std::thread([&, i] {
+            Float64 lastSampleTime = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                // The first thread moves the host time on, the rest just keep asking
+                UInt64 now = (i == 0) ? hostTime.fetch_add(kTicksPerStep) + kTicksPerStep : hostTime.load();
+                Float64 sampleTime;
+                UInt64 zeroHostTime;
+                clock.GetZeroTimeStamp(now, NULL, sampleTime, zeroHostTime);
+
+                // Without an output time stamp the rate stays nominal, so the host time follows from the sample time
+                UInt64 expectedHostTime = UInt64(sampleTime / kPeriod * (kPeriod * kHostTicksPerFrame));
+
+                if (std::fmod(sampleTime, kPeriod) != 0 || std::abs(SInt64(zeroHostTime - expectedHostTime)) > 1) {
+                    tornStamps++;
+                }
+
+                if (sampleTime < lastSampleTime) {
+                    backwardStamps++;
+                }
+
+                lastSampleTime = sampleTime;
+            }
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<Float64>(seconds));
+    stop = true;
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    CHECK_MESSAGE(tornStamps == 0, "%u torn time stamps", tornStamps.load());
+    CHECK_MESSAGE(backwardStamps == 0, "%u time stamps went backwards", backwardStamps.load());
+
+    // Once nobody else is calling it, it catches up one zero time stamp per call
+    Float64 sampleTime = -1;
+    Float64 lastSampleTime;
+    UInt64 zeroHostTime;
+
+    do {
+        lastSampleTime = sampleTime;
+        clock.GetZeroTimeStamp(hostTime.load(), NULL, sampleTime, zeroHostTime);
+    } while (sampleTime != lastSampleTime);
+
+    Float64 expectedSampleTime = std::floor(hostTime.load() / (kPeriod * kHostTicksPerFrame)) * kPeriod;
+    CHECK_MESSAGE(std::fabs(sampleTime - expectedSampleTime) <= kPeriod,
+                  "ended at %.0f, expected %.0f",
+                  sampleTime,
+                  expectedSampleTime);
+
+    CheckLosersDontWait();
+
+    return TestResult("ZeroTimeStampClockTest");
+}